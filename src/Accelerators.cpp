@@ -1,175 +1,1150 @@
+#include <algorithm>
 #include <cstring>
 
+#include "BVH.hpp"
+#include "Mesh.hpp"
 #include "Primitive.hpp"
 #include "Threading.hpp"
+
+uint32_t IntersectionAccelerator::intersectPacket(RayPacket &packet, uint32_t active, float tMin, Intersection *hits) {
+    uint32_t hitMask = 0;
+    for (uint32_t mask = active; mask; mask &= mask - 1) {
+        const int lane = lowestBit(mask);
+        if (intersect(packet.getRay(lane), tMin, packet.tMax[lane], hits[lane])) {
+            packet.tMax[lane] = hits[lane].t;
+            hitMask |= 1u << lane;
+        }
+    }
+    return hitMask;
+}
+
+bool IntersectionAccelerator::occluded(const Ray &ray, float tMin, float tMax) {
+    Intersection intersection;
+    return intersect(ray, tMin, tMax, intersection);
+}
+
+/// Oct tree flattened in a single node array, the primitives of all leaves are contiguous ranges of one index array
+/// Rays visit the children of a node front to back and skip the ones behind the closest hit, primitives that overlap
+/// several leaves are tested once per ray with a mailbox
+template <typename Prim>
 struct OctTree : IntersectionAccelerator {
+    static const uint32_t INTERIOR = UINT32_MAX;
+
+    /// Node of the tree, the 8 children of an interior node are next to each other in @nodes
     struct Node {
         BBox box;
-        Node *children[8] = {
-            nullptr,
-        };
-        std::vector<Intersectable *> primitives;
+        uint32_t offset = 0;  ///< First child for interior nodes, first entry in @primitiveIndices for leaves
+        uint32_t count = 0;  ///< Number of primitives for leaves, INTERIOR for interior nodes
+
         bool isLeaf() const {
-            return children[0] == nullptr;
+            return count != INTERIOR;
         }
     };
 
-    std::vector<Intersectable *> allPrimitives;
-    Node *root = nullptr;
-    int depth = 0;
-    int leafSize = 0;
-    int nodes = 0;
-    int MAX_DEPTH = 35;
-    int MIN_PRIMITIVES = 10;
+    /// Counters of a build, each thread counts its own subtrees
+    struct BuildStats {
+        int nodes = 0;
+        int depth = 0;
+        int leafSize = 0;
 
-    void clear(Node *n) {
-        if (!n) {
-            return;
+        void add(const BuildStats &other) {
+            nodes += other.nodes;
+            depth = std::max(depth, other.depth);
+            leafSize = std::max(leafSize, other.leafSize);
         }
+    };
 
-        for (int c = 0; c < 8; c++) {
-            clear(n->children[c]);
-            delete n->children[c];
+    /// Part of the tree built by one thread, with child and primitive offsets relative to it
+    struct Subtree {
+        std::vector<Node> nodes;
+        std::vector<uint32_t> primitiveIndices;
+        std::vector<uint32_t> primitives;  ///< Primitives overlapping the root, moved to the leaves by the build
+        uint32_t topNode = 0;  ///< Node of the top of the tree that the root of the subtree replaces
+        BuildStats stats;
+    };
+
+    /// Node still to be visited by a ray, with the part of the ray inside it
+    struct Todo {
+        uint32_t node;
+        float tMin, tMax;
+    };
+
+    /// Small direct mapped cache of the primitives a ray already tested, a primitive evicted by another one with the
+    /// same low bits is only tested again
+    struct Mailbox {
+        static const int SIZE = 32;
+        uint32_t tested[SIZE];
+
+        Mailbox() {
+            memset(tested, 0xff, sizeof(tested));
         }
-    }
+
+        /// @brief Check if @primitive was already tested and mark it as tested
+        bool testAndSet(uint32_t primitive) {
+            uint32_t &slot = tested[primitive & (SIZE - 1)];
+            if (slot == primitive) {
+                return true;
+            }
+            slot = primitive;
+            return false;
+        }
+    };
+
+    /// Nodes at this depth are built as separate subtrees by one thread when building with threads
+    static const int PARALLEL_DEPTH = 2;
+    static const int DEPTH_LIMIT = 35;
+    /// Each interior node on the stack is replaced by at most 8 children
+    static const int TODO_SIZE = DEPTH_LIMIT * 7 + 1;
+
+    std::vector<Prim *> allPrimitives;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> primitiveIndices;
+    int depth = 0;
+    int leafSize = 0;
+    int MAX_DEPTH = DEPTH_LIMIT;
+    int MIN_PRIMITIVES = 10;
 
     void clear() {
-        clear(root);
+        nodes.clear();
+        primitiveIndices.clear();
         allPrimitives.clear();
     }
 
     void addPrimitive(Intersectable *prim) override {
-        allPrimitives.push_back(prim);
+        allPrimitives.push_back(static_cast<Prim *>(prim));
     }
 
-    void build(Node *n, int currentDepth = 0) {
-        if (currentDepth >= MAX_DEPTH || n->primitives.size() <= MIN_PRIMITIVES) {
-            leafSize = std::max(leafSize, int(n->primitives.size()));
+    /// @brief Split the node recursively
+    /// @param tree - the part of the tree the node is in
+    /// @param nodeIndex - index of the node in @tree, its box must be set
+    /// @param primitives - the primitives overlapping the node, released once they are moved to the children
+    /// @param threads - if not nullptr the children are filled in parallel and nodes at PARALLEL_DEPTH are added
+    ///                  to @deferred instead of being split
+    void build(Subtree &tree,
+               uint32_t nodeIndex,
+               std::vector<uint32_t> &primitives,
+               int currentDepth,
+               ThreadManager *threads,
+               std::vector<Subtree> *deferred) {
+        if (currentDepth >= MAX_DEPTH || primitives.size() <= MIN_PRIMITIVES) {
+            Node &leaf = tree.nodes[nodeIndex];
+            leaf.offset = uint32_t(tree.primitiveIndices.size());
+            leaf.count = uint32_t(primitives.size());
+            tree.primitiveIndices.insert(tree.primitiveIndices.end(), primitives.begin(), primitives.end());
+            tree.stats.leafSize = std::max(tree.stats.leafSize, int(primitives.size()));
+            return;
+        }
+        if (threads && currentDepth == PARALLEL_DEPTH) {
+            deferred->emplace_back();
+            Subtree &subtree = deferred->back();
+            subtree.nodes.push_back(tree.nodes[nodeIndex]);
+            subtree.primitives.swap(primitives);
+            subtree.topNode = nodeIndex;
             return;
         }
 
-        depth = std::max(depth, currentDepth);
+        tree.stats.depth = std::max(tree.stats.depth, currentDepth);
         BBox childBoxes[8];
-        n->box.octSplit(childBoxes);
+        tree.nodes[nodeIndex].box.octSplit(childBoxes);
 
-        for (int c = 0; c < 8; c++) {
-            Node *&child = n->children[c];
-            child = new Node;
-            nodes++;
-            memset(child->children, 0, sizeof(child->children));
-            child->box = childBoxes[c];
-            for (int r = 0; r < n->primitives.size(); r++) {
-                if (n->primitives[r]->boxIntersect(child->box)) {
-                    child->primitives.push_back(n->primitives[r]);
-                }
-            }
-            if (child->primitives.size() == n->primitives.size()) {
-                build(child, MAX_DEPTH + 1);
-            } else {
-                build(child, currentDepth + 1);
+        std::vector<uint32_t> childPrimitives[8];
+        parallelFor(threads, 8, [&](int c, int) {
+            for (const uint32_t prim : primitives) {
+                if (allPrimitives[prim]->boxIntersect(childBoxes[c])) {
+                    childPrimitives[c].push_back(prim);
+                }
             }
+        });
+        const size_t parentCount = primitives.size();
+        std::vector<uint32_t>().swap(primitives);
+
+        const uint32_t firstChild = uint32_t(tree.nodes.size());
+        tree.nodes[nodeIndex].offset = firstChild;
+        tree.nodes[nodeIndex].count = INTERIOR;
+        tree.nodes.resize(firstChild + 8);
+        for (int c = 0; c < 8; c++) {
+            tree.nodes[firstChild + c].box = childBoxes[c];
+        }
+        tree.stats.nodes += 8;
+
+        for (int c = 0; c < 8; c++) {
+            // splitting a child with all primitives of its parent would not separate any of them
+            const int childDepth = childPrimitives[c].size() == parentCount ? MAX_DEPTH + 1 : currentDepth + 1;
+            build(tree, firstChild + c, childPrimitives[c], childDepth, threads, deferred);
         }
-        n->primitives.clear();
     }
 
-    void build(Purpose purpose) override {
+    void build(Purpose purpose, ThreadManager *threads) override {
         const char *treePurpose = "";
         if (purpose == Purpose::Instances) {
             MAX_DEPTH = 5;
             MIN_PRIMITIVES = 4;
             treePurpose = " instances";
         } else if (purpose == Purpose::Mesh) {
-            MAX_DEPTH = 35;
+            MAX_DEPTH = DEPTH_LIMIT;
             MIN_PRIMITIVES = 20;
             treePurpose = " mesh";
         }
 
-        if (root) {
-            clear(root);
-            delete root;
+        const int primitiveCount = int(allPrimitives.size());
+        Timer timer;
+        Subtree top;
+        top.nodes.resize(1);
+        top.primitives.resize(primitiveCount);
+        for (int c = 0; c < primitiveCount; c++) {
+            top.primitives[c] = uint32_t(c);
+            allPrimitives[c]->expandBox(top.nodes[0].box);
         }
 
-        printf("Building%s oct tree with %d primitives... ", treePurpose, int(allPrimitives.size()));
-        Timer timer;
-        nodes = leafSize = depth = 0;
-        root = new Node();
-        root->primitives.swap(allPrimitives);
-        for (int c = 0; c < root->primitives.size(); c++) {
-            root->primitives[c]->expandBox(root->box);
-        }
-        build(root);
-        printf(" done in %ldms, nodes %d, depth %d, %d leaf size\n",
+        // split the top levels with all threads filling the children, then build the subtrees below in parallel
+        std::vector<Subtree> deferred;
+        build(top, 0, top.primitives, 0, threads, &deferred);
+        parallelFor(threads, int(deferred.size()), [&](int c, int) {
+            build(deferred[c], 0, deferred[c].primitives, PARALLEL_DEPTH, nullptr, nullptr);
+        });
+
+        // append the subtrees after the top, the root of each one takes the place of its deferred node
+        nodes.swap(top.nodes);
+        primitiveIndices.swap(top.primitiveIndices);
+        BuildStats stats = top.stats;
+        for (Subtree &subtree : deferred) {
+            const uint32_t nodeBase = uint32_t(nodes.size()) - 1;
+            const uint32_t primitiveBase = uint32_t(primitiveIndices.size());
+            for (Node &node : subtree.nodes) {
+                node.offset += node.isLeaf() ? primitiveBase : nodeBase;
+            }
+            nodes[subtree.topNode] = subtree.nodes[0];
+            nodes.insert(nodes.end(), subtree.nodes.begin() + 1, subtree.nodes.end());
+            primitiveIndices.insert(
+                primitiveIndices.end(), subtree.primitiveIndices.begin(), subtree.primitiveIndices.end());
+            stats.add(subtree.stats);
+        }
+        nodes.shrink_to_fit();
+        primitiveIndices.shrink_to_fit();
+        depth = stats.depth;
+        leafSize = stats.leafSize;
+        printf("Built%s oct tree with %d primitives in %ldms, nodes %d, depth %d, %d leaf size, %gKB\n",
+               treePurpose,
+               primitiveCount,
                timer.toMs(timer.elapsedNs()),
-               nodes,
+               int(nodes.size()),
                depth,
-               leafSize);
+               leafSize,
+               (nodes.size() * sizeof(Node) + primitiveIndices.size() * sizeof(uint32_t)) / 1024.f);
     }
 
-    bool intersect(Node *n, const Ray &ray, float tMin, float &tMax, Intersection &intersection) {
-        bool hasHit = false;
+    /// @brief Push the children of @node that the ray reaches inside (tMin, tMax) on the stack
+    /// @param sorted - push them farthest first, so they are popped in the order the ray enters them
+    void pushChildren(const Node &node,
+                      const Ray &ray,
+                      float tMin,
+                      float tMax,
+                      bool sorted,
+                      Todo *todo,
+                      int &todoSize) const {
+        Todo children[8];
+        int count = 0;
+        for (uint32_t c = 0; c < 8; c++) {
+            const Node &child = nodes[node.offset + c];
+            float childMin = tMin, childMax = tMax;
+            if (child.count != 0 && child.box.clipRay(ray, childMin, childMax)) {
+                children[count++] = {node.offset + c, childMin, childMax};
+            }
+        }
+        if (sorted) {
+            for (int c = 1; c < count; c++) {
+                const Todo child = children[c];
+                int insert = c;
+                for (; insert > 0 && children[insert - 1].tMin < child.tMin; insert--) {
+                    children[insert] = children[insert - 1];
+                }
+                children[insert] = child;
+            }
+        }
+        memcpy(todo + todoSize, children, count * sizeof(Todo));
+        todoSize += count;
+    }
 
-        if (n->isLeaf()) {
-            for (int c = 0; c < n->primitives.size(); c++) {
-                if (n->primitives[c]->intersect(ray, tMin, tMax, intersection)) {
+    bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override {
+        Todo todo[TODO_SIZE];
+        int todoSize = 0;
+        float rootMin = tMin, rootMax = tMax;
+        if (nodes[0].box.clipRay(ray, rootMin, rootMax)) {
+            todo[todoSize++] = {0, rootMin, rootMax};
+        }
+
+        Mailbox mailbox;
+        bool hasHit = false;
+        while (todoSize > 0) {
+            const Todo current = todo[--todoSize];
+            // nodes are disjoint and popped front to back, so all the rest are behind this one
+            if (current.tMin > tMax) {
+                break;
+            }
+            COUNT_NODE_FETCH();
+            const Node &node = nodes[current.node];
+            if (!node.isLeaf()) {
+                pushChildren(node, ray, current.tMin, std::min(current.tMax, tMax), true, todo, todoSize);
+                continue;
+            }
+            for (uint32_t c = 0; c < node.count; c++) {
+                const uint32_t prim = primitiveIndices[node.offset + c];
+                if (!mailbox.testAndSet(prim) && allPrimitives[prim]->intersect(ray, tMin, tMax, intersection)) {
                     tMax = intersection.t;
                     hasHit = true;
                 }
             }
+        }
+        return hasHit;
+    }
+
+    bool occluded(const Ray &ray, float tMin, float tMax) override {
+        Todo todo[TODO_SIZE];
+        int todoSize = 0;
+        float rootMin = tMin, rootMax = tMax;
+        if (nodes[0].box.clipRay(ray, rootMin, rootMax)) {
+            todo[todoSize++] = {0, rootMin, rootMax};
+        }
+
+        Mailbox mailbox;
+        while (todoSize > 0) {
+            const Todo current = todo[--todoSize];
+            COUNT_NODE_FETCH();
+            const Node &node = nodes[current.node];
+            if (!node.isLeaf()) {
+                // any hit is enough, so the order the children are visited in does not matter
+                pushChildren(node, ray, current.tMin, current.tMax, false, todo, todoSize);
+                continue;
+            }
+            for (uint32_t c = 0; c < node.count; c++) {
+                const uint32_t prim = primitiveIndices[node.offset + c];
+                if (!mailbox.testAndSet(prim) && allPrimitives[prim]->occluded(ray, tMin, tMax)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool isBuilt() const override {
+        return !nodes.empty();
+    }
+
+    ~OctTree() override {
+        clear();
+    }
+};
+
+/// KD-tree with SAH split planes found by sweeping presorted events, which makes the build O(N log N)
+/// source: "On building fast kd-Trees for Ray Tracing, and on doing that in O(N log N)", Wald, Havran 2006
+template <typename Prim>
+struct KDTree : IntersectionAccelerator {
+    /// Node of the tree, 8 bytes for both interior nodes and leaves
+    /// Interior nodes are followed by their below child, only the index of the above child is stored
+    struct Node {
+        union {
+            float split;  ///< Position of the split plane for interior nodes
+            uint32_t onePrimitive;  ///< The primitive for leaves with exactly one primitive
+            uint32_t primitiveOffset;  ///< Offset in @primitiveIndices for leaves with more primitives
+        };
+        uint32_t flags;  ///< Low 2 bits are the split axis or 3 for leaves, the rest is the above child or count
+
+        void initLeaf(uint32_t count, uint32_t first) {
+            flags = 3 | (count << 2);
+            primitiveOffset = first;
+        }
+
+        void initInterior(int axis, uint32_t aboveChild, float splitPos) {
+            split = splitPos;
+            flags = uint32_t(axis) | (aboveChild << 2);
+        }
+
+        bool isLeaf() const {
+            return (flags & 3) == 3;
+        }
+
+        int axis() const {
+            return flags & 3;
+        }
+
+        uint32_t primitiveCount() const {
+            return flags >> 2;
+        }
+
+        uint32_t aboveChild() const {
+            return flags >> 2;
+        }
+    };
+
+    static_assert(sizeof(Node) == 8, "KDTree::Node must be 8 bytes");
+
+    /// Start or end of a primitive's box along an axis, planar for boxes flat along that axis
+    struct Event {
+        enum Type : uint8_t { End = 0, Planar = 1, Start = 2 };
+        float pos;
+        uint32_t primitive;
+        uint8_t axis;
+        Type type;
+
+        bool operator<(const Event &other) const {
+            if (axis != other.axis) {
+                return axis < other.axis;
+            }
+            if (pos != other.pos) {
+                return pos < other.pos;
+            }
+            return type < other.type;
+        }
+    };
+
+    /// Where a primitive goes after splitting a node
+    enum class Side : uint8_t { Both, LeftOnly, RightOnly };
+
+    /// Part of the tree built by one thread, with child and primitive offsets relative to it
+    struct Subtree {
+        std::vector<Event> events;
+        BBox voxel;
+        int count = 0;
+        int startDepth = 0;
+        bool isTop = false;  ///< The top is built on the calling thread and defers big enough nodes as subtrees
+
+        std::vector<Node> nodes;
+        std::vector<uint32_t> primitiveIndices;
+        int depth = 0;
+        int leafSize = 0;
+    };
+
+    /// Nodes with fewer primitives are built as a separate subtree by one thread when building with threads
+    static constexpr int MIN_SUBTREE_SIZE = 1 << 10;
+
+    std::vector<Prim *> allPrimitives;
+    std::vector<BBox> primitiveBoxes;
+    std::vector<Subtree> subtrees;  ///< Subtrees left to build after the top of the tree is done
+    std::vector<int> topSubtree;  ///< Index in @subtrees for placeholder nodes in the top tree, -1 for the rest
+    int subtreeSize = 0;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> primitiveIndices;
+    BBox bounds;
+    int depth = 0;
+    int leafSize = 0;
+    int MAX_DEPTH = 0;
+    float TRAVERSAL_COST = 1.f;
+    float INTERSECT_COST = 1.5f;
+    float EMPTY_BONUS = 0.2f;
+
+    void addPrimitive(Intersectable *prim) override {
+        allPrimitives.push_back(static_cast<Prim *>(prim));
+    }
+
+    void clear() override {
+        allPrimitives.clear();
+        nodes.clear();
+        primitiveIndices.clear();
+        bounds = BBox{};
+    }
+
+    /// @brief Add the events for a primitive box clipped to a voxel
+    static void addEvents(std::vector<Event> &events, uint32_t prim, const BBox &box) {
+        for (int axis = 0; axis < 3; axis++) {
+            if (box.min[axis] == box.max[axis]) {
+                events.push_back({box.min[axis], prim, uint8_t(axis), Event::Planar});
+            } else {
+                events.push_back({box.min[axis], prim, uint8_t(axis), Event::Start});
+                events.push_back({box.max[axis], prim, uint8_t(axis), Event::End});
+            }
+        }
+    }
+
+    /// @brief Compute the SAH cost for splitting @voxel with a plane, planar primitives are in left or right side
+    /// @param planarLeft [out] - true if the cost is lower with planar primitives on the left side
+    float splitCost(const BBox &voxel, int axis, float pos, int left, int right, int planar, bool &planarLeft) const {
+        BBox leftBox = voxel, rightBox = voxel;
+        leftBox.max[axis] = pos;
+        rightBox.min[axis] = pos;
+        const float invArea = 1.f / voxel.surfaceArea();
+        const float leftProb = leftBox.surfaceArea() * invArea;
+        const float rightProb = rightBox.surfaceArea() * invArea;
+        const auto cost = [&](int nLeft, int nRight) {
+            const float bonus = (nLeft == 0 || nRight == 0) ? 1.f - EMPTY_BONUS : 1.f;
+            return bonus * (TRAVERSAL_COST + INTERSECT_COST * (leftProb * nLeft + rightProb * nRight));
+        };
+        const float costLeft = cost(left + planar, right);
+        const float costRight = cost(left, right + planar);
+        planarLeft = costLeft < costRight;
+        return planarLeft ? costLeft : costRight;
+    }
+
+    /// @brief Build the node for the primitives with @events in @voxel and its children into @tree
+    /// @param classification - scratch space with an element for each primitive, one for each thread
+    void build(Subtree &tree,
+               std::vector<Side> &classification,
+               const std::vector<Event> &events,
+               const BBox &voxel,
+               int count,
+               int currentDepth) {
+        std::vector<Node> &nodes = tree.nodes;
+        tree.depth = std::max(tree.depth, currentDepth);
+        const uint32_t nodeIndex = uint32_t(nodes.size());
+        nodes.emplace_back();
+        if (tree.isTop) {
+            topSubtree.push_back(-1);
+            if (count < subtreeSize) {
+                // placeholder for a subtree built later by one thread
+                topSubtree[nodeIndex] = int(subtrees.size());
+                subtrees.emplace_back();
+                subtrees.back().events = events;
+                subtrees.back().voxel = voxel;
+                subtrees.back().count = count;
+                subtrees.back().startDepth = currentDepth;
+                return;
+            }
+        }
+
+        const auto makeLeaf = [&]() {
+            tree.leafSize = std::max(tree.leafSize, count);
+            if (count == 1) {
+                nodes[nodeIndex].initLeaf(1, events[0].primitive);
+                return;
+            }
+            nodes[nodeIndex].initLeaf(count, uint32_t(tree.primitiveIndices.size()));
+            for (const Event &e : events) {
+                if (e.axis == 0 && e.type != Event::End) {
+                    tree.primitiveIndices.push_back(e.primitive);
+                }
+            }
+        };
+
+        if (count <= 1 || currentDepth >= MAX_DEPTH) {
+            makeLeaf();
+            return;
+        }
+
+        // sweep over the events of each axis counting the primitives left, right and on each candidate plane
+        float bestCost = FLT_MAX;
+        int bestAxis = -1;
+        float bestPos = 0.f;
+        bool bestPlanarLeft = false;
+        for (int c = 0; c < int(events.size());) {
+            const int axis = events[c].axis;
+            int left = 0, right = count;
+            while (c < int(events.size()) && events[c].axis == axis) {
+                const float pos = events[c].pos;
+                int ending = 0, planar = 0, starting = 0;
+                for (; c < int(events.size()) && events[c].axis == axis && events[c].pos == pos; c++) {
+                    if (events[c].type == Event::End) {
+                        ending++;
+                    } else if (events[c].type == Event::Planar) {
+                        planar++;
+                    } else {
+                        starting++;
+                    }
+                }
+                right -= planar + ending;
+                if (pos > voxel.min[axis] && pos < voxel.max[axis]) {
+                    bool planarLeft;
+                    const float cost = splitCost(voxel, axis, pos, left, right, planar, planarLeft);
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        bestAxis = axis;
+                        bestPos = pos;
+                        bestPlanarLeft = planarLeft;
+                    }
+                }
+                left += starting + planar;
+            }
+        }
+
+        if (bestAxis == -1 || bestCost > INTERSECT_COST * count) {
+            makeLeaf();
+            return;
+        }
+
+        // classify primitives, the ones with no events on the far side of the plane go to a single child
+        for (const Event &e : events) {
+            classification[e.primitive] = Side::Both;
+        }
+        for (const Event &e : events) {
+            if (e.axis != bestAxis) {
+                continue;
+            }
+            if (e.type == Event::End && e.pos <= bestPos) {
+                classification[e.primitive] = Side::LeftOnly;
+            } else if (e.type == Event::Start && e.pos >= bestPos) {
+                classification[e.primitive] = Side::RightOnly;
+            } else if (e.type == Event::Planar) {
+                if (e.pos < bestPos || (e.pos == bestPos && bestPlanarLeft)) {
+                    classification[e.primitive] = Side::LeftOnly;
+                } else {
+                    classification[e.primitive] = Side::RightOnly;
+                }
+            }
+        }
+
+        BBox leftVoxel = voxel, rightVoxel = voxel;
+        leftVoxel.max[bestAxis] = bestPos;
+        rightVoxel.min[bestAxis] = bestPos;
+
+        // events of single side primitives stay sorted, the straddling ones get new clipped events
+        std::vector<Event> leftOnly, rightOnly, bothLeft, bothRight;
+        int leftCount = 0, rightCount = 0;
+        for (const Event &e : events) {
+            const Side side = classification[e.primitive];
+            if (side == Side::LeftOnly) {
+                leftOnly.push_back(e);
+            } else if (side == Side::RightOnly) {
+                rightOnly.push_back(e);
+            }
+            // each primitive has exactly one start or planar event on the split axis
+            if (e.axis != bestAxis || e.type == Event::End) {
+                continue;
+            }
+            if (side == Side::LeftOnly) {
+                leftCount++;
+            } else if (side == Side::RightOnly) {
+                rightCount++;
+            } else {
+                const BBox &box = primitiveBoxes[e.primitive];
+                addEvents(bothLeft, e.primitive, BBox{::max(box.min, leftVoxel.min), ::min(box.max, leftVoxel.max)});
+                addEvents(bothRight, e.primitive, BBox{::max(box.min, rightVoxel.min), ::min(box.max, rightVoxel.max)});
+                leftCount++;
+                rightCount++;
+            }
+        }
+
+        std::sort(bothLeft.begin(), bothLeft.end());
+        std::sort(bothRight.begin(), bothRight.end());
+        std::vector<Event> leftEvents(leftOnly.size() + bothLeft.size());
+        std::merge(leftOnly.begin(), leftOnly.end(), bothLeft.begin(), bothLeft.end(), leftEvents.begin());
+        std::vector<Event> rightEvents(rightOnly.size() + bothRight.size());
+        std::merge(rightOnly.begin(), rightOnly.end(), bothRight.begin(), bothRight.end(), rightEvents.begin());
+        std::vector<Event>().swap(leftOnly);
+        std::vector<Event>().swap(rightOnly);
+        std::vector<Event>().swap(bothLeft);
+        std::vector<Event>().swap(bothRight);
+
+        build(tree, classification, leftEvents, leftVoxel, leftCount, currentDepth + 1);
+        std::vector<Event>().swap(leftEvents);
+        const uint32_t aboveChild = uint32_t(nodes.size());
+        build(tree, classification, rightEvents, rightVoxel, rightCount, currentDepth + 1);
+        nodes[nodeIndex].initInterior(bestAxis, aboveChild, bestPos);
+    }
+
+    /// @brief Append the node of the top tree to @nodes replacing placeholders with their subtrees
+    void mergeNode(const Subtree &top, uint32_t topIndex) {
+        const int subtreeIndex = topSubtree[topIndex];
+        if (subtreeIndex != -1) {
+            const Subtree &subtree = subtrees[subtreeIndex];
+            const uint32_t nodeBase = uint32_t(nodes.size());
+            const uint32_t primitiveBase = uint32_t(primitiveIndices.size());
+            for (Node node : subtree.nodes) {
+                if (!node.isLeaf()) {
+                    node.initInterior(node.axis(), node.aboveChild() + nodeBase, node.split);
+                } else if (node.primitiveCount() != 1) {
+                    node.primitiveOffset += primitiveBase;
+                }
+                nodes.push_back(node);
+            }
+            primitiveIndices.insert(
+                primitiveIndices.end(), subtree.primitiveIndices.begin(), subtree.primitiveIndices.end());
+            return;
+        }
+
+        const Node &node = top.nodes[topIndex];
+        const uint32_t nodeIndex = uint32_t(nodes.size());
+        nodes.push_back(node);
+        if (node.isLeaf()) {
+            if (node.primitiveCount() != 1) {
+                nodes[nodeIndex].primitiveOffset = uint32_t(primitiveIndices.size());
+                const auto first = top.primitiveIndices.begin() + node.primitiveOffset;
+                primitiveIndices.insert(primitiveIndices.end(), first, first + node.primitiveCount());
+            }
+            return;
+        }
+        mergeNode(top, topIndex + 1);
+        const uint32_t aboveChild = uint32_t(nodes.size());
+        mergeNode(top, node.aboveChild());
+        nodes[nodeIndex].initInterior(node.axis(), aboveChild, node.split);
+    }
+
+    void build(Purpose purpose, ThreadManager *threads) override {
+        const char *treePurpose = "";
+        if (purpose == Purpose::Instances) {
+            treePurpose = " instances";
+        } else if (purpose == Purpose::Mesh) {
+            treePurpose = " mesh";
+        }
+
+        Timer timer;
+        const int primitiveCount = int(allPrimitives.size());
+        nodes.clear();
+        primitiveIndices.clear();
+        bounds = BBox{};
+        depth = leafSize = 0;
+        MAX_DEPTH = int(8 + 1.3f * log2f(float(std::max(primitiveCount, 1))));
+
+        primitiveBoxes.assign(primitiveCount, BBox{});
+        for (int c = 0; c < primitiveCount; c++) {
+            allPrimitives[c]->expandBox(primitiveBoxes[c]);
+            bounds.add(primitiveBoxes[c]);
+        }
+
+        // events are sorted by axis first, so each axis is sorted separately
+        std::vector<Event> axisEvents[3];
+        parallelFor(threads, 3, [&](int axis, int) {
+            axisEvents[axis].reserve(primitiveCount * 2);
+            for (int c = 0; c < primitiveCount; c++) {
+                const BBox &box = primitiveBoxes[c];
+                if (box.min[axis] == box.max[axis]) {
+                    axisEvents[axis].push_back({box.min[axis], uint32_t(c), uint8_t(axis), Event::Planar});
+                } else {
+                    axisEvents[axis].push_back({box.min[axis], uint32_t(c), uint8_t(axis), Event::Start});
+                    axisEvents[axis].push_back({box.max[axis], uint32_t(c), uint8_t(axis), Event::End});
+                }
+            }
+            std::sort(axisEvents[axis].begin(), axisEvents[axis].end());
+        });
+        Subtree top;
+        top.events.reserve(axisEvents[0].size() + axisEvents[1].size() + axisEvents[2].size());
+        for (int axis = 0; axis < 3; axis++) {
+            top.events.insert(top.events.end(), axisEvents[axis].begin(), axisEvents[axis].end());
+            std::vector<Event>().swap(axisEvents[axis]);
+        }
+
+        // split the top of the tree on this thread, then build the subtrees below it in parallel
+        const int threadCount = parallelThreadCount(threads);
+        std::vector<std::vector<Side>> classification(threadCount, std::vector<Side>(primitiveCount, Side::Both));
+        top.isTop = threads != nullptr;
+        subtreeSize = std::max(MIN_SUBTREE_SIZE, primitiveCount / (threadCount * 16));
+        build(top, classification[0], top.events, bounds, primitiveCount, 0);
+        std::vector<Event>().swap(top.events);
+        parallelFor(threads, int(subtrees.size()), [&](int c, int threadIndex) {
+            Subtree &subtree = subtrees[c];
+            std::vector<Side> &sides = classification[threadIndex];
+            build(subtree, sides, subtree.events, subtree.voxel, subtree.count, subtree.startDepth);
+            std::vector<Event>().swap(subtree.events);
+        });
+
+        if (subtrees.empty()) {
+            nodes.swap(top.nodes);
+            primitiveIndices.swap(top.primitiveIndices);
         } else {
-            for (int c = 0; c < 8; c++) {
-                if (n->children[c]->box.testIntersect(ray)) {
-                    if (intersect(n->children[c], ray, tMin, tMax, intersection)) {
+            mergeNode(top, 0);
+        }
+        depth = top.depth;
+        leafSize = top.leafSize;
+        for (const Subtree &subtree : subtrees) {
+            depth = std::max(depth, subtree.depth);
+            leafSize = std::max(leafSize, subtree.leafSize);
+        }
+
+        std::vector<Subtree>().swap(subtrees);
+        std::vector<int>().swap(topSubtree);
+        std::vector<BBox>().swap(primitiveBoxes);
+        nodes.shrink_to_fit();
+        primitiveIndices.shrink_to_fit();
+        printf("Built%s kd tree with %d primitives in %ldms, nodes %d, depth %d, %d leaf size, %gKB\n",
+               treePurpose,
+               primitiveCount,
+               timer.toMs(timer.elapsedNs()),
+               int(nodes.size()),
+               depth,
+               leafSize,
+               (nodes.size() * sizeof(Node) + primitiveIndices.size() * sizeof(uint32_t)) / 1024.f);
+    }
+
+    bool isBuilt() const override {
+        return !nodes.empty();
+    }
+
+    bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override {
+        float nodeMin = tMin, nodeMax = tMax;
+        if (!bounds.clipRay(ray, nodeMin, nodeMax)) {
+            return false;
+        }
+
+        struct Todo {
+            const Node *node;
+            float tMin, tMax;
+        };
+        Todo todo[64];
+        int todoSize = 0;
+
+        bool hasHit = false;
+        const Node *node = &nodes[0];
+        while (true) {
+            COUNT_NODE_FETCH();
+            if (!node->isLeaf()) {
+                // visit the child on the side of the ray origin first and the other one only if the ray reaches it
+                const int axis = node->axis();
+                const float tPlane = (node->split - ray.origin[axis]) * ray.invDir[axis];
+                const bool belowFirst =
+                    ray.origin[axis] < node->split || (ray.origin[axis] == node->split && ray.dir[axis] <= 0);
+                const Node *first = belowFirst ? node + 1 : &nodes[node->aboveChild()];
+                const Node *second = belowFirst ? &nodes[node->aboveChild()] : node + 1;
+                if (tPlane > nodeMax || tPlane <= 0) {
+                    node = first;
+                } else if (tPlane < nodeMin) {
+                    node = second;
+                } else {
+                    todo[todoSize++] = {second, tPlane, nodeMax};
+                    node = first;
+                    nodeMax = tPlane;
+                }
+                continue;
+            }
+
+            const uint32_t count = node->primitiveCount();
+            if (count == 1) {
+                if (allPrimitives[node->onePrimitive]->intersect(ray, tMin, tMax, intersection)) {
+                    tMax = intersection.t;
+                    hasHit = true;
+                }
+            } else {
+                for (uint32_t c = 0; c < count; c++) {
+                    const uint32_t prim = primitiveIndices[node->primitiveOffset + c];
+                    if (allPrimitives[prim]->intersect(ray, tMin, tMax, intersection)) {
                         tMax = intersection.t;
                         hasHit = true;
                     }
                 }
             }
-        }
 
+            // leaves are visited front to back, so a hit inside the current interval can't be occluded
+            if (hasHit && tMax <= nodeMax) {
+                break;
+            }
+            if (todoSize == 0) {
+                break;
+            }
+            --todoSize;
+            node = todo[todoSize].node;
+            nodeMin = todo[todoSize].tMin;
+            nodeMax = todo[todoSize].tMax;
+            if (hasHit && tMax < nodeMin) {
+                break;
+            }
+        }
         return hasHit;
     }
 
-    bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override {
-        return intersect(root, ray, tMin, tMax, intersection);
-    }
+    bool occluded(const Ray &ray, float tMin, float tMax) override {
+        float nodeMin = tMin, nodeMax = tMax;
+        if (!bounds.clipRay(ray, nodeMin, nodeMax)) {
+            return false;
+        }
 
-    bool isBuilt() const override {
-        return root != nullptr;
+        struct Todo {
+            const Node *node;
+            float tMin, tMax;
+        };
+        Todo todo[64];
+        int todoSize = 0;
+
+        const Node *node = &nodes[0];
+        while (true) {
+            COUNT_NODE_FETCH();
+            if (!node->isLeaf()) {
+                // the children are still split by the plane to skip the ones outside the ray interval, but the
+                // order they are visited in does not matter
+                const int axis = node->axis();
+                const float tPlane = (node->split - ray.origin[axis]) * ray.invDir[axis];
+                const bool belowFirst =
+                    ray.origin[axis] < node->split || (ray.origin[axis] == node->split && ray.dir[axis] <= 0);
+                const Node *first = belowFirst ? node + 1 : &nodes[node->aboveChild()];
+                const Node *second = belowFirst ? &nodes[node->aboveChild()] : node + 1;
+                if (tPlane > nodeMax || tPlane <= 0) {
+                    node = first;
+                } else if (tPlane < nodeMin) {
+                    node = second;
+                } else {
+                    todo[todoSize++] = {second, tPlane, nodeMax};
+                    node = first;
+                    nodeMax = tPlane;
+                }
+                continue;
+            }
+
+            const uint32_t count = node->primitiveCount();
+            if (count == 1) {
+                if (allPrimitives[node->onePrimitive]->occluded(ray, tMin, tMax)) {
+                    return true;
+                }
+            } else {
+                for (uint32_t c = 0; c < count; c++) {
+                    if (allPrimitives[primitiveIndices[node->primitiveOffset + c]]->occluded(ray, tMin, tMax)) {
+                        return true;
+                    }
+                }
+            }
+
+            if (todoSize == 0) {
+                return false;
+            }
+            --todoSize;
+            node = todo[todoSize].node;
+            nodeMin = todo[todoSize].tMin;
+            nodeMax = todo[todoSize].tMax;
+        }
     }
 
-    ~OctTree() override {
+    ~KDTree() override {
         clear();
     }
 };
 
-/// TODO: Implement one/both or any other acceleration structure and change makeDefaultAccelerator to create it
-struct KDTree : IntersectionAccelerator {
-    void addPrimitive(Intersectable *prim) override {}
-    void clear() override {}
-    void build(Purpose purpose) override {}
+/// Accelerator over any intersectables using binned SAH BVH with flattened node array
+template <typename Prim>
+struct BVHTree : IntersectionAccelerator {
+    std::vector<Prim *> allPrimitives;
+    BVH bvh;
+
+    void addPrimitive(Intersectable *prim) override {
+        allPrimitives.push_back(static_cast<Prim *>(prim));
+    }
+
+    void clear() override {
+        allPrimitives.clear();
+        bvh.clear();
+    }
+
+    void build(Purpose purpose, ThreadManager *threads) override {
+        const char *treePurpose = "";
+        BVHBuildSettings settings;
+        if (purpose == Purpose::Instances) {
+            settings.maxLeafSize = 2;
+            settings.traversalCost = 0.5f;
+            treePurpose = " instances";
+        } else if (purpose == Purpose::Mesh) {
+            settings.maxLeafSize = 4;
+            settings.traversalCost = 1.f;
+            treePurpose = " mesh";
+        }
+
+        Timer timer;
+        std::vector<BBox> boxes(allPrimitives.size());
+        for (int c = 0; c < allPrimitives.size(); c++) {
+            allPrimitives[c]->expandBox(boxes[c]);
+        }
+        bvh.build(boxes, settings, threads);
+        bvh.applyOrder(allPrimitives);
+        printf("Built%s BVH with %d primitives in %ldms, nodes %d, depth %d, %d leaf size, %gKB\n",
+               treePurpose,
+               int(allPrimitives.size()),
+               timer.toMs(timer.elapsedNs()),
+               int(bvh.nodes.size()),
+               bvh.depth,
+               bvh.maxLeafPrimitives,
+               (bvh.memoryUsage() + allPrimitives.size() * sizeof(Prim *)) / 1024.f);
+    }
+
     bool isBuilt() const override {
-        return false;
+        return bvh.isBuilt();
     }
+
     bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override {
-        return false;
+        return bvh.intersect(ray, tMin, tMax, [&](uint32_t first, uint32_t count, float tMin, float &tMax) {
+            bool hasHit = false;
+            for (uint32_t c = first; c < first + count; c++) {
+                if (allPrimitives[c]->intersect(ray, tMin, tMax, intersection)) {
+                    tMax = intersection.t;
+                    hasHit = true;
+                }
+            }
+            return hasHit;
+        });
+    }
+
+    uint32_t intersectPacket(RayPacket &packet, uint32_t active, float tMin, Intersection *hits) override {
+        return bvh.intersectPacket(packet, active, tMin, [&](uint32_t first, uint32_t count, uint32_t active) {
+            uint32_t hitMask = 0;
+            for (uint32_t c = first; c < first + count; c++) {
+                hitMask |= allPrimitives[c]->intersectPacket(packet, active, tMin, hits);
+            }
+            return hitMask;
+        });
+    }
+
+    bool occluded(const Ray &ray, float tMin, float tMax) override {
+        return bvh.occluded(ray, tMin, tMax, [&](uint32_t first, uint32_t count) {
+            for (uint32_t c = first; c < first + count; c++) {
+                if (allPrimitives[c]->occluded(ray, tMin, tMax)) {
+                    return true;
+                }
+            }
+            return false;
+        });
     }
 };
 
-struct BVHTree : IntersectionAccelerator {
-    void addPrimitive(Intersectable *prim) override {}
-    void clear() override {}
-    void build(Purpose purpose) override {}
+template <int Width, typename Prim>
+struct WideBVHTree;
+
+/// @brief The 8 wide traversals compiled for AVX2 with the traversal inlined, only valid if cpuSupportsAVX2()
+template <typename Prim>
+TARGET_AVX2 bool intersectWide8(
+    WideBVHTree<8, Prim> &tree, const Ray &ray, float tMin, float tMax, Intersection &intersection) {
+    return tree.intersectWide(ray, tMin, tMax, intersection);
+}
+
+template <typename Prim>
+TARGET_AVX2 uint32_t intersectPacketWide8(
+    WideBVHTree<8, Prim> &tree, RayPacket &packet, uint32_t active, float tMin, Intersection *hits) {
+    return tree.intersectPacketWide(packet, active, tMin, hits);
+}
+
+template <typename Prim>
+TARGET_AVX2 bool occludedWide8(WideBVHTree<8, Prim> &tree, const Ray &ray, float tMin, float tMax) {
+    return tree.occludedWide(ray, tMin, tMax);
+}
+
+/// Accelerator over any intersectables using BVH with 4 or 8 children per node collapsed from binary BVH
+template <int Width, typename Prim>
+struct WideBVHTree : IntersectionAccelerator {
+    std::vector<Prim *> allPrimitives;
+    WideBVH<Width> bvh;
+
+    void addPrimitive(Intersectable *prim) override {
+        allPrimitives.push_back(static_cast<Prim *>(prim));
+    }
+
+    void clear() override {
+        allPrimitives.clear();
+        bvh.clear();
+    }
+
+    void build(Purpose purpose, ThreadManager *threads) override {
+        const char *treePurpose = "";
+        BVHBuildSettings settings;
+        if (purpose == Purpose::Instances) {
+            settings.maxLeafSize = 2;
+            settings.traversalCost = 0.5f;
+            treePurpose = " instances";
+        } else if (purpose == Purpose::Mesh) {
+            settings.maxLeafSize = 4;
+            settings.traversalCost = 1.f;
+            treePurpose = " mesh";
+        }
+
+        Timer timer;
+        std::vector<BBox> boxes(allPrimitives.size());
+        for (int c = 0; c < allPrimitives.size(); c++) {
+            allPrimitives[c]->expandBox(boxes[c]);
+        }
+        BVH binary;
+        binary.build(boxes, settings, threads);
+        binary.applyOrder(allPrimitives);
+        bvh.build(binary);
+        printf("Built%s BVH%d with %d primitives in %ldms, nodes %d, depth %d, %gKB\n",
+               treePurpose,
+               Width,
+               int(allPrimitives.size()),
+               timer.toMs(timer.elapsedNs()),
+               int(bvh.nodes.size()),
+               bvh.depth,
+               (bvh.memoryUsage() + allPrimitives.size() * sizeof(Prim *)) / 1024.f);
+    }
+
     bool isBuilt() const override {
-        return false;
+        return bvh.isBuilt();
     }
+
     bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override {
-        return false;
+        if constexpr (Width == 8) {
+            return intersectWide8(*this, ray, tMin, tMax, intersection);
+        } else {
+            return intersectWide(ray, tMin, tMax, intersection);
+        }
+    }
+
+    uint32_t intersectPacket(RayPacket &packet, uint32_t active, float tMin, Intersection *hits) override {
+        if constexpr (Width == 8) {
+            return intersectPacketWide8(*this, packet, active, tMin, hits);
+        } else {
+            return intersectPacketWide(packet, active, tMin, hits);
+        }
+    }
+
+    bool occluded(const Ray &ray, float tMin, float tMax) override {
+        if constexpr (Width == 8) {
+            return occludedWide8(*this, ray, tMin, tMax);
+        } else {
+            return occludedWide(ray, tMin, tMax);
+        }
+    }
+
+    /// @brief Separate from intersect so the 8 wide version can be compiled for AVX2 with the traversal inlined
+    FORCE_INLINE bool intersectWide(const Ray &ray, float tMin, float tMax, Intersection &intersection) {
+        return bvh.intersect(ray, tMin, tMax, [&](uint32_t first, uint32_t count, float tMin, float &tMax) {
+            bool hasHit = false;
+            for (uint32_t c = first; c < first + count; c++) {
+                if (allPrimitives[c]->intersect(ray, tMin, tMax, intersection)) {
+                    tMax = intersection.t;
+                    hasHit = true;
+                }
+            }
+            return hasHit;
+        });
+    }
+
+    FORCE_INLINE uint32_t intersectPacketWide(RayPacket &packet, uint32_t active, float tMin, Intersection *hits) {
+        return bvh.intersectPacket(packet, active, tMin, [&](uint32_t first, uint32_t count, uint32_t active) {
+            uint32_t hitMask = 0;
+            for (uint32_t c = first; c < first + count; c++) {
+                hitMask |= allPrimitives[c]->intersectPacket(packet, active, tMin, hits);
+            }
+            return hitMask;
+        });
+    }
+
+    FORCE_INLINE bool occludedWide(const Ray &ray, float tMin, float tMax) {
+        return bvh.occluded(ray, tMin, tMax, [&](uint32_t first, uint32_t count) {
+            for (uint32_t c = first; c < first + count; c++) {
+                if (allPrimitives[c]->occluded(ray, tMin, tMax)) {
+                    return true;
+                }
+            }
+            return false;
+        });
     }
 };
 
+template <typename Prim>
+AcceleratorPtr makeAccelerator(AcceleratorType type) {
+    switch (type) {
+    case AcceleratorType::Oct:
+        return AcceleratorPtr(new OctTree<Prim>());
+    case AcceleratorType::KD:
+        return AcceleratorPtr(new KDTree<Prim>());
+    case AcceleratorType::BVH:
+        return AcceleratorPtr(new BVHTree<Prim>());
+    case AcceleratorType::BVH4:
+        return AcceleratorPtr(new WideBVHTree<4, Prim>());
+    case AcceleratorType::BVH8:
+        if (cpuSupportsAVX2()) {
+            return AcceleratorPtr(new WideBVHTree<8, Prim>());
+        }
+        return AcceleratorPtr(new WideBVHTree<4, Prim>());
+    }
+    return nullptr;
+}
+
+template AcceleratorPtr makeAccelerator<Intersectable>(AcceleratorType type);
+template AcceleratorPtr makeAccelerator<TriangleMesh::Triangle>(AcceleratorType type);
+
+AcceleratorType bestWideBVHType() {
+    return cpuSupportsAVX2() ? AcceleratorType::BVH8 : AcceleratorType::BVH4;
+}
+
+static AcceleratorType defaultAcceleratorType = bestWideBVHType();
+
+void setDefaultAcceleratorType(AcceleratorType type) {
+    defaultAcceleratorType = type;
+}
+
+AcceleratorType getDefaultAcceleratorType() {
+    return defaultAcceleratorType;
+}
+
 AcceleratorPtr makeDefaultAccelerator() {
-    // TODO: uncomment or add the acceleration structure you have implemented
-    // return AcceleratorPtr(new KDTree());
-    // return AcceleratorPtr(new BVHTree());
-    return AcceleratorPtr(new OctTree());
+    return makeAccelerator(defaultAcceleratorType);
 }
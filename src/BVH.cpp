@@ -0,0 +1,437 @@
+#include "BVH.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+#include "Threading.hpp"
+
+static const int MAX_BINS = 32;
+
+/// Nodes with at least that many primitives are binned and partitioned by all threads
+static const uint32_t PARALLEL_NODE_SIZE = 1 << 14;
+
+/// Number of primitives binned or partitioned by one thread at a time in parallel nodes
+static const uint32_t PARALLEL_CHUNK_SIZE = 1 << 12;
+
+/// Subtrees with fewer primitives are not split further in parallel tasks
+static const uint32_t MIN_SUBTREE_SIZE = 1 << 10;
+
+namespace {
+struct Bin {
+    BBox box;
+    int count = 0;
+};
+
+/// Bins of all three axes for a range of primitives, ranges binned by different threads are added together
+struct Bins {
+    BBox nodeBox;
+    BBox centerBox;
+    Bin bins[3][MAX_BINS];
+
+    void add(const Bins &other, int binCount) {
+        nodeBox.add(other.nodeBox);
+        centerBox.add(other.centerBox);
+        for (int axis = 0; axis < 3; axis++) {
+            for (int c = 0; c < binCount; c++) {
+                bins[axis][c].box.add(other.bins[axis][c].box);
+                bins[axis][c].count += other.bins[axis][c].count;
+            }
+        }
+    }
+};
+}  // namespace
+
+struct BVH::BuildContext {
+    const std::vector<BBox> &boxes;
+    std::vector<vec3> centers;
+    BVHBuildSettings settings;
+    int binCount;
+    ThreadManager *threads;
+    uint32_t subtreeSize;  ///< Nodes with fewer primitives are built as a separate subtree by one thread
+    std::vector<uint32_t> partitionBuffer;  ///< Destination of the parallel partition
+    std::vector<Subtree> subtrees;  ///< Subtrees left to build after the top of the tree is done
+    std::vector<int> topSubtree;  ///< Index in @subtrees for placeholder nodes in the top tree, -1 for the rest
+};
+
+/// Nodes of a part of the tree, with child and primitive offsets relative to it
+struct BVH::Subtree {
+    uint32_t begin = 0;
+    uint32_t end = 0;
+    int startDepth = 0;
+    bool isTop = false;  ///< The top is built on the calling thread and defers big enough nodes as subtrees
+    std::vector<BVHNode> nodes;
+    int depth = 0;
+    int leafCount = 0;
+    int maxLeafPrimitives = 0;
+};
+
+/// Best split plane of a node
+struct BVH::Split {
+    BBox nodeBox;
+    BBox centerBox;
+    int axis = -1;  ///< -1 if the centers of all primitives are the same point
+    int bin = -1;  ///< Primitives in this bin and the ones before it go to the first child
+    float cost = FLT_MAX;  ///< Sum of child area times primitive count
+};
+
+void BVH::clear() {
+    nodes.clear();
+    primIndices.clear();
+    depth = leafCount = maxLeafPrimitives = 0;
+}
+
+void BVH::build(const std::vector<BBox> &boxes, const BVHBuildSettings &settings, ThreadManager *threads) {
+    clear();
+    if (boxes.empty()) {
+        return;
+    }
+
+    const uint32_t count = uint32_t(boxes.size());
+    BuildContext ctx{boxes, {}, settings, std::min(std::max(settings.binCount, 2), MAX_BINS), threads};
+    ctx.subtreeSize = std::max(MIN_SUBTREE_SIZE, count / (uint32_t(parallelThreadCount(threads)) * 16));
+    ctx.centers.resize(count);
+    primIndices.resize(count);
+    const int chunkCount = int((count + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE);
+    parallelFor(threads, chunkCount, [&](int chunk, int) {
+        const uint32_t end = std::min(count, (chunk + 1) * PARALLEL_CHUNK_SIZE);
+        for (uint32_t c = chunk * PARALLEL_CHUNK_SIZE; c < end; c++) {
+            ctx.centers[c] = boxes[c].center();
+            primIndices[c] = c;
+        }
+    });
+
+    Subtree top;
+    top.end = count;
+    top.isTop = threads != nullptr;
+    top.nodes.reserve(2 * count / std::max(settings.maxLeafSize, 1) + 1);
+    buildNode(ctx, top, 0, count, 0);
+    if (ctx.subtrees.empty()) {
+        nodes.swap(top.nodes);
+        nodes.shrink_to_fit();
+        depth = top.depth;
+        leafCount = top.leafCount;
+        maxLeafPrimitives = top.maxLeafPrimitives;
+        return;
+    }
+
+    // biggest subtrees first for better load balance at the end
+    std::vector<int> order(ctx.subtrees.size());
+    for (int c = 0; c < int(order.size()); c++) {
+        order[c] = c;
+    }
+    std::sort(order.begin(), order.end(), [&ctx](int a, int b) {
+        return ctx.subtrees[a].end - ctx.subtrees[a].begin > ctx.subtrees[b].end - ctx.subtrees[b].begin;
+    });
+    parallelFor(threads, int(order.size()), [&](int item, int) {
+        Subtree &subtree = ctx.subtrees[order[item]];
+        subtree.nodes.reserve(2 * (subtree.end - subtree.begin) / std::max(settings.maxLeafSize, 1) + 1);
+        buildNode(ctx, subtree, subtree.begin, subtree.end, subtree.startDepth);
+    });
+
+    size_t nodeCount = top.nodes.size();
+    depth = top.depth;
+    leafCount = top.leafCount;
+    maxLeafPrimitives = top.maxLeafPrimitives;
+    for (const Subtree &subtree : ctx.subtrees) {
+        nodeCount += subtree.nodes.size();
+        depth = std::max(depth, subtree.depth);
+        leafCount += subtree.leafCount;
+        maxLeafPrimitives = std::max(maxLeafPrimitives, subtree.maxLeafPrimitives);
+    }
+    nodes.reserve(nodeCount);
+    mergeNode(ctx, top, 0);
+}
+
+BVH::Split BVH::findSplit(BuildContext &ctx, uint32_t begin, uint32_t end, bool parallel) const {
+    const int binCount = ctx.binCount;
+    const uint32_t count = end - begin;
+    const int chunkCount = parallel ? int((count + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE) : 1;
+    const uint32_t chunkSize = parallel ? PARALLEL_CHUNK_SIZE : count;
+
+    // first pass finds the bounds of the centers needed to place primitives in bins
+    std::vector<Bins> chunkBins(chunkCount);
+    parallelFor(parallel ? ctx.threads : nullptr, chunkCount, [&](int chunk, int) {
+        const uint32_t chunkEnd = std::min(end, begin + (chunk + 1) * chunkSize);
+        for (uint32_t c = begin + chunk * chunkSize; c < chunkEnd; c++) {
+            chunkBins[chunk].nodeBox.add(ctx.boxes[primIndices[c]]);
+            chunkBins[chunk].centerBox.add(ctx.centers[primIndices[c]]);
+        }
+    });
+    Split split;
+    for (const Bins &bins : chunkBins) {
+        split.nodeBox.add(bins.nodeBox);
+        split.centerBox.add(bins.centerBox);
+    }
+    if (count == 1) {
+        return split;
+    }
+
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        const float extent = split.centerBox.max[axis] - split.centerBox.min[axis];
+        scale[axis] = extent > 0.f ? binCount / extent : 0.f;
+    }
+    parallelFor(parallel ? ctx.threads : nullptr, chunkCount, [&](int chunk, int) {
+        const uint32_t chunkEnd = std::min(end, begin + (chunk + 1) * chunkSize);
+        for (uint32_t c = begin + chunk * chunkSize; c < chunkEnd; c++) {
+            const uint32_t prim = primIndices[c];
+            for (int axis = 0; axis < 3; axis++) {
+                const float offset = (ctx.centers[prim][axis] - split.centerBox.min[axis]) * scale[axis];
+                Bin &bin = chunkBins[chunk].bins[axis][std::min(binCount - 1, int(offset))];
+                bin.count++;
+                bin.box.add(ctx.boxes[prim]);
+            }
+        }
+    });
+    for (int c = 1; c < chunkCount; c++) {
+        chunkBins[0].add(chunkBins[c], binCount);
+    }
+
+    // find the best split plane among the bin borders of all axes
+    float rightArea[MAX_BINS];
+    int rightCount[MAX_BINS];
+    for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0.f) {
+            continue;
+        }
+        const Bin *bins = chunkBins[0].bins[axis];
+        BBox sweepBox;
+        int sweepCount = 0;
+        for (int c = binCount - 1; c > 0; c--) {
+            sweepBox.add(bins[c].box);
+            sweepCount += bins[c].count;
+            rightArea[c] = sweepCount ? sweepBox.surfaceArea() : 0.f;
+            rightCount[c] = sweepCount;
+        }
+
+        sweepBox = BBox{};
+        sweepCount = 0;
+        for (int c = 0; c < binCount - 1; c++) {
+            sweepBox.add(bins[c].box);
+            sweepCount += bins[c].count;
+            if (sweepCount == 0 || rightCount[c + 1] == 0) {
+                continue;
+            }
+            const float cost = sweepBox.surfaceArea() * sweepCount + rightArea[c + 1] * rightCount[c + 1];
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.bin = c;
+            }
+        }
+    }
+    return split;
+}
+
+uint32_t BVH::partition(BuildContext &ctx, uint32_t begin, uint32_t end, const Split &split, bool parallel) {
+    const int binCount = ctx.binCount;
+    const float scale = binCount / (split.centerBox.max[split.axis] - split.centerBox.min[split.axis]);
+    const float axisMin = split.centerBox.min[split.axis];
+    const auto isFirst = [&](uint32_t prim) {
+        const int bin = std::min(binCount - 1, int((ctx.centers[prim][split.axis] - axisMin) * scale));
+        return bin <= split.bin;
+    };
+    if (!parallel) {
+        return uint32_t(std::partition(&primIndices[begin], &primIndices[0] + end, isFirst) - primIndices.data());
+    }
+
+    // count the first child primitives of each chunk, then each chunk copies its primitives to their final place
+    const uint32_t count = end - begin;
+    const int chunkCount = int((count + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE);
+    std::vector<uint32_t> firstCount(chunkCount, 0);
+    parallelFor(ctx.threads, chunkCount, [&](int chunk, int) {
+        const uint32_t chunkEnd = std::min(end, begin + (chunk + 1) * PARALLEL_CHUNK_SIZE);
+        for (uint32_t c = begin + chunk * PARALLEL_CHUNK_SIZE; c < chunkEnd; c++) {
+            firstCount[chunk] += isFirst(primIndices[c]);
+        }
+    });
+    std::vector<uint32_t> firstOffset(chunkCount), secondOffset(chunkCount);
+    uint32_t totalFirst = 0;
+    for (int c = 0; c < chunkCount; c++) {
+        firstOffset[c] = totalFirst;
+        totalFirst += firstCount[c];
+    }
+    for (int c = 0; c < chunkCount; c++) {
+        secondOffset[c] = totalFirst + c * PARALLEL_CHUNK_SIZE - firstOffset[c];
+    }
+
+    ctx.partitionBuffer.resize(count);
+    parallelFor(ctx.threads, chunkCount, [&](int chunk, int) {
+        uint32_t first = firstOffset[chunk], second = secondOffset[chunk];
+        const uint32_t chunkEnd = std::min(end, begin + (chunk + 1) * PARALLEL_CHUNK_SIZE);
+        for (uint32_t c = begin + chunk * PARALLEL_CHUNK_SIZE; c < chunkEnd; c++) {
+            const uint32_t prim = primIndices[c];
+            ctx.partitionBuffer[isFirst(prim) ? first++ : second++] = prim;
+        }
+    });
+    parallelFor(ctx.threads, chunkCount, [&](int chunk, int) {
+        const uint32_t chunkBegin = chunk * PARALLEL_CHUNK_SIZE;
+        const uint32_t chunkEnd = std::min(count, chunkBegin + PARALLEL_CHUNK_SIZE);
+        const uint32_t *buffer = ctx.partitionBuffer.data();
+        std::copy(buffer + chunkBegin, buffer + chunkEnd, &primIndices[begin + chunkBegin]);
+    });
+    return begin + totalFirst;
+}
+
+uint32_t BVH::buildNode(BuildContext &ctx, Subtree &tree, uint32_t begin, uint32_t end, int currentDepth) {
+    const uint32_t count = end - begin;
+    const uint32_t nodeIndex = uint32_t(tree.nodes.size());
+    tree.nodes.emplace_back();
+    tree.depth = std::max(tree.depth, currentDepth);
+    if (tree.isTop) {
+        ctx.topSubtree.push_back(-1);
+        if (count < ctx.subtreeSize) {
+            // placeholder for a subtree built later by one thread
+            ctx.topSubtree[nodeIndex] = int(ctx.subtrees.size());
+            ctx.subtrees.emplace_back();
+            ctx.subtrees.back().begin = begin;
+            ctx.subtrees.back().end = end;
+            ctx.subtrees.back().startDepth = currentDepth;
+            return nodeIndex;
+        }
+    }
+
+    const Split split = findSplit(ctx, begin, end, tree.isTop && count >= PARALLEL_NODE_SIZE);
+    tree.nodes[nodeIndex].box = split.nodeBox;
+
+    const auto makeLeaf = [&]() {
+        assert(count <= UINT16_MAX);
+        tree.nodes[nodeIndex].offset = begin;
+        tree.nodes[nodeIndex].count = uint16_t(count);
+        tree.leafCount++;
+        tree.maxLeafPrimitives = std::max(tree.maxLeafPrimitives, int(count));
+        return nodeIndex;
+    };
+
+    if (count == 1 || currentDepth >= MAX_DEPTH - 1) {
+        return makeLeaf();
+    }
+
+    uint32_t middle = begin + count / 2;
+    if (split.axis == -1) {
+        // all centers are the same point, there is nothing to gain from splitting unless the leaf is too big
+        if (count <= uint32_t(ctx.settings.maxLeafSize)) {
+            return makeLeaf();
+        }
+    } else {
+        const float nodeArea = split.nodeBox.surfaceArea();
+        const float splitCost = ctx.settings.traversalCost + (nodeArea > 0.f ? split.cost / nodeArea : count);
+        if (count <= uint32_t(ctx.settings.maxLeafSize) && splitCost >= float(count)) {
+            return makeLeaf();
+        }
+        middle = partition(ctx, begin, end, split, tree.isTop && count >= PARALLEL_NODE_SIZE);
+        tree.nodes[nodeIndex].axis = uint8_t(split.axis);
+    }
+
+    if (middle == begin || middle == end) {
+        middle = begin + count / 2;
+    }
+
+    buildNode(ctx, tree, begin, middle, currentDepth + 1);
+    const uint32_t secondChild = buildNode(ctx, tree, middle, end, currentDepth + 1);
+    tree.nodes[nodeIndex].offset = secondChild;
+    return nodeIndex;
+}
+
+void BVH::mergeNode(const BuildContext &ctx, const Subtree &top, uint32_t topIndex) {
+    const int subtreeIndex = ctx.topSubtree[topIndex];
+    if (subtreeIndex != -1) {
+        const uint32_t base = uint32_t(nodes.size());
+        for (BVHNode node : ctx.subtrees[subtreeIndex].nodes) {
+            if (!node.isLeaf()) {
+                node.offset += base;
+            }
+            nodes.push_back(node);
+        }
+        return;
+    }
+
+    const uint32_t nodeIndex = uint32_t(nodes.size());
+    nodes.push_back(top.nodes[topIndex]);
+    if (!top.nodes[topIndex].isLeaf()) {
+        mergeNode(ctx, top, topIndex + 1);
+        nodes[nodeIndex].offset = uint32_t(nodes.size());
+        mergeNode(ctx, top, top.nodes[topIndex].offset);
+    }
+}
+
+template <int Width>
+void WideBVH<Width>::build(const BVH &binary) {
+    clear();
+    if (!binary.isBuilt()) {
+        return;
+    }
+    nodes.reserve(binary.nodes.size() / (Width - 1) + 1);
+    nodes.emplace_back();
+    if (binary.nodes[0].isLeaf()) {
+        Node &root = nodes[0];
+        for (int c = 0; c < Width; c++) {
+            for (int axis = 0; axis < 3; axis++) {
+                root.bounds[axis][c] = c == 0 ? binary.nodes[0].box.min[axis] : FLT_MAX;
+                root.bounds[axis + 3][c] = c == 0 ? binary.nodes[0].box.max[axis] : -FLT_MAX;
+            }
+            root.child[c] = c == 0 ? binary.nodes[0].offset : 0;
+            root.count[c] = c == 0 ? binary.nodes[0].count : 0;
+        }
+        return;
+    }
+    collapse(binary, 0, 0, 0);
+}
+
+template <int Width>
+void WideBVH<Width>::collapse(const BVH &binary, uint32_t binaryIndex, uint32_t wideIndex, int currentDepth) {
+    depth = std::max(depth, currentDepth);
+
+    // pull up grandchildren by opening the interior child with the biggest area until all slots are used
+    uint32_t children[Width];
+    int childCount = 2;
+    children[0] = binaryIndex + 1;
+    children[1] = binary.nodes[binaryIndex].offset;
+    while (childCount < Width) {
+        int open = -1;
+        float openArea = -1.f;
+        for (int c = 0; c < childCount; c++) {
+            const BVHNode &child = binary.nodes[children[c]];
+            if (!child.isLeaf() && child.box.surfaceArea() > openArea) {
+                open = c;
+                openArea = child.box.surfaceArea();
+            }
+        }
+        if (open == -1) {
+            break;
+        }
+        const uint32_t opened = children[open];
+        children[open] = opened + 1;
+        children[childCount++] = binary.nodes[opened].offset;
+    }
+
+    for (int c = 0; c < Width; c++) {
+        if (c >= childCount) {
+            for (int axis = 0; axis < 3; axis++) {
+                nodes[wideIndex].bounds[axis][c] = FLT_MAX;
+                nodes[wideIndex].bounds[axis + 3][c] = -FLT_MAX;
+            }
+            nodes[wideIndex].child[c] = 0;
+            nodes[wideIndex].count[c] = 0;
+            continue;
+        }
+
+        const BVHNode &child = binary.nodes[children[c]];
+        for (int axis = 0; axis < 3; axis++) {
+            nodes[wideIndex].bounds[axis][c] = child.box.min[axis];
+            nodes[wideIndex].bounds[axis + 3][c] = child.box.max[axis];
+        }
+        nodes[wideIndex].count[c] = child.count;
+        if (child.isLeaf()) {
+            nodes[wideIndex].child[c] = child.offset;
+        } else {
+            const uint32_t childIndex = uint32_t(nodes.size());
+            nodes.emplace_back();
+            nodes[wideIndex].child[c] = childIndex;
+            collapse(binary, children[c], childIndex, currentDepth + 1);
+        }
+    }
+}
+
+template struct WideBVH<4>;
+template struct WideBVH<8>;
@@ -0,0 +1,483 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Counters.hpp"
+#include "Packet.hpp"
+#include "SIMD.hpp"
+#include "Utils.hpp"
+
+struct ThreadManager;
+
+/// Node of a flattened BVH. Nodes are stored depth first, so the first (hit) child of an interior node is always
+/// the next node in the array and only the index of the second child needs to be stored to skip the first subtree
+struct BVHNode {
+    BBox box;
+    uint32_t offset = 0;  ///< Index of the second child for interior nodes, index of the first primitive for leaves
+    uint16_t count = 0;  ///< Number of primitives in a leaf, 0 for interior nodes
+    uint8_t axis = 0;  ///< The split axis of an interior node, used to visit the near child first
+    uint8_t pad = 0;
+
+    bool isLeaf() const {
+        return count != 0;
+    }
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode should fit two nodes in a cache line");
+
+/// Parameters for the binned SAH build
+struct BVHBuildSettings {
+    int maxLeafSize = 4;  ///< Nodes with more primitives are always split
+    int binCount = 16;  ///< Number of bins per axis used to estimate the SAH
+    float traversalCost = 1.f;  ///< Cost of traversing a node relative to intersecting one primitive
+};
+
+/// Bounding volume hierarchy over abstract primitives given only by their bounding boxes
+/// The tree does not reference the primitives, leaves store ranges in @primIndices that the user maps to its data
+struct BVH {
+    static const int MAX_DEPTH = 64;
+
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> primIndices;  ///< Maps leaf primitive ranges to the indices of the boxes passed to build
+    int depth = 0;
+    int leafCount = 0;
+    int maxLeafPrimitives = 0;
+
+    /// @brief Build the tree with binned SAH
+    ///        With threads the top nodes are binned and partitioned by all threads and the subtrees below them are
+    ///        built in parallel, each by one thread
+    /// @param boxes - the bounding box of each primitive
+    /// @param settings - build parameters
+    /// @param threads - threads to build with, nullptr to build on the calling thread
+    void build(const std::vector<BBox> &boxes, const BVHBuildSettings &settings, ThreadManager *threads = nullptr);
+
+    /// @brief Clear all allocated data
+    void clear();
+
+    bool isBuilt() const {
+        return !nodes.empty();
+    }
+
+    /// @brief Get the number of bytes used by the tree
+    size_t memoryUsage() const {
+        return nodes.size() * sizeof(BVHNode) + primIndices.size() * sizeof(uint32_t);
+    }
+
+    /// @brief Permute @items to leaf order, so leaf ranges can index them directly
+    ///        After calling this @primIndices is the identity and is released
+    template <typename T>
+    void applyOrder(std::vector<T> &items) {
+        std::vector<T> ordered;
+        ordered.reserve(items.size());
+        for (int c = 0; c < int(primIndices.size()); c++) {
+            ordered.push_back(items[primIndices[c]]);
+        }
+        items.swap(ordered);
+        std::vector<uint32_t>().swap(primIndices);
+    }
+
+    /// @brief Find the closest intersection along the ray, visiting the near child of each node first
+    /// @param ray - the ray
+    /// @param tMin - near clip distance
+    /// @param tMax - far clip distance
+    /// @param leaf - bool(uint32_t first, uint32_t count, float tMin, float &tMax) called for each leaf the ray
+    ///               reaches, must return true and shrink tMax when a closer intersection is found
+    /// @return true if any of the leaf calls returned true
+    template <typename LeafIntersect>
+    bool intersect(const Ray &ray, float tMin, float tMax, LeafIntersect &&leaf) const {
+        if (nodes.empty()) {
+            return false;
+        }
+        uint32_t stack[MAX_DEPTH];
+        int stackSize = 0;
+        uint32_t current = 0;
+        bool hasHit = false;
+        while (true) {
+            const BVHNode &node = nodes[current];
+            COUNT_NODE_FETCH();
+            if (node.box.testIntersect(ray, tMin, tMax)) {
+                if (node.isLeaf()) {
+                    if (leaf(node.offset, uint32_t(node.count), tMin, tMax)) {
+                        hasHit = true;
+                    }
+                } else if (ray.dirIsNeg[node.axis]) {
+                    stack[stackSize++] = current + 1;
+                    current = node.offset;
+                    continue;
+                } else {
+                    stack[stackSize++] = node.offset;
+                    current = current + 1;
+                    continue;
+                }
+            }
+            if (stackSize == 0) {
+                break;
+            }
+            current = stack[--stackSize];
+        }
+        return hasHit;
+    }
+
+    /// @brief Find the closest intersections for the active rays of a packet
+    ///        Nodes are culled with the packet frustum first and the near child is picked by the first active ray
+    /// @param packet - the rays, the leaf callback must shrink their tMax when it finds closer intersections
+    /// @param active - mask of the rays to trace
+    /// @param tMin - near clip distance for all rays
+    /// @param leaf - uint32_t(uint32_t first, uint32_t count, uint32_t active) called for each leaf reached by some
+    ///               of the rays, must return the mask of the rays for which it found closer intersection
+    /// @return mask of the rays for which any of the leaf calls found intersection
+    template <typename LeafIntersect>
+    uint32_t intersectPacket(RayPacket &packet, uint32_t active, float tMin, LeafIntersect &&leaf) const {
+        if (nodes.empty()) {
+            return 0;
+        }
+        struct Entry {
+            uint32_t node;
+            uint32_t active;
+        };
+        Entry stack[MAX_DEPTH];
+        int stackSize = 0;
+        uint32_t current = 0;
+        uint32_t hitMask = 0;
+        while (true) {
+            const BVHNode &node = nodes[current];
+            float nearest;
+            active = intersectBox(node.box, packet, active, tMin, nearest);
+            if (active) {
+                if (node.isLeaf()) {
+                    hitMask |= leaf(node.offset, uint32_t(node.count), active);
+                } else {
+                    const bool dirIsNeg = packet.dir[node.axis][lowestBit(active)] < 0;
+                    stack[stackSize++] = {dirIsNeg ? current + 1 : node.offset, active};
+                    current = dirIsNeg ? node.offset : current + 1;
+                    continue;
+                }
+            }
+            if (stackSize == 0) {
+                break;
+            }
+            --stackSize;
+            current = stack[stackSize].node;
+            active = stack[stackSize].active;
+        }
+        return hitMask;
+    }
+
+    /// @brief Check if anything blocks the ray in (tMin, tMax), used for visibility queries
+    ///        The traversal ends at the first leaf with a hit, so tMax never shrinks and the near child is picked
+    ///        only by the direction sign, which is usually the first to block the ray
+    /// @param leaf - bool(uint32_t first, uint32_t count) called for each leaf the ray reaches, must return true if
+    ///               any of the primitives blocks the ray
+    /// @return true if any of the leaf calls returned true
+    template <typename LeafOccluded>
+    bool occluded(const Ray &ray, float tMin, float tMax, LeafOccluded &&leaf) const {
+        if (nodes.empty()) {
+            return false;
+        }
+        uint32_t stack[MAX_DEPTH];
+        int stackSize = 0;
+        uint32_t current = 0;
+        while (true) {
+            const BVHNode &node = nodes[current];
+            COUNT_NODE_FETCH();
+            if (node.box.testIntersect(ray, tMin, tMax)) {
+                if (!node.isLeaf()) {
+                    stack[stackSize++] = ray.dirIsNeg[node.axis] ? current + 1 : node.offset;
+                    current = ray.dirIsNeg[node.axis] ? node.offset : current + 1;
+                    continue;
+                }
+                if (leaf(node.offset, uint32_t(node.count))) {
+                    return true;
+                }
+            }
+            if (stackSize == 0) {
+                return false;
+            }
+            current = stack[--stackSize];
+        }
+    }
+
+private:
+    struct BuildContext;
+    struct Subtree;
+    struct Split;
+    Split findSplit(BuildContext &ctx, uint32_t begin, uint32_t end, bool parallel) const;
+    uint32_t partition(BuildContext &ctx, uint32_t begin, uint32_t end, const Split &split, bool parallel);
+    uint32_t buildNode(BuildContext &ctx, Subtree &tree, uint32_t begin, uint32_t end, int currentDepth);
+    void mergeNode(const BuildContext &ctx, const Subtree &top, uint32_t topIndex);
+};
+
+/// Node of a wide BVH with @Width children, child boxes are stored as structure of arrays
+/// so all of them can be tested against a ray with one set of SIMD instructions
+template <int Width>
+struct alignas(64) WideBVHNode {
+    float bounds[6][Width];  ///< Rows of min x, y, z and max x, y, z of the child boxes, inverted for empty slots
+    uint32_t child[Width];  ///< Node index for interior children, index of the first primitive for leaves
+    uint16_t count[Width];  ///< Number of primitives for leaf children, 0 for interior and empty slots
+};
+
+/// Ray data precomputed once for all node tests of a wide BVH traversal
+struct WideRay {
+    vec3 origin;
+    vec3 invDir;
+    int nearRow[3];  ///< The row in WideBVHNode::bounds with the near plane for each axis
+    int farRow[3];  ///< The row in WideBVHNode::bounds with the far plane for each axis
+
+    WideRay() = default;
+    explicit WideRay(const Ray &ray) : origin(ray.origin), invDir(ray.invDir) {
+        for (int c = 0; c < 3; c++) {
+            nearRow[c] = ray.dirIsNeg[c] ? c + 3 : c;
+            farRow[c] = ray.dirIsNeg[c] ? c : c + 3;
+        }
+    }
+};
+
+/// @brief Slab test of the ray against all children of a node, generic version for any width
+/// @param dist [out] - the entry distance for each child that is hit
+/// @return bit mask with the children that are hit inside (tMin, tMax)
+template <int Width>
+inline uint32_t intersectChildren(
+    const WideBVHNode<Width> &node, const WideRay &ray, float tMin, float tMax, float *dist) {
+    uint32_t mask = 0;
+    for (int c = 0; c < Width; c++) {
+        float tNear = tMin, tFar = tMax;
+        for (int axis = 0; axis < 3; axis++) {
+            const float nearDist = (node.bounds[ray.nearRow[axis]][c] - ray.origin[axis]) * ray.invDir[axis];
+            const float farDist = (node.bounds[ray.farRow[axis]][c] - ray.origin[axis]) * ray.invDir[axis];
+            tNear = nearDist > tNear ? nearDist : tNear;
+            tFar = farDist * (1.f + 3.f * FLT_EPSILON) < tFar ? farDist * (1.f + 3.f * FLT_EPSILON) : tFar;
+        }
+        if (tNear <= tFar) {
+            mask |= 1 << c;
+            dist[c] = tNear;
+        }
+    }
+    return mask;
+}
+
+#if defined(RT_X86)
+/// @brief SSE slab test of a ray against 4 child boxes
+/// NaN from 0 * inf is dropped by passing it as the first operand of min/max, which then return the second one
+inline uint32_t intersectChildren(const WideBVHNode<4> &node, const WideRay &ray, float tMin, float tMax, float *dist) {
+    __m128 tNear = _mm_set1_ps(tMin);
+    __m128 tFar = _mm_set1_ps(tMax);
+    for (int axis = 0; axis < 3; axis++) {
+        const __m128 origin = _mm_set1_ps(ray.origin[axis]);
+        const __m128 invDir = _mm_set1_ps(ray.invDir[axis]);
+        const __m128 nearDist = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.nearRow[axis]]), origin), invDir);
+        const __m128 farDist = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.farRow[axis]]), origin), invDir);
+        tNear = _mm_max_ps(nearDist, tNear);
+        tFar = _mm_min_ps(_mm_mul_ps(farDist, _mm_set1_ps(1.f + 3.f * FLT_EPSILON)), tFar);
+    }
+    _mm_storeu_ps(dist, tNear);
+    return uint32_t(_mm_movemask_ps(_mm_cmple_ps(tNear, tFar)));
+}
+
+/// @brief AVX slab test of a ray against 8 child boxes, only valid if cpuSupportsAVX2()
+TARGET_AVX2 inline uint32_t intersectChildren(
+    const WideBVHNode<8> &node, const WideRay &ray, float tMin, float tMax, float *dist) {
+    __m256 tNear = _mm256_set1_ps(tMin);
+    __m256 tFar = _mm256_set1_ps(tMax);
+    for (int axis = 0; axis < 3; axis++) {
+        const __m256 origin = _mm256_set1_ps(ray.origin[axis]);
+        const __m256 invDir = _mm256_set1_ps(ray.invDir[axis]);
+        const __m256 nearBound = _mm256_load_ps(node.bounds[ray.nearRow[axis]]);
+        const __m256 farBound = _mm256_load_ps(node.bounds[ray.farRow[axis]]);
+        const __m256 nearDist = _mm256_mul_ps(_mm256_sub_ps(nearBound, origin), invDir);
+        const __m256 farDist = _mm256_mul_ps(_mm256_sub_ps(farBound, origin), invDir);
+        tNear = _mm256_max_ps(nearDist, tNear);
+        tFar = _mm256_min_ps(_mm256_mul_ps(farDist, _mm256_set1_ps(1.f + 3.f * FLT_EPSILON)), tFar);
+    }
+    _mm256_storeu_ps(dist, tNear);
+    return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ)));
+}
+#endif
+
+/// BVH with @Width children per node, collapsed from a binary BVH
+/// Leaves are stored inline in their parent node and reference the primitive ranges of the binary tree
+template <int Width>
+struct WideBVH {
+    typedef WideBVHNode<Width> Node;
+    static const int STACK_SIZE = (Width - 1) * BVH::MAX_DEPTH + 1;
+
+    std::vector<Node> nodes;
+    int depth = 0;
+
+    /// @brief Build by collapsing a binary tree, the primitive ranges stay valid for the binary tree's order
+    void build(const BVH &binary);
+
+    void clear() {
+        nodes.clear();
+        depth = 0;
+    }
+
+    bool isBuilt() const {
+        return !nodes.empty();
+    }
+
+    size_t memoryUsage() const {
+        return nodes.size() * sizeof(Node);
+    }
+
+    /// @brief Find the closest intersection along the ray, visiting the children of each node in distance order
+    ///        Same interface as BVH::intersect
+    template <typename LeafIntersect>
+    FORCE_INLINE bool intersect(const Ray &ray, float tMin, float tMax, LeafIntersect &&leaf) const {
+        if (nodes.empty()) {
+            return false;
+        }
+        const WideRay wideRay(ray);
+        struct Entry {
+            uint32_t index;
+            uint32_t count;
+            float dist;
+        };
+        Entry stack[STACK_SIZE];
+        int stackSize = 0;
+        stack[stackSize++] = {0, 0, tMin};
+
+        bool hasHit = false;
+        while (stackSize) {
+            const Entry entry = stack[--stackSize];
+            if (entry.dist > tMax) {
+                continue;
+            }
+            if (entry.count) {
+                if (leaf(entry.index, entry.count, tMin, tMax)) {
+                    hasHit = true;
+                }
+                continue;
+            }
+
+            const Node &node = nodes[entry.index];
+            COUNT_NODE_FETCH();
+            float dist[Width];
+            uint32_t mask = intersectChildren(node, wideRay, tMin, tMax, dist);
+
+            // insertion sort the hit children by distance, then push the farthest first so the nearest is on top
+            int order[Width];
+            int hitCount = 0;
+            while (mask) {
+                const int child = lowestBit(mask);
+                mask &= mask - 1;
+                int pos = hitCount++;
+                for (; pos > 0 && dist[order[pos - 1]] < dist[child]; pos--) {
+                    order[pos] = order[pos - 1];
+                }
+                order[pos] = child;
+            }
+            for (int c = 0; c < hitCount; c++) {
+                stack[stackSize++] = {node.child[order[c]], node.count[order[c]], dist[order[c]]};
+            }
+        }
+        return hasHit;
+    }
+
+    /// @brief Find the closest intersections for the active rays of a packet, same interface as BVH::intersectPacket
+    ///        Each active ray is tested against all children of a node with the SIMD kernel, a child is visited
+    ///        with the rays that hit it and children are visited by their nearest entry
+    template <typename LeafIntersect>
+    FORCE_INLINE uint32_t intersectPacket(RayPacket &packet, uint32_t active, float tMin, LeafIntersect &&leaf) const {
+        if (nodes.empty()) {
+            return 0;
+        }
+        WideRay rays[RayPacket::SIZE];
+        for (uint32_t mask = active; mask; mask &= mask - 1) {
+            const int lane = lowestBit(mask);
+            rays[lane] = WideRay(packet.getRay(lane));
+        }
+
+        struct Entry {
+            uint32_t index;
+            uint32_t count;
+            uint32_t active;
+            float dist;
+        };
+        Entry stack[STACK_SIZE];
+        int stackSize = 0;
+        stack[stackSize++] = {0, 0, active, tMin};
+
+        uint32_t hitMask = 0;
+        while (stackSize) {
+            Entry entry = stack[--stackSize];
+            // drop the rays that found a closer hit since the entry was pushed
+            for (uint32_t mask = entry.active; mask; mask &= mask - 1) {
+                const int lane = lowestBit(mask);
+                if (entry.dist > packet.tMax[lane]) {
+                    entry.active &= ~(1u << lane);
+                }
+            }
+            if (!entry.active) {
+                continue;
+            }
+            if (entry.count) {
+                hitMask |= leaf(entry.index, entry.count, entry.active);
+                continue;
+            }
+
+            const Node &node = nodes[entry.index];
+            float nearest[Width];
+            uint32_t childActive[Width] = {};
+            uint32_t childMask = 0;
+            for (uint32_t mask = entry.active; mask; mask &= mask - 1) {
+                const int lane = lowestBit(mask);
+                float dist[Width];
+                const uint32_t hitChildren = intersectChildren(node, rays[lane], tMin, packet.tMax[lane], dist);
+                for (uint32_t children = hitChildren; children; children &= children - 1) {
+                    const int child = lowestBit(children);
+                    nearest[child] = (childMask >> child) & 1 ? std::min(nearest[child], dist[child]) : dist[child];
+                    childActive[child] |= 1u << lane;
+                }
+                childMask |= hitChildren;
+            }
+
+            int order[Width];
+            int hitCount = 0;
+            while (childMask) {
+                const int child = lowestBit(childMask);
+                childMask &= childMask - 1;
+                int pos = hitCount++;
+                for (; pos > 0 && nearest[order[pos - 1]] < nearest[child]; pos--) {
+                    order[pos] = order[pos - 1];
+                }
+                order[pos] = child;
+            }
+            for (int c = 0; c < hitCount; c++) {
+                const int child = order[c];
+                stack[stackSize++] = {node.child[child], node.count[child], childActive[child], nearest[child]};
+            }
+        }
+        return hitMask;
+    }
+
+    /// @brief Check if anything blocks the ray in (tMin, tMax), same interface as BVH::occluded
+    ///        Children are pushed without sorting and leaf children are tested as soon as their parent is reached
+    template <typename LeafOccluded>
+    FORCE_INLINE bool occluded(const Ray &ray, float tMin, float tMax, LeafOccluded &&leaf) const {
+        if (nodes.empty()) {
+            return false;
+        }
+        const WideRay wideRay(ray);
+        uint32_t stack[STACK_SIZE];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize) {
+            const Node &node = nodes[stack[--stackSize]];
+            COUNT_NODE_FETCH();
+            float dist[Width];
+            for (uint32_t mask = intersectChildren(node, wideRay, tMin, tMax, dist); mask; mask &= mask - 1) {
+                const int child = lowestBit(mask);
+                if (!node.count[child]) {
+                    stack[stackSize++] = node.child[child];
+                } else if (leaf(node.child[child], uint32_t(node.count[child]))) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+private:
+    void collapse(const BVH &binary, uint32_t binaryIndex, uint32_t wideIndex, int currentDepth);
+};
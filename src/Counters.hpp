@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/// Per thread counters of the traversal work, only updated when built with RAY_STATS
+struct TraversalStats {
+    uint64_t nodes = 0;  ///< Nodes fetched by single ray traversals
+};
+
+inline TraversalStats &threadTraversalStats() {
+    thread_local TraversalStats stats;
+    return stats;
+}
+
+#ifdef RAY_STATS
+#define COUNT_NODE_FETCH() (threadTraversalStats().nodes++)
+#else
+#define COUNT_NODE_FETCH() ((void)0)
+#endif
+
+/// Hardware counter of the cache misses of the calling thread, available only on Linux when perf events are allowed
+/// The generic perf event counts misses in the last level cache, which is the L2 or the L3 depending on the CPU
+struct CacheMissCounter {
+    CacheMissCounter() {
+#if defined(__linux__)
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    CacheMissCounter(const CacheMissCounter &) = delete;
+    CacheMissCounter &operator=(const CacheMissCounter &) = delete;
+
+    ~CacheMissCounter() {
+#if defined(__linux__)
+        if (fd != -1) {
+            close(fd);
+        }
+#endif
+    }
+
+    bool isAvailable() const {
+        return fd != -1;
+    }
+
+    /// @brief Get the misses since the counter was created, 0 if it is not available
+    uint64_t read() const {
+        uint64_t value = 0;
+#if defined(__linux__)
+        if (fd != -1 && ::read(fd, &value, sizeof(value)) != sizeof(value)) {
+            value = 0;
+        }
+#endif
+        return value;
+    }
+
+private:
+    int fd = -1;
+};
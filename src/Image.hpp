@@ -31,6 +31,11 @@ struct PNGImage {
 
 typedef vec3 Color;
 
+/// @brief Get the perceived brightness of a linear color, with the Rec. 709 weights
+inline float luminance(const Color &color) {
+	return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
 /// Image used while rendering with 32 bit float for each color component
 struct ImageData {
 	int width;
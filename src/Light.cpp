@@ -0,0 +1,112 @@
+#include "Light.hpp"
+
+#include "Sampler.hpp"
+
+bool PointLight::sample(const vec3 &from, LightSample &result) {
+    const vec3 toLight = position - from;
+    const float distanceSquare = toLight.lengthSquare();
+    if (distanceSquare <= 0.f) {
+        return false;
+    }
+    result.distance = sqrtf(distanceSquare);
+    result.dir = toLight / result.distance;
+    result.radiance = intensity / distanceSquare;
+    result.pdf = 1.f;
+    result.isDelta = true;
+    return true;
+}
+
+float PointLight::power() const {
+    return 4.f * PI * luminance(intensity);
+}
+
+QuadLight::QuadLight(const vec3 &corner, const vec3 &edgeU, const vec3 &edgeV, const Color &radiance)
+    : corner(corner), edgeU(edgeU), edgeV(edgeV), radiance(radiance) {
+    const vec3 perpendicular = cross(edgeU, edgeV);
+    area = perpendicular.length();
+    normal = perpendicular / area;
+    // pad the flat box along the normal, so it is not treated as empty
+    const vec3 pad = normal * 1e-4f;
+    for (const vec3 &point : {corner, corner + edgeU, corner + edgeV, corner + edgeU + edgeV}) {
+        box.add(point + pad);
+        box.add(point - pad);
+    }
+}
+
+bool QuadLight::intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) {
+    const float cosine = dot(ray.dir, normal);
+    if (fabsf(cosine) < 1e-8f) {
+        return false;
+    }
+    const float t = dot(corner - ray.origin, normal) / cosine;
+    if (t < tMin || t > tMax) {
+        return false;
+    }
+    // coordinates of the hit along the two edges, from the areas of the parallelograms they span with it
+    const vec3 p = ray.at(t);
+    const vec3 offset = p - corner;
+    const float u = dot(cross(offset, edgeV), normal) / area;
+    const float v = dot(cross(edgeU, offset), normal) / area;
+    if (u < 0.f || u > 1.f || v < 0.f || v > 1.f) {
+        return false;
+    }
+    intersection.t = t;
+    intersection.p = p;
+    intersection.normal = normal;
+    intersection.material = material;
+    return true;
+}
+
+bool QuadLight::sample(const vec3 &from, LightSample &result) {
+    const float u = randFloat();
+    const float v = randFloat();
+    const vec3 toLight = corner + u * edgeU + v * edgeV - from;
+    const float distanceSquare = toLight.lengthSquare();
+    result.distance = sqrtf(distanceSquare);
+    result.dir = toLight / result.distance;
+    // uniform over the area, converted to the solid angle at @from
+    const float cosine = -dot(result.dir, normal);
+    if (cosine <= 0.f || distanceSquare <= 0.f) {
+        return false;
+    }
+    result.radiance = radiance;
+    result.pdf = distanceSquare / (cosine * area);
+    result.isDelta = false;
+    return true;
+}
+
+Color QuadLight::emitted(const Ray &ray, const Intersection &hit) {
+    return dot(ray.dir, normal) < 0.f ? radiance : Color(0.f);
+}
+
+float QuadLight::pdf(const Ray &ray, const Intersection &hit) {
+    const float cosine = -dot(ray.dir, normal);
+    if (cosine <= 0.f) {
+        return 0.f;
+    }
+    return hit.t * hit.t / (cosine * area);
+}
+
+float QuadLight::power() const {
+    return PI * area * luminance(radiance);
+}
+
+void LightList::build() {
+    float total = 0.f;
+    for (const SharedLightPtr &light : lights) {
+        total += light->power();
+    }
+    cdf.clear();
+    float sum = 0.f;
+    for (const SharedLightPtr &light : lights) {
+        // lights without power are still picked with equal chance when no light has any
+        light->selectPdf = total > 0.f ? light->power() / total : 1.f / lights.size();
+        sum += light->selectPdf;
+        cdf.push_back(sum);
+    }
+}
+
+Light *LightList::select(float u) const {
+    const int index = int(std::upper_bound(cdf.begin(), cdf.end(), u * cdf.back()) - cdf.begin());
+    return lights[std::min(index, int(lights.size()) - 1)].get();
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "Material.hpp"
+#include "Primitive.hpp"
+
+/// Direction from a point towards a light with the light arriving along it
+struct LightSample {
+    vec3 dir;  ///< Normalized direction from the shaded point to the sampled point of the light
+    float distance = 0.f;  ///< Distance to the sampled point, shadow rays are traced up to it
+    Color radiance;  ///< Light arriving at the shaded point along dir if nothing is in the way
+    float pdf = 0.f;  ///< Density of dir over the solid angle, 1 for delta lights
+    bool isDelta = false;  ///< The light can only be reached by sampling it, never by a scattered ray
+};
+
+/// Base class for light sources that can be sampled from a point in the scene
+struct Light {
+    float selectPdf = 0.f;  ///< Chance that LightList::select picks this light, set by LightList::build
+
+    /// @brief Sample a point of the light as seen from @from. Called from multiple threads
+    /// @param result [out] - the direction, distance and light arriving from the sampled point
+    /// @return false if nothing of the light can be sampled from @from
+    virtual bool sample(const vec3 &from, LightSample &result) = 0;
+
+    /// @brief Light emitted towards the origin of @ray by the surface of the light at @hit
+    virtual Color emitted(const Ray &ray, const Intersection &hit) {
+        return Color(0.f);
+    }
+
+    /// @brief Density over the solid angle with which sample picks the direction of @ray from its origin, when @ray
+    ///        hits the surface of the light at @hit
+    virtual float pdf(const Ray &ray, const Intersection &hit) {
+        return 0.f;
+    }
+
+    /// @brief Total emitted power as luminance, lights are selected in proportion to it
+    virtual float power() const = 0;
+
+    virtual ~Light() = default;
+};
+
+typedef std::shared_ptr<Light> SharedLightPtr;
+
+/// Light from a single point, the same intensity in all directions
+struct PointLight : Light {
+    vec3 position;
+    Color intensity;  ///< Radiance times area, the light arriving at distance d is intensity / d^2
+
+    PointLight(const vec3 &position, const Color &intensity) : position(position), intensity(intensity) {}
+
+    bool sample(const vec3 &from, LightSample &result) override;
+    float power() const override;
+};
+
+/// One sided parallelogram light, emits from the side its normal cross(edgeU, edgeV) points to and blocks rays from
+/// both sides. Added to the scene both as a primitive and as a light.
+struct QuadLight : Primitive, Light {
+    vec3 corner;
+    vec3 edgeU;
+    vec3 edgeV;
+    Color radiance;  ///< Emitted radiance, the same over the whole surface and in all directions
+    vec3 normal;
+    float area;
+    MaterialId material = NO_MATERIAL;  ///< A LightSurface pointing to this light, set by Scene::addLight
+
+    QuadLight(const vec3 &corner, const vec3 &edgeU, const vec3 &edgeV, const Color &radiance);
+
+    bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+
+    bool sample(const vec3 &from, LightSample &result) override;
+    Color emitted(const Ray &ray, const Intersection &hit) override;
+    float pdf(const Ray &ray, const Intersection &hit) override;
+    float power() const override;
+};
+
+/// All lights of a scene, selected at random in proportion to their power
+struct LightList {
+    std::vector<SharedLightPtr> lights;
+    std::vector<float> cdf;  ///< Sum of the select chances of the lights up to and including each one
+
+    void add(SharedLightPtr light) {
+        lights.push_back(std::move(light));
+    }
+
+    bool empty() const {
+        return lights.empty();
+    }
+
+    /// @brief Compute the select chance of each light, must be called after all lights are added
+    void build();
+
+    /// @brief Pick a light with chance equal to its selectPdf
+    /// @param u - uniform number in [0, 1)
+    Light *select(float u) const;
+};
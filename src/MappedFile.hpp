@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/// Read only memory mapping of a whole file, pages are loaded by the OS on first access
+struct MappedFile {
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    /// @brief Map the file at @path, any previously mapped file is closed
+    /// @return true on success, false if the file does not exist, is empty or can not be mapped
+    bool open(const char *path) {
+        close();
+#if defined(_WIN32)
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) {
+            close();
+            return false;
+        }
+        bytes = static_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!bytes) {
+            close();
+            return false;
+        }
+        byteCount = size_t(fileSize.QuadPart);
+#else
+        const int fd = ::open(path, O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void *view = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        // the mapping keeps its own reference to the file
+        ::close(fd);
+        if (view == MAP_FAILED) {
+            return false;
+        }
+        bytes = static_cast<const uint8_t *>(view);
+        byteCount = size_t(info.st_size);
+#endif
+        return true;
+    }
+
+    void close() {
+#if defined(_WIN32)
+        if (bytes) {
+            UnmapViewOfFile(bytes);
+        }
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes) {
+            munmap(const_cast<uint8_t *>(bytes), byteCount);
+        }
+#endif
+        bytes = nullptr;
+        byteCount = 0;
+    }
+
+    bool isOpen() const {
+        return bytes != nullptr;
+    }
+
+    const uint8_t *data() const {
+        return bytes;
+    }
+
+    size_t size() const {
+        return byteCount;
+    }
+
+private:
+    const uint8_t *bytes = nullptr;
+    size_t byteCount = 0;
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
@@ -1,17 +1,172 @@
 #include "Material.hpp"
 
 #include "Primitive.hpp"
+#include "Sampler.hpp"
 
-bool Lambert::shade(const Ray &ray, const Intersection &data, Color &attenuation, Ray &scatter) {
-    const vec3 target = data.p + data.normal + randomUnitSphere();
-    scatter = Ray{data.p, (target - data.p).normalized()};
-    attenuation = albedo;
-    return true;
+/// Smallest GGX alpha, below it the distribution is too sharp for float
+static const float MIN_ALPHA = 1e-3f;
+
+bool Lambert::sample(const Ray &ray, const Intersection &data, MaterialSample &result) const {
+    // uniform point on the disk projected up to the hemisphere has density cos / PI
+    const float radius = sqrtf(randFloat());
+    const float phi = 2.f * PI * randFloat();
+    const float z = sqrtf(std::max(1.f - radius * radius, 0.f));
+    result.dir = Frame(data.normal).toWorld(vec3(radius * cosf(phi), radius * sinf(phi), z));
+    result.pdf = z / PI;
+    result.weight = albedo;
+    return result.pdf > 0.f;
+}
+
+Color Lambert::eval(const Ray &ray, const Intersection &data, const vec3 &dir) const {
+    return albedo * (std::max(dot(dir, data.normal), 0.f) / PI);
+}
+
+float Lambert::pdf(const Ray &ray, const Intersection &data, const vec3 &dir) const {
+    return std::max(dot(dir, data.normal), 0.f) / PI;
+}
+
+/// @brief GGX distribution of the microfacet normals, @cosine is the cosine of the microfacet normal with the normal
+static float ggxDistribution(float cosine, float alpha) {
+    const float alpha2 = alpha * alpha;
+    const float d = cosine * cosine * (alpha2 - 1.f) + 1.f;
+    return alpha2 / (PI * d * d);
+}
+
+/// @brief Smith's Lambda of the GGX distribution for a direction with cosine @cosine with the normal
+static float ggxLambda(float cosine, float alpha) {
+    const float cosine2 = cosine * cosine;
+    const float tangent2 = std::max(1.f - cosine2, 0.f) / cosine2;
+    return 0.5f * (sqrtf(1.f + alpha * alpha * tangent2) - 1.f);
+}
+
+/// @brief Sample a microfacet normal from the GGX normals visible from @view, all in local space with the normal as
+///        the z axis, "Sampling the GGX Distribution of Visible Normals" (Heitz 2018)
+static vec3 sampleVisibleNormal(const vec3 &view, float alpha, float u1, float u2) {
+    // stretch to the hemisphere configuration, where the visible normals are a projected disk
+    const vec3 hemisphere = vec3(alpha * view.x, alpha * view.y, view.z).normalized();
+    const float lengthSquare = hemisphere.x * hemisphere.x + hemisphere.y * hemisphere.y;
+    const vec3 t1 = lengthSquare > 0.f ? vec3(-hemisphere.y, hemisphere.x, 0.f) / sqrtf(lengthSquare) : vec3(1, 0, 0);
+    const vec3 t2 = cross(hemisphere, t1);
+
+    const float radius = sqrtf(u1);
+    const float phi = 2.f * PI * u2;
+    const float p1 = radius * cosf(phi);
+    const float s = 0.5f * (1.f + hemisphere.z);
+    const float p2 = (1.f - s) * sqrtf(std::max(1.f - p1 * p1, 0.f)) + s * radius * sinf(phi);
+    const vec3 normal = p1 * t1 + p2 * t2 + sqrtf(std::max(1.f - p1 * p1 - p2 * p2, 0.f)) * hemisphere;
+
+    // unstretch back to the ellipsoid configuration
+    return vec3(alpha * normal.x, alpha * normal.y, std::max(normal.z, 0.f)).normalized();
+}
+
+/// @brief Schlick's approximation of the Fresnel reflectance, @cosine is the cosine of the angle of incidence
+static Color fresnelSchlick(const Color &f0, float cosine) {
+    const float m = std::min(std::max(1.f - cosine, 0.f), 1.f);
+    const float m5 = m * m * m * m * m;
+    return f0 + (Color(1.f) - f0) * m5;
+}
+
+bool Metal::sample(const Ray &ray, const Intersection &data, MaterialSample &result) const {
+    const Frame frame(data.normal);
+    const vec3 view = frame.toLocal(-ray.dir);
+    if (view.z <= 0.f) {
+        return false;
+    }
+    const float alpha = std::max(roughness, MIN_ALPHA);
+    const float u1 = randFloat();
+    const float u2 = randFloat();
+    const vec3 micro = sampleVisibleNormal(view, alpha, u1, u2);
+    const float viewDotMicro = dot(view, micro);
+    const vec3 light = 2.f * viewDotMicro * micro - view;
+    if (light.z <= 0.f) {
+        return false;
+    }
+    // the density of the reflected direction is D_visible / (4 * dot(view, micro)), which leaves
+    // eval / pdf = F * G2 / G1 with the rest cancelling out
+    const float lambdaView = ggxLambda(view.z, alpha);
+    const float lambdaLight = ggxLambda(light.z, alpha);
+    result.dir = frame.toWorld(light).normalized();
+    result.pdf = ggxDistribution(micro.z, alpha) / (4.f * view.z * (1.f + lambdaView));
+    result.weight = fresnelSchlick(albedo, viewDotMicro) * ((1.f + lambdaView) / (1.f + lambdaView + lambdaLight));
+    return result.pdf > 0.f;
+}
+
+Color Metal::eval(const Ray &ray, const Intersection &data, const vec3 &dir) const {
+    const vec3 view = -ray.dir;
+    const float viewCos = dot(view, data.normal);
+    const float lightCos = dot(dir, data.normal);
+    if (viewCos <= 0.f || lightCos <= 0.f) {
+        return Color(0.f);
+    }
+    const float alpha = std::max(roughness, MIN_ALPHA);
+    const vec3 micro = (view + dir).normalized();
+    const float shadowing = 1.f / (1.f + ggxLambda(viewCos, alpha) + ggxLambda(lightCos, alpha));
+    // F * D * G2 / (4 * cos view * cos light), times the cosine of the light
+    return fresnelSchlick(albedo, dot(view, micro)) *
+           (ggxDistribution(dot(micro, data.normal), alpha) * shadowing / (4.f * viewCos));
+}
+
+float Metal::pdf(const Ray &ray, const Intersection &data, const vec3 &dir) const {
+    const vec3 view = -ray.dir;
+    const float viewCos = dot(view, data.normal);
+    if (viewCos <= 0.f || dot(dir, data.normal) <= 0.f) {
+        return 0.f;
+    }
+    const float alpha = std::max(roughness, MIN_ALPHA);
+    const vec3 micro = (view + dir).normalized();
+    return ggxDistribution(dot(micro, data.normal), alpha) / (4.f * viewCos * (1.f + ggxLambda(viewCos, alpha)));
+}
+
+MaterialId MaterialTable::add(const Lambert &material) {
+    lamberts.push_back(material);
+    return makeMaterialId(MaterialType::Lambert, uint32_t(lamberts.size() - 1));
+}
+
+MaterialId MaterialTable::add(const Metal &material) {
+    metals.push_back(material);
+    return makeMaterialId(MaterialType::Metal, uint32_t(metals.size() - 1));
+}
+
+MaterialId MaterialTable::add(const LightSurface &material) {
+    lightSurfaces.push_back(material);
+    return makeMaterialId(MaterialType::LightSurface, uint32_t(lightSurfaces.size() - 1));
+}
+
+bool MaterialTable::sample(const Ray &in, const Intersection &data, MaterialSample &result) const {
+    const uint32_t index = getMaterialIndex(data.material);
+    switch (getMaterialType(data.material)) {
+    case MaterialType::Lambert:
+        return lamberts[index].sample(in, data, result);
+    case MaterialType::Metal:
+        return metals[index].sample(in, data, result);
+    case MaterialType::LightSurface:
+        return false;
+    }
+    return false;
+}
+
+Color MaterialTable::eval(const Ray &in, const Intersection &data, const vec3 &dir) const {
+    const uint32_t index = getMaterialIndex(data.material);
+    switch (getMaterialType(data.material)) {
+    case MaterialType::Lambert:
+        return lamberts[index].eval(in, data, dir);
+    case MaterialType::Metal:
+        return metals[index].eval(in, data, dir);
+    case MaterialType::LightSurface:
+        return Color(0.f);
+    }
+    return Color(0.f);
 }
 
-bool Metal::shade(const Ray &ray, const Intersection &data, Color &attenuation, Ray &scatter) {
-    const vec3 reflected = (reflect(ray.dir, data.normal).normalized() + fuzz * randomUnitSphere()).normalized();
-    scatter = Ray{data.p, reflected};
-    attenuation = albedo;
-    return dot(scatter.dir, data.normal) > 0.f;
+float MaterialTable::pdf(const Ray &in, const Intersection &data, const vec3 &dir) const {
+    const uint32_t index = getMaterialIndex(data.material);
+    switch (getMaterialType(data.material)) {
+    case MaterialType::Lambert:
+        return lamberts[index].pdf(in, data, dir);
+    case MaterialType::Metal:
+        return metals[index].pdf(in, data, dir);
+    case MaterialType::LightSurface:
+        return 0.f;
+    }
+    return 0.f;
 }
@@ -1,37 +1,103 @@
 #pragma once
 #include "Image.hpp"
 #include "Utils.hpp"
-#include <memory>
+#include <cstdint>
+#include <vector>
 
 struct Intersection;
+struct Light;
 
-/// Base class for a surface material
-struct Material {
-	/// @brief Shade an intersection. Called from multiple threads
-	/// @param in - the ray that created the intersection
-	/// @param data - surface properties of the intersection
-	/// @param attenuation [out] - color attenuation for the at the intersection
-	/// @param scatter [out] - new scatter ray from the intersection
-	virtual bool shade(const Ray &in, const Intersection &data, Color &attenuation, Ray &scatter) = 0;
+/// Direction sampled from a material with its weight and density
+struct MaterialSample {
+	vec3 dir; ///< Direction of the scattered ray, normalized
+	Color weight; ///< Value of eval for dir divided by pdf, what the path throughput is multiplied by
+	float pdf = 0.f; ///< Density of dir over the solid angle
+};
+
+/// The kinds of materials, each one is stored in its own array of MaterialTable
+enum class MaterialType : uint32_t {
+	Lambert,
+	Metal,
+	LightSurface,
 };
 
-typedef std::unique_ptr<Material> MaterialPtr;
-typedef std::shared_ptr<Material> SharedMaterialPtr;
+/// Handle of a material in a MaterialTable, the type is in the top MATERIAL_TYPE_BITS and the index in the array of
+/// the type below them, so sorting by id also groups the materials by type
+typedef uint32_t MaterialId;
+
+static const int MATERIAL_TYPE_BITS = 4;
+static const int MATERIAL_INDEX_BITS = 32 - MATERIAL_TYPE_BITS;
+static const MaterialId NO_MATERIAL = UINT32_MAX; ///< Keeps the primitive's own material when instancing
+
+inline MaterialId makeMaterialId(MaterialType type, uint32_t index) {
+	return uint32_t(type) << MATERIAL_INDEX_BITS | index;
+}
 
-struct Lambert : Material {
+inline MaterialType getMaterialType(MaterialId id) {
+	return MaterialType(id >> MATERIAL_INDEX_BITS);
+}
+
+inline uint32_t getMaterialIndex(MaterialId id) {
+	return id & ((1u << MATERIAL_INDEX_BITS) - 1);
+}
+
+// All materials implement the same 3 functions, called from multiple threads through MaterialTable.
+// All directions point away from the surface, except the direction of the ray that created the intersection.
+//   bool sample(in, data, result) - sample the direction of the ray scattered at an intersection, false if the ray
+//                                   is absorbed
+//   Color eval(in, data, dir) - the BSDF for light scattered from @dir into the reverse of @in, times the cosine of
+//                               @dir with the normal
+//   float pdf(in, data, dir) - the density over the solid angle with which sample picks @dir
+
+/// Ideal diffuse surface, sampled with density proportional to the cosine with the normal
+struct Lambert {
 	Color albedo;
-	Lambert(Color albedo)
-		: albedo(albedo)
-	{}
-	bool shade(const Ray& ray, const Intersection& data, Color& attenuation, Ray& scatter) override;
+	bool sample(const Ray& ray, const Intersection& data, MaterialSample& result) const;
+	Color eval(const Ray& ray, const Intersection& data, const vec3& dir) const;
+	float pdf(const Ray& ray, const Intersection& data, const vec3& dir) const;
 };
 
-struct Metal : Material {
-	Color albedo;
-	float fuzz;
-	Metal(Color albedo, float fuzz)
-		: albedo(albedo)
-		, fuzz(fuzz)
-	{}
-	bool shade(const Ray& ray, const Intersection& data, Color& attenuation, Ray& scatter) override;
+/// Rough conductor with the GGX microfacet distribution and Schlick's Fresnel, sampled with the distribution of the
+/// normals visible from the incoming direction
+struct Metal {
+	Color albedo; ///< Reflectance at normal incidence
+	float roughness; ///< Alpha of the GGX distribution, 0 is a mirror and 1 is close to diffuse
+	bool sample(const Ray& ray, const Intersection& data, MaterialSample& result) const;
+	Color eval(const Ray& ray, const Intersection& data, const vec3& dir) const;
+	float pdf(const Ray& ray, const Intersection& data, const vec3& dir) const;
+};
+
+/// Material of the surfaces of area lights, absorbs all light that arrives and leaves the emission to the light
+struct LightSurface {
+	Light *light;
+};
+
+/// All materials of a scene, the parameters of each type are kept in a flat array and a material is referenced by
+/// its MaterialId. The functions dispatch on the type with a switch, so the code of each type is inlined in them.
+struct MaterialTable {
+	std::vector<Lambert> lamberts;
+	std::vector<Metal> metals;
+	std::vector<LightSurface> lightSurfaces;
+
+	MaterialId add(const Lambert &material);
+	MaterialId add(const Metal &material);
+	MaterialId add(const LightSurface &material);
+
+	/// @brief Sample the direction of the ray scattered at an intersection with the material of the intersection
+	/// @param in - the ray that created the intersection
+	/// @param data - surface properties of the intersection
+	/// @param result [out] - the sampled direction with its weight and density
+	/// @return false if the ray is absorbed
+	bool sample(const Ray &in, const Intersection &data, MaterialSample &result) const;
+
+	/// @brief Evaluate the BSDF of the material of the intersection, see the functions of the materials above
+	Color eval(const Ray &in, const Intersection &data, const vec3 &dir) const;
+
+	/// @brief Get the density with which sample picks @dir
+	float pdf(const Ray &in, const Intersection &data, const vec3 &dir) const;
+
+	/// @brief Get the light that emits from the surfaces with material @id, nullptr if they do not emit
+	Light *getLight(MaterialId id) const {
+		return getMaterialType(id) == MaterialType::LightSurface ? lightSurfaces[getMaterialIndex(id)].light : nullptr;
+	}
 };
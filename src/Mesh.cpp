@@ -1,8 +1,10 @@
-#define TINYOBJLOADER_IMPLEMENTATION
-
 #include "Mesh.hpp"
 
-#include "third_party/tiny_obj_loader.h"
+#include <atomic>
+#include <cstdio>
+
+#include "MappedFile.hpp"
+#include "Threading.hpp"
 
 /// source https://github.com/anrieff/quaddamage/blob/master/src/mesh.cpp
 bool intersectTriangleFast(const Ray& ray, const vec3& A, const vec3& B, const vec3& C, float& dist) {
@@ -59,15 +61,12 @@ bool TriangleMesh::Triangle::intersect(const Ray& ray, float tMin, float tMax, I
     const vec3 AB = B - A;
     const vec3 AC = C - A;
 
-    const vec3 normal = cross(AB, AC).normalized();
-    ;
+    const vec3 ABcrossAC = cross(AB, AC);
 
-    if (dot(ray.dir, normal) > 0) {
+    if (dot(ray.dir, ABcrossAC) > 0) {
         return false;
     }
 
-    const vec3 ABcrossAC = cross(AB, AC);
-
     const vec3 H = ray.origin - A;
     const vec3 D = ray.dir;
 
@@ -98,14 +97,112 @@ bool TriangleMesh::Triangle::intersect(const Ray& ray, float tMin, float tMax, I
         return false;
     }
 
+    // the point, normal and material are filled by the owner mesh once the closest triangle is known
     intersection.t = gamma;
-    intersection.p = ray.origin + ray.dir * gamma;
-    intersection.normal = normal;
-    intersection.material = owner->material.get();
+    intersection.primitive = uint32_t(this - owner->faces.data());
+    intersection.u = lambda2;
+    intersection.v = lambda3;
 
     return true;
 }
 
+/// @brief Same test as Triangle::intersect done for 4 rays of the packet at a time
+uint32_t TriangleMesh::Triangle::intersectPacket(RayPacket& packet, uint32_t active, float tMin, Intersection* hits) {
+#if defined(RT_X86)
+    const vec3& A = owner->vertices[indices[0]];
+    const vec3& B = owner->vertices[indices[1]];
+    const vec3& C = owner->vertices[indices[2]];
+    const vec3 AB = B - A;
+    const vec3 AC = C - A;
+    const vec3 ABcrossAC = cross(AB, AC);
+
+    const auto dot4 = [](__m128 x, __m128 y, __m128 z, const vec3& v) {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(v.x)), _mm_mul_ps(y, _mm_set1_ps(v.y))),
+                          _mm_mul_ps(z, _mm_set1_ps(v.z)));
+    };
+
+    uint32_t hitMask = 0;
+    for (int group = 0; group < RayPacket::SIZE / 4; group++) {
+        const int offset = group * 4;
+        const uint32_t groupActive = (active >> offset) & 0xF;
+        if (!groupActive) {
+            continue;
+        }
+        const __m128 Dx = _mm_load_ps(packet.dir[0] + offset);
+        const __m128 Dy = _mm_load_ps(packet.dir[1] + offset);
+        const __m128 Dz = _mm_load_ps(packet.dir[2] + offset);
+        const __m128 Hx = _mm_sub_ps(_mm_load_ps(packet.origin[0] + offset), _mm_set1_ps(A.x));
+        const __m128 Hy = _mm_sub_ps(_mm_load_ps(packet.origin[1] + offset), _mm_set1_ps(A.y));
+        const __m128 Hz = _mm_sub_ps(_mm_load_ps(packet.origin[2] + offset), _mm_set1_ps(A.z));
+
+        // back facing and parallel rays have Dcr <= 0
+        const __m128 Dcr = _mm_sub_ps(_mm_setzero_ps(), dot4(Dx, Dy, Dz, ABcrossAC));
+        __m128 valid = _mm_cmpge_ps(Dcr, _mm_set1_ps(1e-12f));
+        const __m128 rDcr = _mm_div_ps(_mm_set1_ps(1.f), Dcr);
+
+        const __m128 gamma = _mm_mul_ps(dot4(Hx, Hy, Hz, ABcrossAC), rDcr);
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(gamma, _mm_set1_ps(tMin)));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(gamma, _mm_load_ps(packet.tMax + offset)));
+
+        const __m128 HcrossDx = _mm_sub_ps(_mm_mul_ps(Hy, Dz), _mm_mul_ps(Hz, Dy));
+        const __m128 HcrossDy = _mm_sub_ps(_mm_mul_ps(Hz, Dx), _mm_mul_ps(Hx, Dz));
+        const __m128 HcrossDz = _mm_sub_ps(_mm_mul_ps(Hx, Dy), _mm_mul_ps(Hy, Dx));
+        const __m128 lambda2 = _mm_mul_ps(dot4(HcrossDx, HcrossDy, HcrossDz, AC), rDcr);
+        const __m128 lambda3 = _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(dot4(HcrossDx, HcrossDy, HcrossDz, AB), rDcr));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(lambda2, _mm_setzero_ps()));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(lambda3, _mm_setzero_ps()));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(lambda2, lambda3), _mm_set1_ps(1.f)));
+
+        const uint32_t groupHits = uint32_t(_mm_movemask_ps(valid)) & groupActive;
+        if (!groupHits) {
+            continue;
+        }
+        float distances[4], u[4], v[4];
+        _mm_storeu_ps(distances, gamma);
+        _mm_storeu_ps(u, lambda2);
+        _mm_storeu_ps(v, lambda3);
+        const uint32_t index = uint32_t(this - owner->faces.data());
+        for (uint32_t mask = groupHits; mask; mask &= mask - 1) {
+            const int lane = offset + lowestBit(mask);
+            Intersection& intersection = hits[lane];
+            intersection.t = distances[lane - offset];
+            intersection.primitive = index;
+            intersection.u = u[lane - offset];
+            intersection.v = v[lane - offset];
+            packet.tMax[lane] = intersection.t;
+        }
+        hitMask |= groupHits << offset;
+    }
+    return hitMask;
+#else
+    return Intersectable::intersectPacket(packet, active, tMin, hits);
+#endif
+}
+
+/// @brief Same test as Triangle::intersect without normalizing the normal and filling the intersection
+bool TriangleMesh::Triangle::occluded(const Ray& ray, float tMin, float tMax) {
+    const vec3& A = owner->vertices[indices[0]];
+    const vec3 AB = owner->vertices[indices[1]] - A;
+    const vec3 AC = owner->vertices[indices[2]] - A;
+    const vec3 ABcrossAC = cross(AB, AC);
+    const vec3 H = ray.origin - A;
+
+    // back facing and parallel triangles are skipped like in intersect
+    const float Dcr = -dot(ABcrossAC, ray.dir);
+    if (Dcr < 1e-12f) {
+        return false;
+    }
+    const float rDcr = 1.f / Dcr;
+    const float gamma = dot(ABcrossAC, H) * rDcr;
+    if (gamma < tMin || gamma > tMax) {
+        return false;
+    }
+    const vec3 HcrossD = cross(H, ray.dir);
+    const float lambda2 = dot(HcrossD, AC) * rDcr;
+    const float lambda3 = -dot(AB, HcrossD) * rDcr;
+    return lambda2 >= 0 && lambda3 >= 0 && lambda2 + lambda3 <= 1;
+}
+
 int signOf(float f) {
     return (f > 0) - (f < 0);
 }
@@ -123,10 +220,10 @@ bool TriangleMesh::Triangle::boxIntersect(const BBox& box) {
     for (int i = 0; i < 3; i++) {
         for (int j = i + 1; j < 3; j++) {
             ray.origin = t[i];
-            ray.dir = t[j] - t[i];
+            ray.setDir(t[j] - t[i]);
             if (box.testIntersect(ray)) {
                 ray.origin = t[j];
-                ray.dir = t[i] - t[j];
+                ray.setDir(t[i] - t[j]);
                 if (box.testIntersect(ray)) {
                     return true;
                 }
@@ -148,7 +245,7 @@ bool TriangleMesh::Triangle::boxIntersect(const BBox& box) {
             vec3 rayEnd = ray.origin;
             rayEnd[j] = box.max[j];
             if (signOf(dot(ray.origin, ABcrossAC) - D) != signOf(dot(rayEnd, ABcrossAC) - D)) {
-                ray.dir = rayEnd - ray.origin;
+                ray.setDir(rayEnd - ray.origin);
                 float gamma = 1.0000001;
                 if (intersectTriangleFast(ray, A, B, C, gamma)) {
                     return true;
@@ -165,78 +262,887 @@ void TriangleMesh::Triangle::expandBox(BBox& box) {
     }
 }
 
-void TriangleMesh::onBeforeRender() {
+void TriangleMesh::TriangleSoA::init(const std::vector<vec3>& vertices, const std::vector<Triangle>& faces) {
+    count = uint32_t(faces.size());
+    // padding triangles have all edges 0 and are never hit, a group starting at the last triangle stays in bounds
+    const size_t padded = faces.size() + PADDING;
+    for (int c = 0; c < 3; c++) {
+        A[c].assign(padded, 0.f);
+        AB[c].assign(padded, 0.f);
+        AC[c].assign(padded, 0.f);
+        N[c].assign(padded, 0.f);
+    }
+    for (int r = 0; r < faces.size(); r++) {
+        const vec3& a = vertices[faces[r].indices[0]];
+        const vec3 ab = vertices[faces[r].indices[1]] - a;
+        const vec3 ac = vertices[faces[r].indices[2]] - a;
+        const vec3 n = cross(ab, ac);
+        for (int c = 0; c < 3; c++) {
+            A[c][r] = a[c];
+            AB[c][r] = ab[c];
+            AC[c][r] = ac[c];
+            N[c][r] = n[c];
+        }
+    }
+}
+
+/// @brief Same test as Triangle::intersect with the stored edges and normal
+int TriangleMesh::TriangleSoA::intersect(
+    const Ray& ray, uint32_t first, uint32_t count, float tMin, float& tMax, float& u, float& v) const {
+    int closest = -1;
+#if defined(RT_X86)
+    const __m128 Dx = _mm_set1_ps(ray.dir.x);
+    const __m128 Dy = _mm_set1_ps(ray.dir.y);
+    const __m128 Dz = _mm_set1_ps(ray.dir.z);
+    for (uint32_t group = first; group < first + count; group += LANES) {
+        const __m128 ABx = _mm_loadu_ps(&AB[0][group]);
+        const __m128 ABy = _mm_loadu_ps(&AB[1][group]);
+        const __m128 ABz = _mm_loadu_ps(&AB[2][group]);
+        const __m128 ACx = _mm_loadu_ps(&AC[0][group]);
+        const __m128 ACy = _mm_loadu_ps(&AC[1][group]);
+        const __m128 ACz = _mm_loadu_ps(&AC[2][group]);
+        const __m128 Nx = _mm_loadu_ps(&N[0][group]);
+        const __m128 Ny = _mm_loadu_ps(&N[1][group]);
+        const __m128 Nz = _mm_loadu_ps(&N[2][group]);
+        const __m128 Hx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(&A[0][group]));
+        const __m128 Hy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(&A[1][group]));
+        const __m128 Hz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(&A[2][group]));
+
+        // back facing and parallel triangles have Dcr <= 0, padding triangles have Dcr = 0
+        const __m128 Dcr = _mm_sub_ps(
+            _mm_setzero_ps(), _mm_add_ps(_mm_add_ps(_mm_mul_ps(Nx, Dx), _mm_mul_ps(Ny, Dy)), _mm_mul_ps(Nz, Dz)));
+        __m128 valid = _mm_cmpge_ps(Dcr, _mm_set1_ps(1e-12f));
+        const __m128 rDcr = _mm_div_ps(_mm_set1_ps(1.f), Dcr);
+
+        const __m128 gamma =
+            _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(Nx, Hx), _mm_mul_ps(Ny, Hy)), _mm_mul_ps(Nz, Hz)), rDcr);
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(gamma, _mm_set1_ps(tMin)));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(gamma, _mm_set1_ps(tMax)));
+
+        const __m128 HcrossDx = _mm_sub_ps(_mm_mul_ps(Hy, Dz), _mm_mul_ps(Hz, Dy));
+        const __m128 HcrossDy = _mm_sub_ps(_mm_mul_ps(Hz, Dx), _mm_mul_ps(Hx, Dz));
+        const __m128 HcrossDz = _mm_sub_ps(_mm_mul_ps(Hx, Dy), _mm_mul_ps(Hy, Dx));
+        const __m128 lambda2 = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(HcrossDx, ACx), _mm_mul_ps(HcrossDy, ACy)), _mm_mul_ps(HcrossDz, ACz)),
+            rDcr);
+        const __m128 lambda3 = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(HcrossDx, ABx), _mm_mul_ps(HcrossDy, ABy)), _mm_mul_ps(HcrossDz, ABz)),
+            _mm_sub_ps(_mm_setzero_ps(), rDcr));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(lambda2, _mm_setzero_ps()));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(lambda3, _mm_setzero_ps()));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(lambda2, lambda3), _mm_set1_ps(1.f)));
+
+        uint32_t mask = uint32_t(_mm_movemask_ps(valid));
+        if (first + count - group < LANES) {
+            mask &= (1u << (first + count - group)) - 1;
+        }
+        if (!mask) {
+            continue;
+        }
+        float distances[LANES], lambdas2[LANES], lambdas3[LANES];
+        _mm_storeu_ps(distances, gamma);
+        _mm_storeu_ps(lambdas2, lambda2);
+        _mm_storeu_ps(lambdas3, lambda3);
+        for (; mask; mask &= mask - 1) {
+            const int lane = lowestBit(mask);
+            if (distances[lane] <= tMax) {
+                tMax = distances[lane];
+                u = lambdas2[lane];
+                v = lambdas3[lane];
+                closest = int(group) + lane;
+            }
+        }
+    }
+#else
+    for (uint32_t c = first; c < first + count; c++) {
+        const vec3 ab(AB[0][c], AB[1][c], AB[2][c]);
+        const vec3 ac(AC[0][c], AC[1][c], AC[2][c]);
+        const vec3 n(N[0][c], N[1][c], N[2][c]);
+        const vec3 H = ray.origin - vec3(A[0][c], A[1][c], A[2][c]);
+        const float Dcr = -dot(n, ray.dir);
+        if (Dcr < 1e-12f) {
+            continue;
+        }
+        const float rDcr = 1.f / Dcr;
+        const float gamma = dot(n, H) * rDcr;
+        if (gamma < tMin || gamma > tMax) {
+            continue;
+        }
+        const vec3 HcrossD = cross(H, ray.dir);
+        const float lambda2 = dot(HcrossD, ac) * rDcr;
+        const float lambda3 = -dot(ab, HcrossD) * rDcr;
+        if (lambda2 < 0 || lambda3 < 0 || lambda2 + lambda3 > 1) {
+            continue;
+        }
+        tMax = gamma;
+        u = lambda2;
+        v = lambda3;
+        closest = int(c);
+    }
+#endif
+    return closest;
+}
+
+/// @brief Get the type of the tree over the mesh triangles for the default accelerator type and the running CPU
+static AcceleratorType meshTreeType() {
+    const AcceleratorType type = getDefaultAcceleratorType();
+    if (type == AcceleratorType::BVH8 && !cpuSupportsAVX2()) {
+        return AcceleratorType::BVH4;
+    }
+    return type;
+}
+
+/// @brief Check if the mesh builds its own tree over TriangleSoA for @type instead of using an accelerator
+static bool usesTriangleTree(AcceleratorType type) {
+    return type == AcceleratorType::BVH || type == AcceleratorType::BVH4 || type == AcceleratorType::BVH8;
+}
+
+static const char *triangleTreeName(AcceleratorType type) {
+    return type == AcceleratorType::BVH8 ? "BVH8" : type == AcceleratorType::BVH4 ? "BVH4" : "BVH";
+}
+
+static BVHBuildSettings triangleTreeSettings() {
+    BVHBuildSettings settings;
+    settings.maxLeafSize = TriangleMesh::TriangleSoA::LANES;
+    return settings;
+}
+
+void TriangleMesh::onBeforeRender(ThreadManager *threads) {
+    const AcceleratorType type = meshTreeType();
+    if (usesTriangleTree(type)) {
+        if (!triangles.count) {
+            buildTriangleTree(type, threads);
+        }
+        saveCache();
+        return;
+    }
+
+    // the oct and kd trees point to the faces, so only the mesh itself is cached for them
+    saveCache();
     if (faces.size() < 50) {
         return;
     }
 
     if (!accelerator) {
-        accelerator = makeDefaultAccelerator();
+        accelerator = makeAccelerator<Triangle>(type);
     }
 
     if (!accelerator->isBuilt()) {
         for (int c = 0; c < faces.size(); c++) {
             accelerator->addPrimitive(&faces[c]);
         }
-        accelerator->build(IntersectionAccelerator::Purpose::Mesh);
+        accelerator->build(IntersectionAccelerator::Purpose::Mesh, threads);
     }
 }
 
-bool TriangleMesh::loadFromObj(const std::string& objPath) {
-    tinyobj::attrib_t inattrib;
-    std::vector<tinyobj::shape_t> inshapes;
-    std::string error;
-    std::vector<tinyobj::material_t> materials;
-    const bool loadRes = tinyobj::LoadObj(&inattrib, &inshapes, &materials, &error, objPath.c_str(), nullptr);
-    if (!loadRes) {
-        printf("Error loading file \"%s\", \"%s\"", objPath.c_str(), error.c_str());
+void TriangleMesh::buildTriangleTree(AcceleratorType type, ThreadManager *threads) {
+    if (faces.empty()) {
+        return;
     }
+    treeType = type;
+    Timer timer;
 
-    static_assert(sizeof(vec3) == sizeof(tinyobj::real_t) * 3, "next line avoids copy with type alias");
-    vertices.swap(reinterpret_cast<std::vector<vec3>&>(inattrib.vertices));
+    std::vector<BBox> boxes(faces.size());
+    for (int c = 0; c < faces.size(); c++) {
+        faces[c].expandBox(boxes[c]);
+    }
+    bvh.build(boxes, triangleTreeSettings(), threads);
+    bvh.applyOrder(faces);
+    triangles.init(vertices, faces);
+    faces.clear();
+    faces.shrink_to_fit();
 
-    for (int c = 0; c < vertices.size(); c++) {
-        box.add(vertices[c]);
+    int nodeCount = int(bvh.nodes.size());
+    int depth = bvh.depth;
+    size_t treeMemory = bvh.memoryUsage();
+    if (type == AcceleratorType::BVH8) {
+        bvh8.build(bvh);
+        nodeCount = int(bvh8.nodes.size());
+        depth = bvh8.depth;
+        treeMemory = bvh8.memoryUsage();
+        bvh.clear();
+    } else if (type == AcceleratorType::BVH4) {
+        bvh4.build(bvh);
+        nodeCount = int(bvh4.nodes.size());
+        depth = bvh4.depth;
+        treeMemory = bvh4.memoryUsage();
+        bvh.clear();
     }
+    printf("Built mesh triangle %s with %d triangles in %ldms, nodes %d, depth %d, %gKB\n",
+           triangleTreeName(type),
+           int(triangles.count),
+           timer.toMs(timer.elapsedNs()),
+           nodeCount,
+           depth,
+           (treeMemory + triangles.memoryUsage()) / 1024.f);
+}
+
+/// Files are split in chunks of at least this many bytes, so small files are parsed by one thread
+static const size_t OBJ_MIN_CHUNK_SIZE = 1 << 16;
+/// Number of chunks for each thread, more than one so threads with faster chunks help the rest
+static const int OBJ_CHUNKS_PER_THREAD = 8;
 
-    for (int c = 0; c < inshapes.size(); c++) {
-        int index = 0;
-        bool skipMesh = false;
-        const tinyobj::mesh_t& mesh = inshapes[c].mesh;
+/// Part of an obj file starting and ending at line boundaries, parsed independently of the other chunks
+struct ObjChunk {
+    const char* begin;
+    const char* end;
+    std::vector<vec3> vertices;
+    std::vector<int> indices;  ///< Vertex indices, 3 for each triangle
+    std::vector<uint32_t> relative;  ///< Positions in @indices relative to the first vertex of the chunk
+    BBox box;
+    int invalidFaces = 0;  ///< Faces skipped because they have less than 3 or unreadable indices
+    uint32_t vertexOffset = 0;  ///< Index of the first vertex of the chunk in the whole file
+    uint32_t indexOffset = 0;
+};
+
+static bool isObjSpace(char c) {
+    return c == ' ' || c == '\t';
+}
 
-        const std::vector<unsigned char>& numFaceVertices = inshapes[c].mesh.num_face_vertices;
-        for (int r = 0; r < numFaceVertices.size(); r++) {
-            if (numFaceVertices[r] != 3) {
-                skipMesh = true;
-                break;
+static const char* skipObjSpaces(const char* p, const char* end) {
+    while (p < end && isObjSpace(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+/// @brief Parse an integer with an optional sign
+/// @return pointer after the parsed value or nullptr if there are no digits at @p
+static const char* parseObjInt(const char* p, const char* end, int& value) {
+    const bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+        ++p;
+    }
+    const char* digits = p;
+    int64_t result = 0;
+    while (p < end && *p >= '0' && *p <= '9' && result <= INT32_MAX) {
+        result = result * 10 + (*p - '0');
+        ++p;
+    }
+    if (p == digits || result > INT32_MAX) {
+        return nullptr;
+    }
+    value = int(negative ? -result : result);
+    return p;
+}
+
+/// @brief Parse a decimal float with optional sign, fraction and exponent, without the locale and allocation
+///        overhead of strtof, the result may differ from the correctly rounded value in the last bit
+/// @return pointer after the parsed value or nullptr if there is no number at @p
+static const char* parseObjFloat(const char* p, const char* end, float& value) {
+    static const double POWERS_OF_10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                          1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+        ++p;
+    }
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int digitCount = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digitCount) {
+        // digits after the 19th do not fit, they only change the scale
+        if (mantissa < 1000000000000000000ull) {
+            mantissa = mantissa * 10 + (*p - '0');
+        } else {
+            ++exponent;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digitCount) {
+            if (mantissa < 1000000000000000000ull) {
+                mantissa = mantissa * 10 + (*p - '0');
+                --exponent;
             }
         }
-        if (skipMesh) {
-            continue;
+    }
+    if (digitCount == 0) {
+        return nullptr;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        int power;
+        const char* afterPower = parseObjInt(p + 1, end, power);
+        if (afterPower) {
+            exponent += std::max(std::min(power, 1000), -1000);
+            p = afterPower;
+        }
+    }
+    double result = double(mantissa);
+    if (exponent < 0) {
+        result = -exponent <= 22 ? result / POWERS_OF_10[-exponent] : result * pow(10.0, exponent);
+    } else if (exponent > 0) {
+        result = exponent <= 22 ? result * POWERS_OF_10[exponent] : result * pow(10.0, exponent);
+    }
+    value = float(negative ? -result : result);
+    return p;
+}
+
+/// @brief Parse the "v" and "f" lines of a chunk, polygons are split in triangle fans, other lines are ignored
+static void parseObjChunk(ObjChunk& chunk) {
+    std::vector<int> polygon;
+    std::vector<bool> polygonRelative;
+    for (const char* p = chunk.begin; p < chunk.end;) {
+        const char* lineEnd = static_cast<const char*>(memchr(p, '\n', chunk.end - p));
+        lineEnd = lineEnd ? lineEnd : chunk.end;
+        p = skipObjSpaces(p, lineEnd);
+
+        if (lineEnd - p > 1 && p[0] == 'v' && isObjSpace(p[1])) {
+            vec3 vertex(0.f);
+            const char* value = p + 1;
+            for (int c = 0; c < 3 && value; c++) {
+                value = parseObjFloat(skipObjSpaces(value, lineEnd), lineEnd, vertex[c]);
+            }
+            chunk.vertices.push_back(vertex);
+            chunk.box.add(vertex);
+        } else if (lineEnd - p > 1 && p[0] == 'f' && isObjSpace(p[1])) {
+            polygon.clear();
+            polygonRelative.clear();
+            bool valid = true;
+            for (const char* vertex = skipObjSpaces(p + 1, lineEnd); vertex < lineEnd && *vertex != '\r' &&
+                                                                     *vertex != '#';
+                 vertex = skipObjSpaces(vertex, lineEnd)) {
+                int index;
+                vertex = parseObjInt(vertex, lineEnd, index);
+                if (!vertex || index == 0) {
+                    valid = false;
+                    break;
+                }
+                // negative indices count back from the last vertex before the face
+                polygon.push_back(index > 0 ? index - 1 : int(chunk.vertices.size()) + index);
+                polygonRelative.push_back(index < 0);
+                // texture coordinate and normal indices are not used
+                while (vertex < lineEnd && !isObjSpace(*vertex) && *vertex != '\r') {
+                    ++vertex;
+                }
+            }
+            if (!valid || polygon.size() < 3) {
+                ++chunk.invalidFaces;
+            } else {
+                for (int c = 1; c + 1 < int(polygon.size()); c++) {
+                    const int corners[3] = {0, c, c + 1};
+                    for (int corner : corners) {
+                        if (polygonRelative[corner]) {
+                            chunk.relative.push_back(uint32_t(chunk.indices.size()));
+                        }
+                        chunk.indices.push_back(polygon[corner]);
+                    }
+                }
+            }
+        }
+        p = lineEnd + 1;
+    }
+}
+
+bool TriangleMesh::loadFromObj(const std::string& objPath, ThreadManager* threads) {
+    Timer timer;
+    MappedFile file;
+    if (!file.open(objPath.c_str())) {
+        printf("Error loading file \"%s\"\n", objPath.c_str());
+        return false;
+    }
+
+    // split the file at line boundaries so lines are never shared by two chunks
+    const char* data = reinterpret_cast<const char*>(file.data());
+    const char* dataEnd = data + file.size();
+    const size_t chunkCount =
+        std::max<size_t>(1,
+                         std::min<size_t>(file.size() / OBJ_MIN_CHUNK_SIZE,
+                                          size_t(parallelThreadCount(threads)) * OBJ_CHUNKS_PER_THREAD));
+    std::vector<ObjChunk> chunks(chunkCount);
+    const char* chunkBegin = data;
+    for (size_t c = 0; c < chunkCount; c++) {
+        const char* chunkEnd = c + 1 == chunkCount ? dataEnd : data + file.size() / chunkCount * (c + 1);
+        chunkEnd = std::max(chunkEnd, chunkBegin);
+        const char* newLine = static_cast<const char*>(memchr(chunkEnd, '\n', dataEnd - chunkEnd));
+        chunkEnd = newLine ? newLine + 1 : dataEnd;
+        chunks[c].begin = chunkBegin;
+        chunks[c].end = chunkEnd;
+        chunkBegin = chunkEnd;
+    }
+
+    parallelFor(threads, int(chunkCount), [&](int c, int) {
+        parseObjChunk(chunks[c]);
+    });
+
+    uint32_t vertexCount = 0, indexCount = 0;
+    for (ObjChunk& chunk : chunks) {
+        chunk.vertexOffset = vertexCount;
+        chunk.indexOffset = indexCount;
+        vertexCount += uint32_t(chunk.vertices.size());
+        indexCount += uint32_t(chunk.indices.size());
+        box.add(chunk.box);
+    }
+
+    // copy the chunks to their place in the mesh arrays, resolving the indices relative to the chunk
+    vertices.resize(vertexCount);
+    faces.resize(indexCount / 3);
+    std::atomic<bool> hasInvalidIndex{false};
+    parallelFor(threads, int(chunkCount), [&](int c, int) {
+        ObjChunk& chunk = chunks[c];
+        std::copy(chunk.vertices.begin(), chunk.vertices.end(), vertices.begin() + chunk.vertexOffset);
+        for (uint32_t position : chunk.relative) {
+            chunk.indices[position] += int(chunk.vertexOffset);
+        }
+        for (size_t r = 0; r < chunk.indices.size(); r += 3) {
+            const int* corners = &chunk.indices[r];
+            for (int corner = 0; corner < 3; corner++) {
+                if (corners[corner] < 0 || corners[corner] >= int(vertexCount)) {
+                    hasInvalidIndex = true;
+                }
+            }
+            faces[(chunk.indexOffset + r) / 3] = Triangle(corners[0], corners[1], corners[2], this);
         }
+        std::vector<vec3>().swap(chunk.vertices);
+        std::vector<int>().swap(chunk.indices);
+    });
+
+    int invalidFaces = 0;
+    for (const ObjChunk& chunk : chunks) {
+        invalidFaces += chunk.invalidFaces;
+    }
+    if (invalidFaces) {
+        printf("Skipped %d invalid faces in file \"%s\"\n", invalidFaces, objPath.c_str());
+    }
+    if (hasInvalidIndex) {
+        printf("Error loading file \"%s\", face with vertex index out of range\n", objPath.c_str());
+        vertices.clear();
+        faces.clear();
+        box = BBox{};
+        return false;
+    }
+
+    const int64_t elapsed = timer.elapsedNs();
+    printf("Loaded mesh \"%s\" with %d vertices and %d triangles in %ldms, %gMB/s\n",
+           objPath.c_str(),
+           int(vertices.size()),
+           int(faces.size()),
+           timer.toMs(elapsed),
+           file.size() / (1024.f * 1024.f) / std::max(elapsed * 1e-9f, 1e-9f));
+    return true;
+}
+
+static bool meshCacheEnabled = true;
+
+void setMeshCacheEnabled(bool enabled) {
+    meshCacheEnabled = enabled;
+}
+
+/// Increment when the layout of the cache or of any of the stored types changes
+static const uint32_t MESH_CACHE_VERSION = 3;
+static const char MESH_CACHE_MAGIC[8] = {'R', 'T', 'M', 'E', 'S', 'H', 'C', '\0'};
+/// All arrays in the cache file start at a multiple of this, the alignment of the wide BVH nodes
+static const size_t MESH_CACHE_ALIGNMENT = 64;
 
-        faces.reserve(faces.size() + numFaceVertices.size());
-        for (int r = 0; r < numFaceVertices.size(); r++) {
-            const Triangle face{mesh.indices[index++].vertex_index,
-                                mesh.indices[index++].vertex_index,
-                                mesh.indices[index++].vertex_index,
-                                this};
-            faces.push_back(face);
+/// Start of a mesh cache file, the arrays follow in the order of the counts below
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t treeType;  ///< AcceleratorType the file was made for, the tree is stored only for the triangle trees
+    uint64_t sourceHash;
+    uint64_t sourceSize;
+    int32_t maxLeafSize;
+    int32_t binCount;
+    float traversalCost;
+    uint32_t nodeSize;  ///< Size of the stored tree's node, 0 if there is no tree
+    BBox box;
+    uint32_t vertexCount;
+    uint32_t faceCount;  ///< Number of faces, each stored as 3 vertex indices, 0 if the triangle tree is stored
+    uint32_t triangleCount;  ///< Number of triangles in the SoA arrays without the padding
+    uint32_t triangleArraySize;  ///< Size of each of the 12 SoA arrays including the padding
+    uint32_t nodeCount;
+    int32_t depth;
+    int32_t leafCount;
+    int32_t maxLeafPrimitives;
+};
+
+/// Reads arrays written with writeCacheArray from a mapped cache file, checking they are inside the file
+struct MeshCacheReader {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+
+    template <typename T>
+    bool read(std::vector<T>& items, size_t count) {
+        offset = (offset + MESH_CACHE_ALIGNMENT - 1) / MESH_CACHE_ALIGNMENT * MESH_CACHE_ALIGNMENT;
+        if (offset > size || count > (size - offset) / sizeof(T)) {
+            return false;
         }
+        items.resize(count);
+        if (count) {
+            memcpy(items.data(), data + offset, count * sizeof(T));
+        }
+        offset += count * sizeof(T);
+        return true;
     }
+};
+
+template <typename T>
+static bool writeCacheArray(FILE* file, const std::vector<T>& items) {
+    static const uint8_t zeros[MESH_CACHE_ALIGNMENT] = {};
+    const size_t padding = (MESH_CACHE_ALIGNMENT - size_t(ftell(file)) % MESH_CACHE_ALIGNMENT) % MESH_CACHE_ALIGNMENT;
+    if (fwrite(zeros, 1, padding, file) != padding) {
+        return false;
+    }
+    // empty vectors may have no storage at all, which fwrite must not be given
+    return items.empty() || fwrite(items.data(), sizeof(T), items.size(), file) == items.size();
+}
+
+bool TriangleMesh::loadFromCache(const std::string& objPath) {
+    if (!meshCacheEnabled) {
+        return false;
+    }
+    Timer timer;
+    MappedFile source;
+    if (!source.open(objPath.c_str())) {
+        return false;
+    }
+    sourceHash = hashBytes(source.data(), source.size());
+    sourceSize = source.size();
+    source.close();
+    cachePath = objPath + ".cache";
+
+    MappedFile cache;
+    if (!cache.open(cachePath.c_str()) || cache.size() < sizeof(MeshCacheHeader)) {
+        return false;
+    }
+    MeshCacheHeader header;
+    memcpy(&header, cache.data(), sizeof(header));
+    const AcceleratorType type = meshTreeType();
+    const BVHBuildSettings settings = triangleTreeSettings();
+    const bool isTreeStored = usesTriangleTree(type);
+    uint32_t nodeSize = 0;
+    if (isTreeStored) {
+        nodeSize = type == AcceleratorType::BVH8   ? sizeof(WideBVH<8>::Node)
+                   : type == AcceleratorType::BVH4 ? sizeof(WideBVH<4>::Node)
+                                                   : sizeof(BVHNode);
+    }
+    if (memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC)) != 0 ||
+        header.version != MESH_CACHE_VERSION || header.sourceHash != sourceHash ||
+        header.sourceSize != sourceSize || header.treeType != uint32_t(type) || header.nodeSize != nodeSize ||
+        header.maxLeafSize != settings.maxLeafSize || header.binCount != settings.binCount ||
+        header.traversalCost != settings.traversalCost) {
+        return false;
+    }
+    // the kernel loads whole groups from any triangle, so the stored arrays must have the padding
+    if (isTreeStored && header.triangleArraySize < uint64_t(header.triangleCount) + TriangleSoA::PADDING) {
+        return false;
+    }
+
+    MeshCacheReader reader{cache.data(), cache.size(), sizeof(MeshCacheHeader)};
+    std::vector<int> indices;
+    bool valid = reader.read(vertices, header.vertexCount) && reader.read(indices, header.faceCount * 3);
+    if (isTreeStored) {
+        for (int c = 0; c < 3 && valid; c++) {
+            valid = reader.read(triangles.A[c], header.triangleArraySize) &&
+                    reader.read(triangles.AB[c], header.triangleArraySize) &&
+                    reader.read(triangles.AC[c], header.triangleArraySize) &&
+                    reader.read(triangles.N[c], header.triangleArraySize);
+        }
+        if (type == AcceleratorType::BVH8) {
+            valid = valid && reader.read(bvh8.nodes, header.nodeCount);
+            bvh8.depth = header.depth;
+        } else if (type == AcceleratorType::BVH4) {
+            valid = valid && reader.read(bvh4.nodes, header.nodeCount);
+            bvh4.depth = header.depth;
+        } else {
+            valid = valid && reader.read(bvh.nodes, header.nodeCount);
+            bvh.depth = header.depth;
+            bvh.leafCount = header.leafCount;
+            bvh.maxLeafPrimitives = header.maxLeafPrimitives;
+        }
+    }
+    if (!valid) {
+        vertices.clear();
+        triangles.clear();
+        bvh.clear();
+        bvh4.clear();
+        bvh8.clear();
+        return false;
+    }
+
+    box = header.box;
+    faces.reserve(header.faceCount);
+    for (uint32_t c = 0; c < header.faceCount; c++) {
+        faces.emplace_back(indices[c * 3], indices[c * 3 + 1], indices[c * 3 + 2], this);
+    }
+    if (isTreeStored) {
+        treeType = type;
+        triangles.count = header.triangleCount;
+    }
+    cacheUpToDate = true;
+    printf("Loaded mesh \"%s\" with %d triangles from cache in %ldms\n",
+           objPath.c_str(),
+           int(isTreeStored ? triangles.count : faces.size()),
+           timer.toMs(timer.elapsedNs()));
     return true;
 }
 
+void TriangleMesh::saveCache() {
+    if (cachePath.empty() || cacheUpToDate) {
+        return;
+    }
+    // stop trying after the first attempt, even if it fails
+    cacheUpToDate = true;
+
+    const AcceleratorType type = meshTreeType();
+    const BVHBuildSettings settings = triangleTreeSettings();
+    const bool isTreeStored = usesTriangleTree(type);
+    MeshCacheHeader header = MeshCacheHeader();
+    memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+    header.version = MESH_CACHE_VERSION;
+    header.treeType = uint32_t(type);
+    header.sourceHash = sourceHash;
+    header.sourceSize = sourceSize;
+    header.maxLeafSize = settings.maxLeafSize;
+    header.binCount = settings.binCount;
+    header.traversalCost = settings.traversalCost;
+    header.box = box;
+    header.vertexCount = uint32_t(vertices.size());
+
+    std::vector<int> indices;
+    if (isTreeStored) {
+        header.triangleCount = triangles.count;
+        header.triangleArraySize = uint32_t(triangles.A[0].size());
+        if (type == AcceleratorType::BVH8) {
+            header.nodeSize = sizeof(WideBVH<8>::Node);
+            header.nodeCount = uint32_t(bvh8.nodes.size());
+            header.depth = bvh8.depth;
+        } else if (type == AcceleratorType::BVH4) {
+            header.nodeSize = sizeof(WideBVH<4>::Node);
+            header.nodeCount = uint32_t(bvh4.nodes.size());
+            header.depth = bvh4.depth;
+        } else {
+            header.nodeSize = sizeof(BVHNode);
+            header.nodeCount = uint32_t(bvh.nodes.size());
+            header.depth = bvh.depth;
+            header.leafCount = bvh.leafCount;
+            header.maxLeafPrimitives = bvh.maxLeafPrimitives;
+        }
+    } else {
+        header.faceCount = uint32_t(faces.size());
+        indices.reserve(faces.size() * 3);
+        for (const Triangle& face : faces) {
+            indices.insert(indices.end(), face.indices, face.indices + 3);
+        }
+    }
+
+    // write to a unique file and rename it, so readers and other meshes from the same file never see partial data
+    const std::string tempPath = cachePath + "." + std::to_string(uintptr_t(this)) + ".tmp";
+    FILE* file = fopen(tempPath.c_str(), "wb");
+    if (!file) {
+        printf("Failed to write mesh cache \"%s\"\n", cachePath.c_str());
+        return;
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    written = written && writeCacheArray(file, vertices) && writeCacheArray(file, indices);
+    if (isTreeStored) {
+        for (int c = 0; c < 3 && written; c++) {
+            written = writeCacheArray(file, triangles.A[c]) && writeCacheArray(file, triangles.AB[c]) &&
+                      writeCacheArray(file, triangles.AC[c]) && writeCacheArray(file, triangles.N[c]);
+        }
+        if (type == AcceleratorType::BVH8) {
+            written = written && writeCacheArray(file, bvh8.nodes);
+        } else if (type == AcceleratorType::BVH4) {
+            written = written && writeCacheArray(file, bvh4.nodes);
+        } else {
+            written = written && writeCacheArray(file, bvh.nodes);
+        }
+    }
+    written = fclose(file) == 0 && written;
+#if defined(_WIN32)
+    // rename does not replace existing files on Windows
+    remove(cachePath.c_str());
+#endif
+    if (!written || rename(tempPath.c_str(), cachePath.c_str()) != 0) {
+        remove(tempPath.c_str());
+        printf("Failed to write mesh cache \"%s\"\n", cachePath.c_str());
+    }
+}
+
 bool TriangleMesh::intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) {
+    if (!intersectDeferred(ray, tMin, tMax, intersection)) {
+        return false;
+    }
+    resolveHit(ray, intersection);
+    return true;
+}
+
+bool TriangleMesh::intersectDeferred(const Ray& ray, float tMin, float tMax, Intersection& intersection) {
+    if (!box.testIntersect(ray)) {
+        return false;
+    }
+    return intersectTriangles(ray, tMin, tMax, intersection);
+}
+
+void TriangleMesh::resolveHit(const Ray& ray, Intersection& intersection) {
+    intersection.p = ray.at(intersection.t);
+    if (triangles.count) {
+        intersection.normal = triangles.normal(intersection.primitive);
+    } else {
+        const Triangle& face = faces[intersection.primitive];
+        const vec3& A = vertices[face.indices[0]];
+        intersection.normal = cross(vertices[face.indices[1]] - A, vertices[face.indices[2]] - A).normalized();
+    }
+    intersection.material = material;
+}
+
+bool TriangleMesh::occluded(const Ray& ray, float tMin, float tMax) {
     if (!box.testIntersect(ray)) {
         return false;
     }
+    return occludedTriangles(ray, tMin, tMax);
+}
+
+uint32_t TriangleMesh::intersectPacket(RayPacket& packet, uint32_t active, float tMin, Intersection* hits) {
+    float nearest;
+    active = intersectBox(box, packet, active, tMin, nearest);
+    if (!active) {
+        return 0;
+    }
+    const uint32_t hitMask = intersectTriangles(packet, active, tMin, hits);
+    for (uint32_t mask = hitMask; mask; mask &= mask - 1) {
+        const int lane = lowestBit(mask);
+        resolveHit(packet.getRay(lane), hits[lane]);
+    }
+    return hitMask;
+}
+
+template <typename Tree>
+FORCE_INLINE bool TriangleMesh::intersectTree(
+    const Tree& tree, const Ray& ray, float tMin, float tMax, Intersection& intersection) const {
+    int closest = -1;
+    float closestDist = tMax;
+    float u = 0.f, v = 0.f;
+    tree.intersect(ray, tMin, tMax, [&](uint32_t first, uint32_t count, float tMin, float& tMax) {
+        const int hit = triangles.intersect(ray, first, count, tMin, tMax, u, v);
+        if (hit == -1) {
+            return false;
+        }
+        closest = hit;
+        closestDist = tMax;
+        return true;
+    });
+    if (closest == -1) {
+        return false;
+    }
+    intersection.t = closestDist;
+    intersection.primitive = uint32_t(closest);
+    intersection.u = u;
+    intersection.v = v;
+    return true;
+}
+
+template <typename Tree>
+FORCE_INLINE uint32_t TriangleMesh::intersectTreePacket(
+    const Tree& tree, RayPacket& packet, uint32_t active, float tMin, Intersection* hits) const {
+    const auto leaf = [&](uint32_t first, uint32_t count, uint32_t active) {
+        uint32_t leafHits = 0;
+        for (uint32_t mask = active; mask; mask &= mask - 1) {
+            const int lane = lowestBit(mask);
+            Intersection& intersection = hits[lane];
+            const int hit = triangles.intersect(
+                packet.getRay(lane), first, count, tMin, packet.tMax[lane], intersection.u, intersection.v);
+            if (hit != -1) {
+                intersection.primitive = uint32_t(hit);
+                leafHits |= 1u << lane;
+            }
+        }
+        return leafHits;
+    };
+    const uint32_t hitMask = tree.intersectPacket(packet, active, tMin, leaf);
+    for (uint32_t mask = hitMask; mask; mask &= mask - 1) {
+        const int lane = lowestBit(mask);
+        hits[lane].t = packet.tMax[lane];
+    }
+    return hitMask;
+}
+
+template <typename Tree>
+FORCE_INLINE bool TriangleMesh::occludedTree(const Tree& tree, const Ray& ray, float tMin, float tMax) const {
+    return tree.occluded(ray, tMin, tMax, [&](uint32_t first, uint32_t count) {
+        float tHit = tMax, u, v;
+        return triangles.intersect(ray, first, count, tMin, tHit, u, v) != -1;
+    });
+}
+
+TARGET_AVX2 bool TriangleMesh::intersectTree8(
+    const Ray& ray, float tMin, float tMax, Intersection& intersection) const {
+    return intersectTree(bvh8, ray, tMin, tMax, intersection);
+}
+
+TARGET_AVX2 uint32_t TriangleMesh::intersectTreePacket8(RayPacket& packet,
+                                                        uint32_t active,
+                                                        float tMin,
+                                                        Intersection* hits) const {
+    return intersectTreePacket(bvh8, packet, active, tMin, hits);
+}
+
+TARGET_AVX2 bool TriangleMesh::occludedTree8(const Ray& ray, float tMin, float tMax) const {
+    return occludedTree(bvh8, ray, tMin, tMax);
+}
+
+uint32_t TriangleMesh::intersectTriangles(RayPacket& packet, uint32_t active, float tMin, Intersection* hits) {
+    if (triangles.count) {
+        switch (treeType) {
+        case AcceleratorType::BVH8:
+            return intersectTreePacket8(packet, active, tMin, hits);
+        case AcceleratorType::BVH4:
+            return intersectTreePacket(bvh4, packet, active, tMin, hits);
+        default:
+            return intersectTreePacket(bvh, packet, active, tMin, hits);
+        }
+    }
+    if (accelerator && accelerator->isBuilt()) {
+        return accelerator->intersectPacket(packet, active, tMin, hits);
+    }
+    uint32_t hitMask = 0;
+    for (int c = 0; c < faces.size(); c++) {
+        hitMask |= faces[c].intersectPacket(packet, active, tMin, hits);
+    }
+    return hitMask;
+}
+
+bool TriangleMesh::intersectTriangles(const Ray& ray, float tMin, float tMax, Intersection& intersection) {
+    if (triangles.count) {
+        switch (treeType) {
+        case AcceleratorType::BVH8:
+            return intersectTree8(ray, tMin, tMax, intersection);
+        case AcceleratorType::BVH4:
+            return intersectTree(bvh4, ray, tMin, tMax, intersection);
+        default:
+            return intersectTree(bvh, ray, tMin, tMax, intersection);
+        }
+    }
     if (accelerator && accelerator->isBuilt()) {
         return accelerator->intersect(ray, tMin, tMax, intersection);
     }
     bool haveRes = false;
     for (int c = 0; c < faces.size(); c++) {
-        haveRes = haveRes || faces[c].intersect(ray, tMin, tMax, intersection);
+        if (faces[c].intersect(ray, tMin, tMax, intersection)) {
+            tMax = intersection.t;
+            haveRes = true;
+        }
     }
     return haveRes;
 }
+
+bool TriangleMesh::occludedTriangles(const Ray& ray, float tMin, float tMax) {
+    if (triangles.count) {
+        switch (treeType) {
+        case AcceleratorType::BVH8:
+            return occludedTree8(ray, tMin, tMax);
+        case AcceleratorType::BVH4:
+            return occludedTree(bvh4, ray, tMin, tMax);
+        default:
+            return occludedTree(bvh, ray, tMin, tMax);
+        }
+    }
+    if (accelerator && accelerator->isBuilt()) {
+        return accelerator->occluded(ray, tMin, tMax);
+    }
+    for (int c = 0; c < faces.size(); c++) {
+        if (faces[c].occluded(ray, tMin, tMax)) {
+            return true;
+        }
+    }
+    return false;
+}
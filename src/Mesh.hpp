@@ -1,31 +1,136 @@
 #pragma once
 
+#include "BVH.hpp"
 #include "Primitive.hpp"
 #include "Utils.hpp"
 
+/// @brief Enable or disable the mesh cache files, must be called before loading the scene, enabled by default
+void setMeshCacheEnabled(bool enabled);
+
 struct TriangleMesh : Primitive {
-    struct Triangle : Intersectable {
+    /// Triangle for the generic accelerators, its hits record only the distance, the index in @faces and the
+    /// barycentric coordinates and are completed by TriangleMesh::resolveHit
+    struct Triangle final : Intersectable {
         int indices[3];
         TriangleMesh *owner = nullptr;
 
+        Triangle() = default;
         Triangle(int v1, int v2, int v3, TriangleMesh *owner) : indices{v1, v2, v3}, owner(owner) {}
 
         bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+        uint32_t intersectPacket(RayPacket &packet, uint32_t active, float tMin, Intersection *hits) override;
+        bool occluded(const Ray &ray, float tMin, float tMax) override;
         bool boxIntersect(const BBox &box) override;
         void expandBox(BBox &box) override;
     };
+
+    /// Triangles with their first vertex, edges and normal precomputed, stored as structure of arrays in the leaf
+    /// order of the mesh BVH so a ray can be tested against the triangles of a leaf with SIMD instead of one at a time
+    struct TriangleSoA {
+        static const int LANES = 4;  ///< Number of triangles tested at once
+        /// Arrays have this many triangles past the last one, leaves start anywhere so a group may load past @count
+        static const int PADDING = LANES - 1;
+
+        std::vector<float> A[3];  ///< First vertex
+        std::vector<float> AB[3];  ///< Edge from the first to the second vertex
+        std::vector<float> AC[3];  ///< Edge from the first to the third vertex
+        std::vector<float> N[3];  ///< Unnormalized normal, the cross product of AB and AC
+        uint32_t count = 0;
+
+        void init(const std::vector<vec3> &vertices, const std::vector<Triangle> &faces);
+
+        void clear() {
+            for (int c = 0; c < 3; c++) {
+                A[c].clear();
+                AB[c].clear();
+                AC[c].clear();
+                N[c].clear();
+            }
+            count = 0;
+        }
+
+        size_t memoryUsage() const {
+            return A[0].size() * sizeof(float) * 12;
+        }
+
+        /// @brief Find the closest intersection of the ray with the triangles [first, first + count)
+        /// @param tMax [in/out] - far clip distance, set to the distance of the found intersection
+        /// @param u, v [out] - barycentric coordinates of the found intersection, unchanged if none is found
+        /// @return index of the closest intersected triangle or -1 if none is hit inside (tMin, tMax)
+        int intersect(
+            const Ray &ray, uint32_t first, uint32_t count, float tMin, float &tMax, float &u, float &v) const;
+
+        vec3 normal(uint32_t index) const {
+            return vec3(N[0][index], N[1][index], N[2][index]).normalized();
+        }
+    };
+
+    /// Used only for the accelerators that work with Triangle objects (oct and kd tree), the BVH types use the
+    /// mesh's own tree over @triangles and @faces are released after it is built
     AcceleratorPtr accelerator;
+    AcceleratorType treeType = AcceleratorType::BVH;  ///< Which of the trees over @triangles is built
+    BVH bvh;
+    WideBVH<4> bvh4;
+    WideBVH<8> bvh8;
+    TriangleSoA triangles;
     std::vector<vec3> vertices;
     std::vector<Triangle> faces;
-    std::unique_ptr<Material> material;
+    MaterialId material;
+
+    std::string cachePath;  ///< Binary cache of the loaded mesh and its tree, empty if caching is disabled
+    uint64_t sourceHash = 0;  ///< Hash of the obj file contents, the cache is valid only for the same source
+    uint64_t sourceSize = 0;
+    bool cacheUpToDate = false;  ///< Set when the cache file already matches the mesh and tree in memory
 
-    TriangleMesh(const std::string &objFile, std::unique_ptr<Material> material) : material(std::move(material)) {
-        loadFromObj(objFile);
+    /// @param threads - threads to parse the obj file with, nullptr to parse it on the calling thread
+    TriangleMesh(const std::string &objFile, MaterialId material, ThreadManager *threads = nullptr)
+        : material(material) {
+        if (!loadFromCache(objFile)) {
+            loadFromObj(objFile, threads);
+        }
     }
 
-    void onBeforeRender() override;
-    bool loadFromObj(const std::string &objPath);
+    void onBeforeRender(ThreadManager *threads) override;
+
+    /// @brief Load the vertices and faces from an obj file, polygons are split in triangles
+    ///        The file is mapped in memory and split in chunks of lines parsed in parallel
+    /// @param threads - threads to parse with, nullptr to parse on the calling thread
+    bool loadFromObj(const std::string &objPath, ThreadManager *threads = nullptr);
+
+    /// @brief Load the mesh and the triangle tree for the current accelerator type from the cache next to @objPath
+    /// @return true if the cache exists and matches the obj file contents and the tree build parameters
+    bool loadFromCache(const std::string &objPath);
+
+    /// @brief Write the mesh and the triangle tree to @cachePath, the file is replaced atomically
+    void saveCache();
 
     bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+    uint32_t intersectPacket(RayPacket &packet, uint32_t active, float tMin, Intersection *hits) override;
+    bool occluded(const Ray &ray, float tMin, float tMax) override;
+    bool intersectDeferred(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+    void resolveHit(const Ray &ray, Intersection &intersection) override;
+
+    /// @brief Intersect the triangles without testing the mesh bounding box, used when the caller already culled it
+    ///        The hits are deferred, only their distance, triangle index and barycentric coordinates are recorded
+    bool intersectTriangles(const Ray &ray, float tMin, float tMax, Intersection &intersection);
+    uint32_t intersectTriangles(RayPacket &packet, uint32_t active, float tMin, Intersection *hits);
+    bool occludedTriangles(const Ray &ray, float tMin, float tMax);
     bool intersectTriangle(const Ray &ray, const Triangle &t, Intersection &info);
+
+private:
+    /// @brief Build the tree of type @type over the triangles and move them from @faces to @triangles in leaf order
+    void buildTriangleTree(AcceleratorType type, ThreadManager *threads);
+
+    template <typename Tree>
+    bool intersectTree(const Tree &tree, const Ray &ray, float tMin, float tMax, Intersection &intersection) const;
+    template <typename Tree>
+    uint32_t intersectTreePacket(
+        const Tree &tree, RayPacket &packet, uint32_t active, float tMin, Intersection *hits) const;
+    template <typename Tree>
+    bool occludedTree(const Tree &tree, const Ray &ray, float tMin, float tMax) const;
+
+    /// @brief Separate so they can be compiled for AVX2 with the traversal inlined
+    bool intersectTree8(const Ray &ray, float tMin, float tMax, Intersection &intersection) const;
+    uint32_t intersectTreePacket8(RayPacket &packet, uint32_t active, float tMin, Intersection *hits) const;
+    bool occludedTree8(const Ray &ray, float tMin, float tMax) const;
 };
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "SIMD.hpp"
+#include "Utils.hpp"
+
+/// Packet of rays stored as structure of arrays, used to trace coherent primary rays of a pixel block together
+/// Each ray of the packet is a lane, sets of lanes are passed around as bit masks
+struct alignas(64) RayPacket {
+    static const int SIZE = 16;
+    static const uint32_t ALL_LANES = (1u << SIZE) - 1;
+
+    float origin[3][SIZE];
+    float dir[3][SIZE];
+    float invDir[3][SIZE];
+    float tMax[SIZE];  ///< Far clip distance of each ray, shrinks when closer hits are found
+
+    /// Bounds of the inverse directions, used to cull the whole packet against a box before testing each lane
+    /// Only valid when @coherent is true, meaning all rays share an origin and the signs of their directions
+    bool coherent = false;
+    float invDirMin[3];
+    float invDirMax[3];
+
+    void setRay(int lane, const Ray &ray, float far = FLT_MAX) {
+        for (int c = 0; c < 3; c++) {
+            origin[c][lane] = ray.origin[c];
+            dir[c][lane] = ray.dir[c];
+            invDir[c][lane] = ray.invDir[c];
+        }
+        tMax[lane] = far;
+    }
+
+    Ray getRay(int lane) const {
+        Ray ray;
+        ray.origin = vec3(origin[0][lane], origin[1][lane], origin[2][lane]);
+        ray.dir = vec3(dir[0][lane], dir[1][lane], dir[2][lane]);
+        ray.invDir = vec3(invDir[0][lane], invDir[1][lane], invDir[2][lane]);
+        for (int c = 0; c < 3; c++) {
+            ray.dirIsNeg[c] = ray.invDir[c] < 0;
+        }
+        return ray;
+    }
+
+    /// @brief Fill the inactive lanes with a copy of an active one and compute the frustum data
+    ///        Must be called after all rays are set
+    void finalize(uint32_t active) {
+        assert(active != 0 && (active & ~ALL_LANES) == 0);
+        const int first = lowestBit(active);
+        for (int lane = 0; lane < SIZE; lane++) {
+            if (!(active & (1u << lane))) {
+                setRay(lane, getRay(first), -FLT_MAX);
+            }
+        }
+
+        coherent = true;
+        for (int c = 0; c < 3; c++) {
+            invDirMin[c] = invDirMax[c] = invDir[c][first];
+            for (int lane = 0; lane < SIZE; lane++) {
+                invDirMin[c] = std::min(invDirMin[c], invDir[c][lane]);
+                invDirMax[c] = std::max(invDirMax[c], invDir[c][lane]);
+                coherent = coherent && origin[c][lane] == origin[c][first];
+            }
+            coherent = coherent && (invDirMin[c] > 0.f) == (invDirMax[c] > 0.f);
+        }
+    }
+
+    /// @brief Get a copy of the packet in the local space of an instance with uniform scale and offset
+    RayPacket transformed(const vec3 &offset, float invScale) const {
+        RayPacket local(*this);
+        for (int c = 0; c < 3; c++) {
+            for (int lane = 0; lane < SIZE; lane++) {
+                local.origin[c][lane] = (origin[c][lane] - offset[c]) * invScale;
+            }
+        }
+        for (int lane = 0; lane < SIZE; lane++) {
+            local.tMax[lane] = tMax[lane] * invScale;
+        }
+        return local;
+    }
+};
+
+/// @brief Conservative test if all rays of a coherent packet miss the box, using interval arithmetic on the
+///        inverse directions, see "Ray Tracing Deformable Scenes Using Dynamic Bounding Volume Hierarchies"
+/// @return true if no ray of the packet can hit the box
+inline bool frustumMisses(const BBox &box, const RayPacket &packet, float tMin) {
+    float lower = tMin, upper = FLT_MAX;
+    for (int c = 0; c < 3; c++) {
+        const bool positive = packet.invDirMin[c] > 0.f;
+        const float nearDist = (positive ? box.min[c] : box.max[c]) - packet.origin[c][0];
+        const float farDist = (positive ? box.max[c] : box.min[c]) - packet.origin[c][0];
+        const float near0 = nearDist * packet.invDirMin[c], near1 = nearDist * packet.invDirMax[c];
+        const float far0 = farDist * packet.invDirMin[c], far1 = farDist * packet.invDirMax[c];
+        lower = std::max(lower, std::min(near0, near1));
+        upper = std::min(upper, std::max(far0, far1));
+    }
+    return lower > upper * (1.f + 3.f * FLT_EPSILON);
+}
+
+/// @brief Slab test of the active rays of a packet against a box, the packet frustum is tested first if possible
+/// @param nearest [out] - the smallest entry distance of the rays that hit the box
+/// @return mask of the active rays that hit the box inside (tMin, their tMax)
+inline uint32_t intersectBox(const BBox &box, const RayPacket &packet, uint32_t active, float tMin, float &nearest) {
+    if (packet.coherent && frustumMisses(box, packet, tMin)) {
+        return 0;
+    }
+    uint32_t mask = 0;
+#if defined(RT_X86)
+    __m128 nearestV = _mm_set1_ps(FLT_MAX);
+    for (int group = 0; group < RayPacket::SIZE / 4; group++) {
+        if (!((active >> (group * 4)) & 0xF)) {
+            continue;
+        }
+        __m128 tNear = _mm_set1_ps(tMin);
+        __m128 tFar = _mm_load_ps(packet.tMax + group * 4);
+        for (int c = 0; c < 3; c++) {
+            const __m128 origin = _mm_load_ps(packet.origin[c] + group * 4);
+            const __m128 invDir = _mm_load_ps(packet.invDir[c] + group * 4);
+            const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min[c]), origin), invDir);
+            const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max[c]), origin), invDir);
+            tNear = _mm_max_ps(_mm_min_ps(t0, t1), tNear);
+            tFar = _mm_min_ps(_mm_mul_ps(_mm_max_ps(t0, t1), _mm_set1_ps(1.f + 3.f * FLT_EPSILON)), tFar);
+        }
+        const __m128 hit = _mm_cmple_ps(tNear, tFar);
+        nearestV = _mm_min_ps(nearestV, _mm_or_ps(_mm_and_ps(hit, tNear), _mm_andnot_ps(hit, _mm_set1_ps(FLT_MAX))));
+        mask |= uint32_t(_mm_movemask_ps(hit)) << (group * 4);
+    }
+    float nearestLanes[4];
+    _mm_storeu_ps(nearestLanes, nearestV);
+    nearest = std::min(std::min(nearestLanes[0], nearestLanes[1]), std::min(nearestLanes[2], nearestLanes[3]));
+#else
+    nearest = FLT_MAX;
+    for (int lane = 0; lane < RayPacket::SIZE; lane++) {
+        float tNear = tMin, tFar = packet.tMax[lane];
+        const vec3 origin(packet.origin[0][lane], packet.origin[1][lane], packet.origin[2][lane]);
+        const vec3 invDir(packet.invDir[0][lane], packet.invDir[1][lane], packet.invDir[2][lane]);
+        if (box.clipRay(origin, invDir, tNear, tFar)) {
+            mask |= 1u << lane;
+            nearest = std::min(nearest, tNear);
+        }
+    }
+#endif
+    return mask & active;
+}
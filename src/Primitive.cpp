@@ -1,13 +1,41 @@
 #include "Primitive.hpp"
 
-SpherePrim::SpherePrim(vec3 center, float radius, MaterialPtr material)
-    : center(center), radius(radius), material(std::move(material)) {
+#include "Mesh.hpp"
+#include "Threading.hpp"
+
+SpherePrim::SpherePrim(vec3 center, float radius, MaterialId material)
+    : center(center), radius(radius), material(material) {
     box.add(center);
     box.add(center + vec3(radius, radius, radius));
     box.add(center - vec3(radius, radius, radius));
 }
 
+uint32_t Intersectable::intersectPacket(RayPacket& packet, uint32_t active, float tMin, Intersection* hits) {
+    uint32_t hitMask = 0;
+    for (uint32_t mask = active; mask; mask &= mask - 1) {
+        const int lane = lowestBit(mask);
+        if (intersect(packet.getRay(lane), tMin, packet.tMax[lane], hits[lane])) {
+            packet.tMax[lane] = hits[lane].t;
+            hitMask |= 1u << lane;
+        }
+    }
+    return hitMask;
+}
+
+bool Intersectable::occluded(const Ray& ray, float tMin, float tMax) {
+    Intersection intersection;
+    return intersect(ray, tMin, tMax, intersection);
+}
+
 bool SpherePrim::intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) {
+    if (!intersectDeferred(ray, tMin, tMax, intersection)) {
+        return false;
+    }
+    resolveHit(ray, intersection);
+    return true;
+}
+
+bool SpherePrim::intersectDeferred(const Ray& ray, float tMin, float tMax, Intersection& intersection) {
     const float a = dot(ray.dir, ray.dir);
     const float b = 2.f * dot(ray.dir, ray.origin - center);
     const float c = dot(ray.origin - center, ray.origin - center) - radius * radius;
@@ -16,87 +44,225 @@ bool SpherePrim::intersect(const Ray& ray, float tMin, float tMax, Intersection&
         const float t = (-b - sqrtf(D)) / (2.f * a);
         if (t >= tMin && t <= tMax) {
             intersection.t = t;
-            intersection.p = ray.at(t);
-            intersection.normal = (intersection.p - center) / radius;
-            intersection.material = material.get();
+            intersection.primitive = 0;
             return true;
         }
     }
     return false;
 }
 
-bool Instancer::Instance::intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) {
-    const Ray local = {(ray.origin - offset) / scale, ray.dir};
-    if (primitive->intersect(local, tMin, tMax, intersection)) {
-        if (material) {
-            intersection.material = material.get();
-        }
-        return true;
+void SpherePrim::resolveHit(const Ray& ray, Intersection& intersection) {
+    intersection.p = ray.at(intersection.t);
+    intersection.normal = (intersection.p - center) / radius;
+    intersection.material = material;
+}
+
+uint32_t SpherePrim::intersectPacket(RayPacket& packet, uint32_t active, float tMin, Intersection* hits) {
+    float nearest;
+    active = intersectBox(box, packet, active, tMin, nearest);
+    return active ? Intersectable::intersectPacket(packet, active, tMin, hits) : 0;
+}
+
+bool SpherePrim::occluded(const Ray& ray, float tMin, float tMax) {
+    const vec3 originToCenter = ray.origin - center;
+    const float a = dot(ray.dir, ray.dir);
+    const float b = 2.f * dot(ray.dir, originToCenter);
+    const float c = dot(originToCenter, originToCenter) - radius * radius;
+    const float D = b * b - 4 * a * c;
+    if (D < 0.f) {
+        return false;
     }
-    return false;
+    const float t = (-b - sqrtf(D)) / (2.f * a);
+    return t >= tMin && t <= tMax;
 }
 
-bool Instancer::Instance::boxIntersect(const BBox& other) {
-    const BBox transformed{primitive->box.min * scale + offset, primitive->box.max * scale + offset};
-    return !other.boxIntersection(transformed).isEmpty();
+BBox Instancer::instanceBox(const Instance& instance) const {
+    const BBox& primBox = blasList[instance.blas].primitive->box;
+    return BBox{primBox.min * instance.scale + instance.offset, primBox.max * instance.scale + instance.offset};
 }
 
-void Instancer::Instance::expandBox(BBox& other) {
-    const BBox transformed{primitive->box.min * scale + offset, primitive->box.max * scale + offset};
-    other.add(transformed);
+bool Instancer::intersectInstance(
+    const Instance& instance, const Ray& ray, float tMin, float tMax, Intersection& intersection) {
+    // distances along the local ray are scaled by the inverse of the instance scale
+    const float invScale = 1.f / instance.scale;
+    Ray local = ray;
+    local.origin = (ray.origin - instance.offset) * invScale;
+    const Blas& blas = blasList[instance.blas];
+    bool hasHit;
+    if (blas.mesh) {
+        hasHit = blas.mesh->intersectTriangles(local, tMin * invScale, tMax * invScale, intersection);
+    } else {
+        hasHit = blas.primitive->intersectDeferred(local, tMin * invScale, tMax * invScale, intersection);
+    }
+    if (!hasHit) {
+        return false;
+    }
+    intersection.t *= instance.scale;
+    return true;
 }
 
-void Instancer::onBeforeRender() {
-    for (int c = 0; c < instances.size(); c++) {
-        instances[c].primitive->onBeforeRender();
+void Instancer::resolveInstanceHit(const Instance& instance, const Ray& ray, Intersection& intersection) {
+    const float invScale = 1.f / instance.scale;
+    Ray local = ray;
+    local.origin = (ray.origin - instance.offset) * invScale;
+    const Blas& blas = blasList[instance.blas];
+    const float t = intersection.t;
+    intersection.t = t * invScale;
+    if (blas.mesh) {
+        blas.mesh->resolveHit(local, intersection);
+    } else {
+        blas.primitive->resolveHit(local, intersection);
     }
-    if (instances.size() < 50) {
-        return;
+    intersection.t = t;
+    intersection.p = ray.at(t);
+    if (instance.material != NO_MATERIAL) {
+        intersection.material = instance.material;
     }
+}
 
-    if (!accelerator) {
-        accelerator = makeDefaultAccelerator();
+uint32_t Instancer::intersectInstance(
+    const Instance& instance, RayPacket& packet, uint32_t active, float tMin, Intersection* hits) {
+    if (bitCount(active) < MIN_PACKET_RAYS) {
+        // too few rays left to pay off the transform of the whole packet and the box tests of the empty lanes
+        uint32_t hitMask = 0;
+        for (uint32_t mask = active; mask; mask &= mask - 1) {
+            const int lane = lowestBit(mask);
+            if (intersectInstance(instance, packet.getRay(lane), tMin, packet.tMax[lane], hits[lane])) {
+                packet.tMax[lane] = hits[lane].t;
+                hitMask |= 1u << lane;
+            }
+        }
+        return hitMask;
     }
-    if (!accelerator->isBuilt()) {
-        accelerator->clear();
-        for (int c = 0; c < instances.size(); c++) {
-            accelerator->addPrimitive(&instances[c]);
+
+    const float invScale = 1.f / instance.scale;
+    RayPacket local = packet.transformed(instance.offset, invScale);
+    const Blas& blas = blasList[instance.blas];
+    uint32_t hitMask;
+    if (blas.mesh) {
+        hitMask = blas.mesh->intersectTriangles(local, active, tMin * invScale, hits);
+    } else {
+        hitMask = blas.primitive->intersectPacket(local, active, tMin * invScale, hits);
+    }
+    for (uint32_t mask = hitMask; mask; mask &= mask - 1) {
+        const int lane = lowestBit(mask);
+        Intersection& hit = hits[lane];
+        hit.t *= instance.scale;
+        packet.tMax[lane] = hit.t;
+    }
+    return hitMask;
+}
+
+bool Instancer::occludedInstance(const Instance& instance, const Ray& ray, float tMin, float tMax) {
+    const float invScale = 1.f / instance.scale;
+    Ray local = ray;
+    local.origin = (ray.origin - instance.offset) * invScale;
+    const Blas& blas = blasList[instance.blas];
+    if (blas.mesh) {
+        return blas.mesh->occludedTriangles(local, tMin * invScale, tMax * invScale);
+    }
+    return blas.primitive->occluded(local, tMin * invScale, tMax * invScale);
+}
+
+void Instancer::onBeforeRender(ThreadManager *threads) {
+    if (int(blasList.size()) >= parallelThreadCount(threads)) {
+        // enough independent primitives to keep all threads busy, each one is built by a single thread
+        parallelFor(threads, int(blasList.size()), [this](int c, int) {
+            blasList[c].primitive->onBeforeRender(nullptr);
+        });
+    } else {
+        for (int c = 0; c < blasList.size(); c++) {
+            blasList[c].primitive->onBeforeRender(threads);
         }
-        accelerator->build(IntersectionAccelerator::Purpose::Instances);
     }
+    blasIndex.clear();
+    if (tlas.isBuilt() || instances.empty()) {
+        return;
+    }
+
+    Timer timer;
+    std::vector<BBox> boxes(instances.size());
+    for (int c = 0; c < instances.size(); c++) {
+        boxes[c] = instanceBox(instances[c]);
+    }
+    BVHBuildSettings settings;
+    settings.maxLeafSize = 2;
+    settings.traversalCost = 0.5f;
+    tlas.build(boxes, settings, threads);
+    tlas.applyOrder(instances);
+    printf("Built TLAS with %d instances of %d primitives in %ldms, nodes %d, depth %d, %gKB\n",
+           int(instances.size()),
+           int(blasList.size()),
+           timer.toMs(timer.elapsedNs()),
+           int(tlas.nodes.size()),
+           tlas.depth,
+           (tlas.memoryUsage() + instances.size() * sizeof(Instance)) / 1024.f);
 }
 
-void Instancer::addInstance(SharedPrimPtr prim, const vec3& offset, float scale, SharedMaterialPtr material) {
-    BBox primBox;
-    primBox.min = (prim->box.min * scale) + offset;
-    primBox.max = (prim->box.max * scale) + offset;
-    box.add(primBox);
-    Instance instance;
-    instance.primitive = std::move(prim);
-    instance.offset = offset;
-    instance.scale = scale;
-    instance.material = material;
+void Instancer::addInstance(SharedPrimPtr prim, const vec3& offset, float scale, MaterialId material) {
+    auto blasIt = blasIndex.find(prim.get());
+    if (blasIt == blasIndex.end()) {
+        blasIt = blasIndex.emplace(prim.get(), uint32_t(blasList.size())).first;
+        Blas blas;
+        blas.mesh = dynamic_cast<TriangleMesh*>(prim.get());
+        blas.primitive = std::move(prim);
+        blasList.push_back(std::move(blas));
+    }
+
+    const Instance instance{offset, scale, blasIt->second, material};
+    box.add(instanceBox(instance));
     instances.push_back(instance);
+    tlas.clear();
 }
 
 bool Instancer::intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) {
-    if (!box.testIntersect(ray)) {
-        return false;
+    uint32_t closest = 0;
+    const bool hasHit =
+        tlas.intersect(ray, tMin, tMax, [&](uint32_t first, uint32_t count, float tMin, float& tMax) {
+            bool hasHit = false;
+            for (uint32_t c = first; c < first + count; c++) {
+                if (intersectInstance(instances[c], ray, tMin, tMax, intersection)) {
+                    tMax = intersection.t;
+                    closest = c;
+                    hasHit = true;
+                }
+            }
+            return hasHit;
+        });
+    if (hasHit) {
+        resolveInstanceHit(instances[closest], ray, intersection);
     }
-    if (accelerator && accelerator->isBuilt()) {
-        return accelerator->intersect(ray, tMin, tMax, intersection);
+    return hasHit;
+}
+
+uint32_t Instancer::intersectPacket(RayPacket& packet, uint32_t active, float tMin, Intersection* hits) {
+    uint32_t closest[RayPacket::SIZE];
+    const uint32_t hitMask =
+        tlas.intersectPacket(packet, active, tMin, [&](uint32_t first, uint32_t count, uint32_t active) {
+            uint32_t hitMask = 0;
+            for (uint32_t c = first; c < first + count; c++) {
+                const uint32_t instanceHits = intersectInstance(instances[c], packet, active, tMin, hits);
+                for (uint32_t mask = instanceHits; mask; mask &= mask - 1) {
+                    closest[lowestBit(mask)] = c;
+                }
+                hitMask |= instanceHits;
+            }
+            return hitMask;
+        });
+    for (uint32_t mask = hitMask; mask; mask &= mask - 1) {
+        const int lane = lowestBit(mask);
+        resolveInstanceHit(instances[closest[lane]], packet.getRay(lane), hits[lane]);
     }
-    float closest = tMax;
-    bool hasHit = false;
-    for (int c = 0; c < instances.size(); c++) {
-        Intersection data;
-        if (instances[c].intersect(ray, tMin, tMax, data)) {
-            if (data.t < closest) {
-                intersection = data;
-                closest = data.t;
-                hasHit = true;
+    return hitMask;
+}
+
+bool Instancer::occluded(const Ray& ray, float tMin, float tMax) {
+    return tlas.occluded(ray, tMin, tMax, [&](uint32_t first, uint32_t count) {
+        for (uint32_t c = first; c < first + count; c++) {
+            if (occludedInstance(instances[c], ray, tMin, tMax)) {
+                return true;
             }
         }
-    }
-    return hasHit;
+        return false;
+    });
 }
@@ -1,17 +1,27 @@
 #pragma once
 
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
+#include "BVH.hpp"
 #include "Material.hpp"
+#include "Packet.hpp"
 #include "Utils.hpp"
 
+struct ThreadManager;
+
 /// Data for an intersection between a ray and scene primitive
+/// Traversal records only the distance, the index and the barycentric coordinates of the hit, the point, normal and
+/// material are filled once the closest hit is known, see Primitive::intersectDeferred
 struct Intersection {
     float t = -1.f;  ///< Position of the intersection along the ray
+    uint32_t primitive = 0;  ///< Index of the hit triangle in its mesh or sphere in its SphereSet, 0 for others
+    float u = 0.f;  ///< Barycentric coordinate of the hit for the second vertex of the triangle
+    float v = 0.f;  ///< Barycentric coordinate of the hit for the third vertex of the triangle
     vec3 p;  ///< The intersection point
     vec3 normal;  ///< The normal at the intersection
-    Material *material = nullptr;  ///< Material of the intersected primitive
+    MaterialId material = NO_MATERIAL;  ///< Material of the intersected primitive in the scene's MaterialTable
 };
 
 /// Interface for anything that can be intersected
@@ -24,6 +34,20 @@ struct Intersectable {
     /// @return true when intersection is found, false otherwise
     virtual bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) = 0;
 
+    /// @brief Intersect the active rays of a packet with the primitive, by default each ray is tested separately
+    /// @param packet [in/out] - the rays, tMax of each ray that hits is set to the intersection distance
+    /// @param active - mask of the rays to test
+    /// @param tMin - near clip distance for all rays
+    /// @param hits [out] - intersection data for each of the rays that hit, indexed by lane
+    /// @return mask of the rays that hit the primitive
+    virtual uint32_t intersectPacket(RayPacket &packet, uint32_t active, float tMin, Intersection *hits);
+
+    /// @brief Check if the ray hits the primitive anywhere in (tMin, tMax), used for visibility queries
+    ///        Implementations stop at the first hit they find and skip computing the intersection data,
+    ///        by default it calls intersect
+    /// @return true if intersect would find an intersection in (tMin, tMax)
+    virtual bool occluded(const Ray &ray, float tMin, float tMax);
+
     /// @brief Test intersection of the primitive with a box, used by IntersectionAccelerator
     /// @param box - bounding box to test against
     virtual bool boxIntersect(const BBox &box) = 0;
@@ -41,7 +65,17 @@ struct Primitive : Intersectable {
 
     /// @brief Called after scene is fully created and before rendering starts
     ///	       Used to build acceleration structures
-    virtual void onBeforeRender() {}
+    /// @param threads - threads to build with, nullptr to build on the calling thread
+    virtual void onBeforeRender(ThreadManager *threads) {}
+
+    /// @brief Same as intersect, but may record only the distance and the ids of the hit, so candidates that a closer
+    ///        hit replaces cost no more than that. By default the hit is complete right away
+    virtual bool intersectDeferred(const Ray &ray, float tMin, float tMax, Intersection &intersection) {
+        return intersect(ray, tMin, tMax, intersection);
+    }
+
+    /// @brief Fill the point, normal and material of the closest hit found by intersectDeferred with the same @ray
+    virtual void resolveHit(const Ray &ray, Intersection &intersection) {}
 
     /// @brief Default implementation intersecting the bbox of the primitive, overriden if possible more efficiently
     bool boxIntersect(const BBox &other) override {
@@ -72,7 +106,8 @@ struct IntersectionAccelerator {
 
     /// @brief Build all the internal data for the accelerator
     ///	@param purpose - the purpose of the tree, implementation can use it as hint for internal parameters
-    virtual void build(Purpose purpose = Purpose::Generic) = 0;
+    /// @param threads - threads to build with, nullptr to build on the calling thread
+    virtual void build(Purpose purpose = Purpose::Generic, ThreadManager *threads = nullptr) = 0;
 
     /// @brief Check if the accelerator is built
     virtual bool isBuilt() const = 0;
@@ -80,48 +115,105 @@ struct IntersectionAccelerator {
     /// @brief Implement intersect from Intersectable but don't inherit the Interface
     virtual bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) = 0;
 
+    /// @brief Implement intersectPacket from Intersectable, by default each ray is traced separately
+    virtual uint32_t intersectPacket(RayPacket &packet, uint32_t active, float tMin, Intersection *hits);
+
+    /// @brief Implement occluded from Intersectable, by default it calls intersect
+    virtual bool occluded(const Ray &ray, float tMin, float tMax);
+
     virtual ~IntersectionAccelerator() = default;
 };
 
 typedef std::unique_ptr<IntersectionAccelerator> AcceleratorPtr;
+
+/// The acceleration structures that can be created with makeAccelerator
+/// BVH8 needs AVX2 and FMA and falls back to BVH4 on CPUs without it
+enum class AcceleratorType { Oct, KD, BVH, BVH4, BVH8 };
+
+/// @brief Get the widest BVH the running CPU supports
+AcceleratorType bestWideBVHType();
+
+/// @brief Create an empty accelerator of the given type over primitives that are all of type @Prim
+///        The leaf loops call the methods of @Prim directly, so they are not virtual calls when @Prim is final
+///        Instantiated for Intersectable and TriangleMesh::Triangle
+template <typename Prim = Intersectable>
+AcceleratorPtr makeAccelerator(AcceleratorType type);
+
+/// @brief Set the type of accelerator created by makeDefaultAccelerator, must be called before building the scene
+void setDefaultAcceleratorType(AcceleratorType type);
+
+/// @brief Get the type of accelerator created by makeDefaultAccelerator
+AcceleratorType getDefaultAcceleratorType();
+
+/// @brief Create an empty accelerator of the default type, the widest supported BVH unless changed with
+///        setDefaultAcceleratorType
 AcceleratorPtr makeDefaultAccelerator();
 
 /// Simple smooth sphere primitive
 struct SpherePrim : Primitive {
     vec3 center;
     float radius;
-    std::unique_ptr<Material> material;
+    MaterialId material;
 
-    SpherePrim(vec3 center, float radius, MaterialPtr material);
+    SpherePrim(vec3 center, float radius, MaterialId material);
 
     bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+    bool intersectDeferred(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+    void resolveHit(const Ray &ray, Intersection &intersection) override;
+    uint32_t intersectPacket(RayPacket &packet, uint32_t active, float tMin, Intersection *hits) override;
+    bool occluded(const Ray &ray, float tMin, float tMax) override;
 };
 
+struct TriangleMesh;
+
 /// Primitive that contains a list of other primitives along with offset and scale for each one
-///	Each primitive is tested on intersect call and intersected with its offset and scale
+/// Two level acceleration: a top level BVH over compact instance records, each referencing one of the shared
+/// bottom level primitives that is intersected with the ray transformed in its local space
 struct Instancer : Primitive {
 private:
-    struct Instance : Intersectable {
+    /// Shared primitive that is instanced, meshes are stored separately to intersect them without virtual dispatch
+    struct Blas {
         SharedPrimPtr primitive;
+        TriangleMesh *mesh = nullptr;
+    };
+
+    /// Instance of a bottom level primitive, transformed by uniform scale followed by offset
+    struct Instance {
         vec3 offset;
         float scale;
-        SharedMaterialPtr material;
-
-        bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
-        bool boxIntersect(const BBox &other) override;
-        void expandBox(BBox &other) override;
+        uint32_t blas;  ///< Index in @blasList
+        MaterialId material;  ///< Replaces the material of the primitive unless it is NO_MATERIAL
     };
+
+    std::vector<Blas> blasList;
     std::vector<Instance> instances;
+    BVH tlas;
+
+    /// Only used while adding instances to find already added primitives
+    std::unordered_map<Primitive *, uint32_t> blasIndex;
+
+    /// Packets with fewer active rays are traced through the instances one ray at a time
+    static const int MIN_PACKET_RAYS = 4;
 
-    AcceleratorPtr accelerator;
+    BBox instanceBox(const Instance &instance) const;
+    /// Instance hits are deferred, the distance is converted to the instancer's space and the rest is filled by
+    /// resolveInstanceHit only for the closest hit
+    bool intersectInstance(
+        const Instance &instance, const Ray &ray, float tMin, float tMax, Intersection &intersection);
+    uint32_t intersectInstance(
+        const Instance &instance, RayPacket &packet, uint32_t active, float tMin, Intersection *hits);
+    void resolveInstanceHit(const Instance &instance, const Ray &ray, Intersection &intersection);
+    bool occludedInstance(const Instance &instance, const Ray &ray, float tMin, float tMax);
 
 public:
-    void onBeforeRender() override;
+    void onBeforeRender(ThreadManager *threads) override;
 
     void addInstance(SharedPrimPtr prim,
                      const vec3 &offset = vec3(0.f),
                      float scale = 1.f,
-                     SharedMaterialPtr material = nullptr);
+                     MaterialId material = NO_MATERIAL);
 
     bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+    uint32_t intersectPacket(RayPacket &packet, uint32_t active, float tMin, Intersection *hits) override;
+    bool occluded(const Ray &ray, float tMin, float tMax) override;
 };
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RT_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+/// Functions using instructions above the baseline x86-64 (SSE2) must be marked to be compiled for them
+/// They may only be called after checking for support with the cpuSupports* functions
+#if defined(RT_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define TARGET_AVX2
+#endif
+
+/// Used on traversal templates so they are compiled in the context (and instruction set) of their caller
+#if defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
+/// @brief Check if the CPU running the program supports AVX2 and FMA, the instruction sets of TARGET_AVX2, and the OS
+///        saves the AVX registers
+inline bool cpuSupportsAVX2() {
+#if defined(RT_X86) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#elif defined(RT_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    const bool osSavesYmm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+    const bool fma = info[2] & (1 << 12);
+    __cpuidex(info, 7, 0);
+    return osSavesYmm && fma && (info[1] & (1 << 5));
+#else
+    return false;
+#endif
+}
+
+/// @brief Get the index of the lowest set bit, @mask must not be 0
+inline int lowestBit(uint32_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return int(index);
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+/// @brief Get the number of set bits in @mask
+inline int bitCount(uint32_t mask) {
+#if defined(_MSC_VER)
+    return int(__popcnt(mask));
+#else
+    return __builtin_popcount(mask);
+#endif
+}
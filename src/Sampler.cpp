@@ -0,0 +1,112 @@
+#include "Sampler.hpp"
+
+#include <vector>
+
+static SamplerType samplerType = SamplerType::Sobol;
+
+void setSamplerType(SamplerType type) {
+    samplerType = type;
+    if (type == SamplerType::BlueNoise) {
+        // generate it now instead of in the middle of the first render
+        blueNoiseTexture();
+    }
+}
+
+SamplerType getSamplerType() {
+    return samplerType;
+}
+
+/// @brief Generate a tileable blue noise texture with the void and cluster method (Ulichney 1993), each pixel gets its
+///        rank in the order the method fills the texture, so any threshold of the ranks gives evenly spread pixels
+static std::vector<uint32_t> generateBlueNoise() {
+    const int size = BLUE_NOISE_SIZE;
+    const int mask = size - 1;
+    const int count = size * size;
+    static_assert((BLUE_NOISE_SIZE & (BLUE_NOISE_SIZE - 1)) == 0, "the texture wraps with a mask");
+
+    // gaussian energy of a pixel to all others, wrapping around the edges
+    const float sigma = 1.5f;
+    std::vector<float> kernel(count);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            const int dx = std::min(x, size - x);
+            const int dy = std::min(y, size - y);
+            kernel[y * size + x] = expf(-float(dx * dx + dy * dy) / (2.f * sigma * sigma));
+        }
+    }
+
+    std::vector<uint8_t> pattern(count, 0);
+    std::vector<float> energy(count, 0.f);
+    const auto setPixel = [&](std::vector<uint8_t> &bits, std::vector<float> &field, int index, bool value) {
+        bits[index] = value;
+        const float sign = value ? 1.f : -1.f;
+        const int px = index & mask;
+        const int py = index / size;
+        for (int y = 0; y < size; y++) {
+            const float *row = &kernel[((y - py) & mask) * size];
+            for (int x = 0; x < size; x++) {
+                field[y * size + x] += sign * row[(x - px) & mask];
+            }
+        }
+    };
+    // the set pixel with the most energy is in the tightest cluster, the unset pixel with the least in the largest void
+    const auto find = [&](const std::vector<uint8_t> &bits, const std::vector<float> &field, bool cluster) {
+        int best = -1;
+        for (int c = 0; c < count; c++) {
+            if (bits[c] == cluster && (best == -1 || (cluster ? field[c] > field[best] : field[c] < field[best]))) {
+                best = c;
+            }
+        }
+        return best;
+    };
+
+    // random initial pattern with a tenth of the pixels set, then move pixels from clusters to voids until stable
+    const int initialCount = count / 10;
+    for (uint32_t c = 0, placed = 0; placed < uint32_t(initialCount); c++) {
+        uint32_t key[4] = {c, 0, 0, 0};
+        pcg4d(key);
+        const int index = int(key[0] % uint32_t(count));
+        if (!pattern[index]) {
+            setPixel(pattern, energy, index, true);
+            placed++;
+        }
+    }
+    for (int iteration = 0; iteration < count; iteration++) {
+        const int cluster = find(pattern, energy, true);
+        setPixel(pattern, energy, cluster, false);
+        const int largestVoid = find(pattern, energy, false);
+        setPixel(pattern, energy, largestVoid, true);
+        if (largestVoid == cluster) {
+            break;
+        }
+    }
+
+    std::vector<uint32_t> rank(count);
+    // ranks below the initial pattern, removing the pixels of the tightest clusters first
+    std::vector<uint8_t> bits = pattern;
+    std::vector<float> field = energy;
+    for (int r = initialCount - 1; r >= 0; r--) {
+        const int cluster = find(bits, field, true);
+        setPixel(bits, field, cluster, false);
+        rank[cluster] = r;
+    }
+    // ranks above, filling the largest voids first
+    for (int r = initialCount; r < count; r++) {
+        const int largestVoid = find(pattern, energy, false);
+        setPixel(pattern, energy, largestVoid, true);
+        rank[largestVoid] = r;
+    }
+
+    // spread the ranks over the 32 bit range, each one in the middle of its interval
+    std::vector<uint32_t> texture(count);
+    const uint64_t step = (uint64_t(1) << 32) / count;
+    for (int c = 0; c < count; c++) {
+        texture[c] = uint32_t(rank[c] * step + step / 2);
+    }
+    return texture;
+}
+
+const uint32_t *blueNoiseTexture() {
+    static const std::vector<uint32_t> texture = generateBlueNoise();
+    return texture.data();
+}
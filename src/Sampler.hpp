@@ -0,0 +1,250 @@
+#pragma once
+
+#include <cstdint>
+
+#include "Utils.hpp"
+
+/// The sequences a Sampler draws its numbers from
+enum class SamplerType {
+    Random,  ///< Independent numbers hashed from their (pixel, sample, bounce, dimension) key
+    Sobol,  ///< Owen scrambled Sobol points, scrambled differently for each pixel
+    /// Owen scrambled Sobol points, scrambled the same way for all pixels and shifted by a blue noise texture, so the
+    /// error of neighbour pixels is spread as high frequency noise
+    BlueNoise,
+};
+
+/// @brief Set the type of all samplers, must be called before rendering
+void setSamplerType(SamplerType type);
+
+/// @brief Get the type of all samplers, Sobol unless changed with setSamplerType
+SamplerType getSamplerType();
+
+static const int BLUE_NOISE_SIZE = 64;  ///< Width and height of the tileable blue noise texture
+
+/// @brief Get the blue noise texture, BLUE_NOISE_SIZE rows of BLUE_NOISE_SIZE values each spread uniformly over the
+///        32 bit integers. Generated on the first call.
+const uint32_t *blueNoiseTexture();
+
+/// @brief Hash 4 integers to 4 random integers, the pcg4d hash from "Hash Functions for GPU Rendering" (Jarzynski
+///        and Olano 2020). Only 32 bit multiplies, adds and shifts without branches, so the 4 lanes map to one SIMD
+///        register and loops over many keys vectorize.
+inline void pcg4d(uint32_t v[4]) {
+    for (int c = 0; c < 4; c++) {
+        v[c] = v[c] * 1664525u + 1013904223u;
+    }
+    v[0] += v[1] * v[3];
+    v[1] += v[2] * v[0];
+    v[2] += v[0] * v[1];
+    v[3] += v[1] * v[2];
+    for (int c = 0; c < 4; c++) {
+        v[c] ^= v[c] >> 16;
+    }
+    v[0] += v[1] * v[3];
+    v[1] += v[2] * v[0];
+    v[2] += v[0] * v[1];
+    v[3] += v[1] * v[2];
+}
+
+constexpr uint32_t reverseBits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+/// Generator matrices of the first 4 dimensions of the Sobol sequence, from the primitive polynomials and initial
+/// direction numbers of Joe and Kuo. The matrices are stored as tables of the points for each byte of the index, so a
+/// point is the xor of 4 table rows and each row holds all 4 dimensions for a single SIMD load. The points have their
+/// bits reversed, the order the Owen scramble works in.
+struct SobolTables {
+    uint32_t rows[4][256][4] = {};  ///< [byte of the index][value of the byte][dimension]
+
+    constexpr SobolTables() {
+        // degree, coefficients and initial direction numbers of dimensions 1 to 3, dimension 0 is van der Corput
+        const uint32_t degree[3] = {1, 2, 3};
+        const uint32_t coefficients[3] = {0, 1, 1};
+        const uint32_t initial[3][3] = {{1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+        uint32_t columns[4][32] = {};
+        for (int bit = 0; bit < 32; bit++) {
+            columns[0][bit] = 1u << bit;
+        }
+        for (int dim = 1; dim < 4; dim++) {
+            const uint32_t s = degree[dim - 1];
+            uint32_t *v = columns[dim];
+            for (uint32_t bit = 0; bit < 32; bit++) {
+                if (bit < s) {
+                    // direction number m / 2^(bit + 1), with the bits reversed
+                    v[bit] = reverseBits(initial[dim - 1][bit] << (31 - bit));
+                    continue;
+                }
+                v[bit] = v[bit - s] ^ (v[bit - s] << s);
+                for (uint32_t k = 1; k < s; k++) {
+                    if ((coefficients[dim - 1] >> (s - 1 - k)) & 1) {
+                        v[bit] ^= v[bit - k];
+                    }
+                }
+            }
+        }
+        for (int byte = 0; byte < 4; byte++) {
+            for (int value = 0; value < 256; value++) {
+                for (int bit = 0; bit < 8; bit++) {
+                    if ((value >> bit) & 1) {
+                        for (int dim = 0; dim < 4; dim++) {
+                            rows[byte][value][dim] ^= columns[dim][byte * 8 + bit];
+                        }
+                    }
+                }
+            }
+        }
+    }
+};
+
+inline constexpr SobolTables SOBOL_TABLES;
+
+/// @brief Check the first points of the tables against the Sobol sequence of Joe and Kuo, in the order of the index
+constexpr bool sobolTablesMatchReference() {
+    const uint32_t reference[8][4] = {
+        {0x00000000, 0x00000000, 0x00000000, 0x00000000},
+        {0x80000000, 0x80000000, 0x80000000, 0x80000000},
+        {0x40000000, 0xc0000000, 0xc0000000, 0xc0000000},
+        {0xc0000000, 0x40000000, 0x40000000, 0x40000000},
+        {0x20000000, 0xa0000000, 0x60000000, 0x20000000},
+        {0xa0000000, 0x20000000, 0xe0000000, 0xa0000000},
+        {0x60000000, 0x60000000, 0xa0000000, 0xe0000000},
+        {0xe0000000, 0xe0000000, 0x20000000, 0x60000000},
+    };
+    for (int index = 0; index < 8; index++) {
+        for (int dim = 0; dim < 4; dim++) {
+            if (reverseBits(SOBOL_TABLES.rows[0][index][dim]) != reference[index][dim]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static_assert(sobolTablesMatchReference(), "the Sobol tables must generate the reference points");
+
+/// @brief Get point @index of the first 4 dimensions of the Sobol sequence, as fractions of 2^32 with reversed bits
+inline void sobol4dReversed(uint32_t index, uint32_t point[4]) {
+    for (int dim = 0; dim < 4; dim++) {
+        point[dim] = SOBOL_TABLES.rows[0][index & 0xff][dim] ^ SOBOL_TABLES.rows[1][(index >> 8) & 0xff][dim] ^
+                     SOBOL_TABLES.rows[2][(index >> 16) & 0xff][dim] ^ SOBOL_TABLES.rows[3][index >> 24][dim];
+    }
+}
+
+/// @brief Laine-Karras permutation of the bits of @x, each bit is flipped depending only on the lower bits, with the
+///        constants from "Practical Hash-based Owen Scrambling" (Burley 2020)
+inline uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+    x ^= x * 0x3d20adea;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56;
+    x ^= x * 0x53a22864;
+    return x;
+}
+
+/// @brief Owen scramble the bits of @x, each bit is flipped depending only on the higher bits. Applied to the index of
+///        a sequence it shuffles the order of the points.
+inline uint32_t owenScramble(uint32_t x, uint32_t seed) {
+    return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+/// Hands out the random numbers of a path dimension by dimension for each vertex of the path. Each vertex starts again
+/// at dimension 0, so the numbers of a bounce do not depend on how many numbers the previous bounces used, and all
+/// numbers depend only on the (pixel, sample, bounce, dimension) key and not on the thread or the paths before them.
+/// Numbers come in blocks of 4 dimensions, for Sobol each block is a 4D point with its own scramble.
+struct Sampler {
+    /// @brief Start the numbers of a sample at bounce 0
+    /// @param x, y - the pixel, both must be below 2^16
+    /// @param index - index of the sample in the pixel
+    void startSample(uint32_t x, uint32_t y, uint32_t index) {
+        type = getSamplerType();
+        pixelX = x;
+        pixelY = y;
+        sample = index;
+        startBounce(0);
+    }
+
+    /// @brief Switch to the numbers of another vertex of the current sample
+    void startBounce(uint32_t index) {
+        bounce = index;
+        dimension = 0;
+    }
+
+    /// @brief Get the next number of the current bounce, in [0, 1)
+    float next() {
+        const uint32_t lane = dimension & 3;
+        if (lane == 0) {
+            generateBlock();
+        }
+        dimension++;
+        // the top 24 bits fill the float mantissa exactly
+        return float(block[lane] >> 8) * (1.f / 16777216.f);
+    }
+
+private:
+    void generateBlock() {
+        const uint32_t pixel = pixelX | pixelY << 16;
+        const uint32_t group = dimension >> 2;
+        if (type == SamplerType::Random) {
+            block[0] = pixel;
+            block[1] = sample;
+            block[2] = bounce;
+            block[3] = dimension;
+            pcg4d(block);
+            return;
+        }
+
+        const uint32_t scramblePixel = type == SamplerType::BlueNoise ? 0 : pixel;
+        uint32_t seeds[4] = {scramblePixel, bounce, group, 0};
+        uint32_t shuffle[4] = {scramblePixel, bounce, group, 1};
+        pcg4d(seeds);
+        pcg4d(shuffle);
+        sobol4dReversed(owenScramble(sample, shuffle[0]), block);
+        for (int dim = 0; dim < 4; dim++) {
+            block[dim] = reverseBits(laineKarrasPermutation(block[dim], seeds[dim]));
+        }
+        if (type == SamplerType::BlueNoise) {
+            // toroidal shift of each dimension by the texture, read at a different offset for each dimension
+            const uint32_t *texture = blueNoiseTexture();
+            const uint32_t mask = BLUE_NOISE_SIZE - 1;
+            for (int dim = 0; dim < 4; dim++) {
+                const uint32_t x = (pixelX + (shuffle[1] >> (8 * dim))) & mask;
+                const uint32_t y = (pixelY + (shuffle[2] >> (8 * dim))) & mask;
+                block[dim] += texture[y * BLUE_NOISE_SIZE + x];
+            }
+        }
+    }
+
+    SamplerType type = SamplerType::Random;
+    uint32_t pixelX = 0;
+    uint32_t pixelY = 0;
+    uint32_t sample = 0;
+    uint32_t bounce = 0;
+    uint32_t dimension = 0;  ///< Index of the next number in the bounce
+    uint32_t block[4] = {};  ///< Numbers for the dimensions [dimension & ~3, dimension | 3]
+};
+
+/// @brief Get the sampler of the calling thread, used by randFloat
+inline Sampler &threadSampler() {
+    thread_local Sampler sampler;
+    return sampler;
+}
+
+/// @brief Get random float in range [0, 1) from the sampler of the calling thread
+inline float randFloat() {
+    return threadSampler().next();
+}
+
+/// @brief Get a point uniformly distributed inside the unit sphere, made from exactly 3 numbers of the sampler so
+///        stratified samplers keep their stratification
+inline vec3 randomUnitSphere() {
+    const float z = 2.f * randFloat() - 1.f;
+    const float phi = 2.f * PI * randFloat();
+    const float radius = cbrtf(randFloat());
+    const float ring = sqrtf(std::max(1.f - z * z, 0.f)) * radius;
+    return vec3(ring * cosf(phi), ring * sinf(phi), z * radius);
+}
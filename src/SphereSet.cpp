@@ -0,0 +1,347 @@
+#include "SphereSet.hpp"
+
+#include <cstdio>
+
+#include "Threading.hpp"
+
+void SphereSet::reserve(uint32_t count) {
+    added.reserve(count);
+}
+
+void SphereSet::add(const vec3& center, float radius, MaterialId material) {
+    added.push_back(Sphere{center, radius, material});
+    box.add(center + vec3(radius, radius, radius));
+    box.add(center - vec3(radius, radius, radius));
+}
+
+/// @brief Get the type of the tree over the spheres for the default accelerator type and the running CPU
+///        The spheres are always in one of the BVH types, the oct and kd tree select the widest BVH instead
+static AcceleratorType sphereTreeType() {
+    const AcceleratorType type = getDefaultAcceleratorType();
+    if (type == AcceleratorType::BVH || type == AcceleratorType::BVH4) {
+        return type;
+    }
+    return bestWideBVHType();
+}
+
+static const char *sphereTreeName(AcceleratorType type) {
+    return type == AcceleratorType::BVH8 ? "BVH8" : type == AcceleratorType::BVH4 ? "BVH4" : "BVH";
+}
+
+void SphereSet::onBeforeRender(ThreadManager *threads) {
+    if (!count) {
+        buildSphereTree(sphereTreeType(), threads);
+    }
+}
+
+void SphereSet::buildSphereTree(AcceleratorType type, ThreadManager *threads) {
+    if (added.empty()) {
+        return;
+    }
+    treeType = type;
+    Timer timer;
+
+    std::vector<BBox> boxes(added.size());
+    for (int c = 0; c < added.size(); c++) {
+        const vec3 extent(added[c].radius, added[c].radius, added[c].radius);
+        boxes[c].add(added[c].center - extent);
+        boxes[c].add(added[c].center + extent);
+    }
+    BVHBuildSettings settings;
+    // a leaf is tested with a single group of the kernel used by the tree
+    settings.maxLeafSize = type == AcceleratorType::BVH8 ? WIDE_LANES : LANES;
+    bvh.build(boxes, settings, threads);
+    bvh.applyOrder(added);
+
+    count = uint32_t(added.size());
+    for (int c = 0; c < 3; c++) {
+        center[c].assign(count + PADDING, 0.f);
+    }
+    radius.assign(count + PADDING, 0.f);
+    materials.assign(count + PADDING, NO_MATERIAL);
+    for (uint32_t c = 0; c < count; c++) {
+        for (int r = 0; r < 3; r++) {
+            center[r][c] = added[c].center[r];
+        }
+        radius[c] = added[c].radius;
+        materials[c] = added[c].material;
+    }
+    std::vector<Sphere>().swap(added);
+
+    int nodeCount = int(bvh.nodes.size());
+    int depth = bvh.depth;
+    size_t treeMemory = bvh.memoryUsage();
+    if (type == AcceleratorType::BVH8) {
+        bvh8.build(bvh);
+        nodeCount = int(bvh8.nodes.size());
+        depth = bvh8.depth;
+        treeMemory = bvh8.memoryUsage();
+        bvh.clear();
+    } else if (type == AcceleratorType::BVH4) {
+        bvh4.build(bvh);
+        nodeCount = int(bvh4.nodes.size());
+        depth = bvh4.depth;
+        treeMemory = bvh4.memoryUsage();
+        bvh.clear();
+    }
+    printf("Built sphere set %s with %d spheres in %ldms, nodes %d, depth %d, %gKB\n",
+           sphereTreeName(type),
+           int(count),
+           timer.toMs(timer.elapsedNs()),
+           nodeCount,
+           depth,
+           (treeMemory + memoryUsage()) / 1024.f);
+}
+
+/// @brief Same test as SpherePrim::intersect with the halved b, 4 spheres at a time with SSE
+template <>
+FORCE_INLINE int SphereSet::intersectSpheres<SphereSet::LANES>(
+    const Ray& ray, uint32_t first, uint32_t count, float tMin, float& tMax) const {
+    int closest = -1;
+    const float a = dot(ray.dir, ray.dir);
+#if defined(RT_X86)
+    const __m128 Dx = _mm_set1_ps(ray.dir.x);
+    const __m128 Dy = _mm_set1_ps(ray.dir.y);
+    const __m128 Dz = _mm_set1_ps(ray.dir.z);
+    const __m128 A = _mm_set1_ps(a);
+    const __m128 invA = _mm_set1_ps(1.f / a);
+    for (uint32_t group = first; group < first + count; group += LANES) {
+        const __m128 Hx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(&center[0][group]));
+        const __m128 Hy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(&center[1][group]));
+        const __m128 Hz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(&center[2][group]));
+        const __m128 R = _mm_loadu_ps(&radius[group]);
+
+        const __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Dx, Hx), _mm_mul_ps(Dy, Hy)), _mm_mul_ps(Dz, Hz));
+        const __m128 c = _mm_sub_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(Hx, Hx), _mm_mul_ps(Hy, Hy)), _mm_mul_ps(Hz, Hz)), _mm_mul_ps(R, R));
+        const __m128 D = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(A, c));
+        // lanes that miss take the root of 0 and are masked out below
+        const __m128 t =
+            _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), b), _mm_sqrt_ps(_mm_max_ps(D, _mm_setzero_ps()))), invA);
+        __m128 valid = _mm_cmpge_ps(D, _mm_setzero_ps());
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(t, _mm_set1_ps(tMin)));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(t, _mm_set1_ps(tMax)));
+
+        uint32_t mask = uint32_t(_mm_movemask_ps(valid));
+        if (first + count - group < LANES) {
+            mask &= (1u << (first + count - group)) - 1;
+        }
+        if (!mask) {
+            continue;
+        }
+        float distances[LANES];
+        _mm_storeu_ps(distances, t);
+        for (; mask; mask &= mask - 1) {
+            const int lane = lowestBit(mask);
+            if (distances[lane] <= tMax) {
+                tMax = distances[lane];
+                closest = int(group) + lane;
+            }
+        }
+    }
+#else
+    for (uint32_t s = first; s < first + count; s++) {
+        const vec3 H = ray.origin - vec3(center[0][s], center[1][s], center[2][s]);
+        const float b = dot(ray.dir, H);
+        const float c = dot(H, H) - radius[s] * radius[s];
+        const float D = b * b - a * c;
+        if (D < 0.f) {
+            continue;
+        }
+        const float t = (-b - sqrtf(D)) / a;
+        if (t >= tMin && t <= tMax) {
+            tMax = t;
+            closest = int(s);
+        }
+    }
+#endif
+    return closest;
+}
+
+/// @brief The SSE kernel widened to 8 spheres at a time with AVX2, a BVH8 leaf is a single group
+template <>
+TARGET_AVX2 inline int SphereSet::intersectSpheres<SphereSet::WIDE_LANES>(
+    const Ray& ray, uint32_t first, uint32_t count, float tMin, float& tMax) const {
+#if defined(RT_X86)
+    int closest = -1;
+    const float a = dot(ray.dir, ray.dir);
+    const __m256 Dx = _mm256_set1_ps(ray.dir.x);
+    const __m256 Dy = _mm256_set1_ps(ray.dir.y);
+    const __m256 Dz = _mm256_set1_ps(ray.dir.z);
+    const __m256 A = _mm256_set1_ps(a);
+    const __m256 invA = _mm256_set1_ps(1.f / a);
+    for (uint32_t group = first; group < first + count; group += WIDE_LANES) {
+        const __m256 Hx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(&center[0][group]));
+        const __m256 Hy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(&center[1][group]));
+        const __m256 Hz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(&center[2][group]));
+        const __m256 R = _mm256_loadu_ps(&radius[group]);
+
+        const __m256 b = _mm256_fmadd_ps(Dz, Hz, _mm256_fmadd_ps(Dy, Hy, _mm256_mul_ps(Dx, Hx)));
+        const __m256 c =
+            _mm256_fnmadd_ps(R, R, _mm256_fmadd_ps(Hz, Hz, _mm256_fmadd_ps(Hy, Hy, _mm256_mul_ps(Hx, Hx))));
+        const __m256 D = _mm256_fnmadd_ps(A, c, _mm256_mul_ps(b, b));
+        const __m256 t = _mm256_mul_ps(
+            _mm256_sub_ps(_mm256_sub_ps(_mm256_setzero_ps(), b), _mm256_sqrt_ps(_mm256_max_ps(D, _mm256_setzero_ps()))),
+            invA);
+        __m256 valid = _mm256_cmp_ps(D, _mm256_setzero_ps(), _CMP_GE_OQ);
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(tMin), _CMP_GE_OQ));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(tMax), _CMP_LE_OQ));
+
+        uint32_t mask = uint32_t(_mm256_movemask_ps(valid));
+        if (first + count - group < WIDE_LANES) {
+            mask &= (1u << (first + count - group)) - 1;
+        }
+        if (!mask) {
+            continue;
+        }
+        float distances[WIDE_LANES];
+        _mm256_storeu_ps(distances, t);
+        for (; mask; mask &= mask - 1) {
+            const int lane = lowestBit(mask);
+            if (distances[lane] <= tMax) {
+                tMax = distances[lane];
+                closest = int(group) + lane;
+            }
+        }
+    }
+    return closest;
+#else
+    return intersectSpheres<LANES>(ray, first, count, tMin, tMax);
+#endif
+}
+
+template <int Lanes, typename Tree>
+FORCE_INLINE bool SphereSet::intersectTree(
+    const Tree& tree, const Ray& ray, float tMin, float tMax, Intersection& intersection) const {
+    int closest = -1;
+    float closestDist = tMax;
+    tree.intersect(ray, tMin, tMax, [&](uint32_t first, uint32_t count, float tMin, float& tMax) {
+        const int hit = intersectSpheres<Lanes>(ray, first, count, tMin, tMax);
+        if (hit == -1) {
+            return false;
+        }
+        closest = hit;
+        closestDist = tMax;
+        return true;
+    });
+    if (closest == -1) {
+        return false;
+    }
+    intersection.t = closestDist;
+    intersection.primitive = uint32_t(closest);
+    return true;
+}
+
+template <int Lanes, typename Tree>
+FORCE_INLINE uint32_t SphereSet::intersectTreePacket(
+    const Tree& tree, RayPacket& packet, uint32_t active, float tMin, Intersection* hits) const {
+    const auto leaf = [&](uint32_t first, uint32_t count, uint32_t active) {
+        uint32_t leafHits = 0;
+        for (uint32_t mask = active; mask; mask &= mask - 1) {
+            const int lane = lowestBit(mask);
+            const int hit = intersectSpheres<Lanes>(packet.getRay(lane), first, count, tMin, packet.tMax[lane]);
+            if (hit != -1) {
+                hits[lane].primitive = uint32_t(hit);
+                leafHits |= 1u << lane;
+            }
+        }
+        return leafHits;
+    };
+    const uint32_t hitMask = tree.intersectPacket(packet, active, tMin, leaf);
+    for (uint32_t mask = hitMask; mask; mask &= mask - 1) {
+        const int lane = lowestBit(mask);
+        hits[lane].t = packet.tMax[lane];
+    }
+    return hitMask;
+}
+
+template <int Lanes, typename Tree>
+FORCE_INLINE bool SphereSet::occludedTree(const Tree& tree, const Ray& ray, float tMin, float tMax) const {
+    return tree.occluded(ray, tMin, tMax, [&](uint32_t first, uint32_t count) {
+        float tHit = tMax;
+        return intersectSpheres<Lanes>(ray, first, count, tMin, tHit) != -1;
+    });
+}
+
+TARGET_AVX2 bool SphereSet::intersectTree8(const Ray& ray, float tMin, float tMax, Intersection& intersection) const {
+    return intersectTree<WIDE_LANES>(bvh8, ray, tMin, tMax, intersection);
+}
+
+TARGET_AVX2 uint32_t SphereSet::intersectTreePacket8(RayPacket& packet,
+                                                     uint32_t active,
+                                                     float tMin,
+                                                     Intersection* hits) const {
+    return intersectTreePacket<WIDE_LANES>(bvh8, packet, active, tMin, hits);
+}
+
+TARGET_AVX2 bool SphereSet::occludedTree8(const Ray& ray, float tMin, float tMax) const {
+    return occludedTree<WIDE_LANES>(bvh8, ray, tMin, tMax);
+}
+
+bool SphereSet::intersect(const Ray& ray, float tMin, float tMax, Intersection& intersection) {
+    if (!intersectDeferred(ray, tMin, tMax, intersection)) {
+        return false;
+    }
+    resolveHit(ray, intersection);
+    return true;
+}
+
+bool SphereSet::intersectDeferred(const Ray& ray, float tMin, float tMax, Intersection& intersection) {
+    if (!count || !box.testIntersect(ray)) {
+        return false;
+    }
+    switch (treeType) {
+    case AcceleratorType::BVH8:
+        return intersectTree8(ray, tMin, tMax, intersection);
+    case AcceleratorType::BVH4:
+        return intersectTree<LANES>(bvh4, ray, tMin, tMax, intersection);
+    default:
+        return intersectTree<LANES>(bvh, ray, tMin, tMax, intersection);
+    }
+}
+
+void SphereSet::resolveHit(const Ray& ray, Intersection& intersection) {
+    const uint32_t s = intersection.primitive;
+    intersection.p = ray.at(intersection.t);
+    intersection.normal = (intersection.p - vec3(center[0][s], center[1][s], center[2][s])) / radius[s];
+    intersection.material = materials[s];
+}
+
+bool SphereSet::occluded(const Ray& ray, float tMin, float tMax) {
+    if (!count || !box.testIntersect(ray)) {
+        return false;
+    }
+    switch (treeType) {
+    case AcceleratorType::BVH8:
+        return occludedTree8(ray, tMin, tMax);
+    case AcceleratorType::BVH4:
+        return occludedTree<LANES>(bvh4, ray, tMin, tMax);
+    default:
+        return occludedTree<LANES>(bvh, ray, tMin, tMax);
+    }
+}
+
+uint32_t SphereSet::intersectPacket(RayPacket& packet, uint32_t active, float tMin, Intersection* hits) {
+    float nearest;
+    active = count ? intersectBox(box, packet, active, tMin, nearest) : 0;
+    if (!active) {
+        return 0;
+    }
+    uint32_t hitMask;
+    switch (treeType) {
+    case AcceleratorType::BVH8:
+        hitMask = intersectTreePacket8(packet, active, tMin, hits);
+        break;
+    case AcceleratorType::BVH4:
+        hitMask = intersectTreePacket<LANES>(bvh4, packet, active, tMin, hits);
+        break;
+    default:
+        hitMask = intersectTreePacket<LANES>(bvh, packet, active, tMin, hits);
+        break;
+    }
+    for (uint32_t mask = hitMask; mask; mask &= mask - 1) {
+        const int lane = lowestBit(mask);
+        resolveHit(packet.getRay(lane), hits[lane]);
+    }
+    return hitMask;
+}
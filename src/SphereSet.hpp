@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+
+#include "BVH.hpp"
+#include "Primitive.hpp"
+#include "Utils.hpp"
+
+/// Many spheres under a single BVH of their own, for particle scenes with up to millions of spheres
+/// The spheres are stored as structure of arrays in the leaf order of the tree, so a ray is tested against all spheres
+/// of a leaf with SIMD. Hits record only the distance and the index of the sphere and are completed by resolveHit
+struct SphereSet : Primitive {
+    static const int LANES = 4;  ///< Number of spheres tested at once by the SSE kernel
+    static const int WIDE_LANES = 8;  ///< Number of spheres tested at once by the AVX2 kernel of the BVH8
+    /// Arrays are padded with this many spheres past the last one, so the loads of the last group stay in bounds
+    static const int PADDING = WIDE_LANES;
+
+    AcceleratorType treeType = AcceleratorType::BVH;  ///< Which of the trees over the spheres is built
+    BVH bvh;
+    WideBVH<4> bvh4;
+    WideBVH<8> bvh8;
+    std::vector<float> center[3];
+    std::vector<float> radius;
+    std::vector<MaterialId> materials;
+    uint32_t count = 0;  ///< Number of spheres, set once the tree is built
+
+    /// @brief Reserve memory for @count spheres before they are added
+    void reserve(uint32_t count);
+
+    /// @brief Add a sphere, all spheres must be added before onBeforeRender builds the tree
+    void add(const vec3 &center, float radius, MaterialId material);
+
+    void onBeforeRender(ThreadManager *threads) override;
+
+    bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+    uint32_t intersectPacket(RayPacket &packet, uint32_t active, float tMin, Intersection *hits) override;
+    bool occluded(const Ray &ray, float tMin, float tMax) override;
+    bool intersectDeferred(const Ray &ray, float tMin, float tMax, Intersection &intersection) override;
+    void resolveHit(const Ray &ray, Intersection &intersection) override;
+
+    size_t memoryUsage() const {
+        return radius.size() * (sizeof(float) * 4 + sizeof(MaterialId));
+    }
+
+private:
+    /// Sphere as added, the spheres are moved to the arrays in leaf order when the tree is built
+    struct Sphere {
+        vec3 center;
+        float radius;
+        MaterialId material;
+    };
+
+    std::vector<Sphere> added;
+
+    /// @brief Build the tree of type @type over the added spheres and move them to the arrays in leaf order
+    void buildSphereTree(AcceleratorType type, ThreadManager *threads);
+
+    /// @brief Find the closest intersection of the ray with the spheres [first, first + count), @Lanes at a time
+    /// @param tMax [in/out] - far clip distance, set to the distance of the found intersection
+    /// @return index of the closest intersected sphere or -1 if none is hit inside (tMin, tMax)
+    template <int Lanes>
+    int intersectSpheres(const Ray &ray, uint32_t first, uint32_t count, float tMin, float &tMax) const;
+
+    template <int Lanes, typename Tree>
+    bool intersectTree(const Tree &tree, const Ray &ray, float tMin, float tMax, Intersection &intersection) const;
+    template <int Lanes, typename Tree>
+    uint32_t intersectTreePacket(
+        const Tree &tree, RayPacket &packet, uint32_t active, float tMin, Intersection *hits) const;
+    template <int Lanes, typename Tree>
+    bool occludedTree(const Tree &tree, const Ray &ray, float tMin, float tMax) const;
+
+    /// @brief Separate so they can be compiled for AVX2 with the traversal and the 8 wide kernel inlined
+    bool intersectTree8(const Ray &ray, float tMin, float tMax, Intersection &intersection) const;
+    uint32_t intersectTreePacket8(RayPacket &packet, uint32_t active, float tMin, Intersection *hits) const;
+    bool occludedTree8(const Ray &ray, float tMin, float tMax) const;
+};
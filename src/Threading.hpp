@@ -97,6 +97,8 @@ struct Timer {
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <condition_variable>
 
 struct ThreadManager;
@@ -117,6 +119,77 @@ struct Task {
 	virtual ~Task() {};
 };
 
+/// Distributes the work items [0, itemCount) between threads, each thread starts with a contiguous range of items
+/// and takes them from the front, when its range is empty it steals the back half of the range of another thread
+/// Items that are close in index stay on the same thread unless they have to be stolen to balance the load
+struct WorkStealingRanges {
+	/// Split the items in equal ranges between threads, must be called before any thread calls @next
+	/// @param itemCount - the number of work items
+	/// @param threadCount - the number of threads that will call @next
+	void init(int itemCount, int threadCount) {
+		mAssert(itemCount >= 0 && threadCount > 0);
+		count = threadCount;
+		ranges.reset(new Range[threadCount]);
+		for (int c = 0; c < threadCount; c++) {
+			const uint32_t begin = uint32_t(int64_t(itemCount) * c / threadCount);
+			const uint32_t end = uint32_t(int64_t(itemCount) * (c + 1) / threadCount);
+			ranges[c].bounds.store(pack(begin, end), std::memory_order_relaxed);
+		}
+	}
+
+	/// Get the next work item for a thread
+	/// @param threadIndex - 0 based index of the calling thread
+	/// @param item [out] - the item to process
+	/// @return false when there are no items left for any thread
+	bool next(int threadIndex, int &item) {
+		std::atomic<uint64_t> &own = ranges[threadIndex].bounds;
+		uint64_t bounds = own.load(std::memory_order_relaxed);
+		while (begin(bounds) < end(bounds)) {
+			if (own.compare_exchange_weak(bounds, pack(begin(bounds) + 1, end(bounds)), std::memory_order_relaxed)) {
+				item = int(begin(bounds));
+				return true;
+			}
+		}
+
+		for (int c = 1; c < count; c++) {
+			std::atomic<uint64_t> &victim = ranges[(threadIndex + c) % count].bounds;
+			uint64_t victimBounds = victim.load(std::memory_order_relaxed);
+			while (begin(victimBounds) < end(victimBounds)) {
+				const uint32_t middle = begin(victimBounds) + (end(victimBounds) - begin(victimBounds)) / 2;
+				if (victim.compare_exchange_weak(victimBounds, pack(begin(victimBounds), middle), std::memory_order_relaxed)) {
+					// only the owner stores to an empty range, thieves skip it
+					own.store(pack(middle + 1, end(victimBounds)), std::memory_order_relaxed);
+					item = int(middle);
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+private:
+	/// The begin of the range is in the low 32 bits, the end in the high 32 bits so both are updated together
+	/// Aligned to cache line so threads taking items from their own range do not share it
+	struct alignas(64) Range {
+		std::atomic<uint64_t> bounds{0};
+	};
+
+	static uint64_t pack(uint32_t begin, uint32_t end) {
+		return uint64_t(begin) | (uint64_t(end) << 32);
+	}
+
+	static uint32_t begin(uint64_t bounds) {
+		return uint32_t(bounds);
+	}
+
+	static uint32_t end(uint64_t bounds) {
+		return uint32_t(bounds >> 32);
+	}
+
+	std::unique_ptr<Range[]> ranges;
+	int count = 0; ///< The number of threads
+};
+
 /// Non re-entrant task runner
 struct ThreadManager {
 	ThreadManager(const ThreadManager &) = delete;
@@ -270,4 +343,46 @@ private:
 
 inline void Task::runOn(ThreadManager &tm) {
 	tm.runThreads(*this);
-}
\ No newline at end of file
+}
+
+/// Task calling a function for each of @count items, the threads take items in increasing order
+template <typename Function>
+struct ParallelForTask : Task {
+	ParallelForTask(int count, Function &function)
+		: count(count)
+		, function(function)
+	{}
+
+	void run(int threadIndex, int threadCount) override {
+		for (int item = next.fetch_add(1); item < count; item = next.fetch_add(1)) {
+			function(item, threadIndex);
+		}
+	}
+
+	int count;
+	Function &function;
+	std::atomic<int> next{0};
+};
+
+/// Call function(item, threadIndex) for each item in [0, count) on all threads of @tm
+/// Runs on the calling thread when @tm is nullptr, so code can be shared with the single threaded case
+/// Must not be called from inside a running Task, the ThreadManager is not re-entrant
+/// @param tm - the threads to use or nullptr
+/// @param count - the number of items
+/// @param function - called with the item and the 0 based index of the thread calling it
+template <typename Function>
+void parallelFor(ThreadManager *tm, int count, Function &&function) {
+	if (!tm || count <= 1) {
+		for (int c = 0; c < count; c++) {
+			function(c, 0);
+		}
+		return;
+	}
+	ParallelForTask<Function> task(count, function);
+	task.runOn(*tm);
+}
+
+/// Get the number of threads parallelFor will use with @tm
+inline int parallelThreadCount(ThreadManager *tm) {
+	return tm ? tm->getThreadCount() : 1;
+}
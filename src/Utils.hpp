@@ -1,10 +1,12 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cfloat>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <ostream>
-#include <random>
 
 static const int MAX_RAY_DEPTH = 35;
 const float PI = 3.14159265358979323846;
@@ -17,6 +19,48 @@ inline bool similar(float a, float b) {
     return fabs(a - b) < 1e-4;
 }
 
+/// @brief Interleave the bits of @x and @y to get their index along a Z-order curve, both must be below 2^16
+inline uint32_t mortonCode2D(uint32_t x, uint32_t y) {
+    const auto spread = [](uint32_t v) {
+        v = (v | (v << 8)) & 0x00FF00FF;
+        v = (v | (v << 4)) & 0x0F0F0F0F;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+/// @brief Interleave the bits of @x, @y and @z to get their index along a Z-order curve, all must be below 2^10
+inline uint32_t mortonCode3D(uint32_t x, uint32_t y, uint32_t z) {
+    const auto spread = [](uint32_t v) {
+        v = (v | (v << 16)) & 0x030000FF;
+        v = (v | (v << 8)) & 0x0300F00F;
+        v = (v | (v << 4)) & 0x030C30C3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1) | (spread(z) << 2);
+}
+
+/// @brief Hash @size bytes of @data, 8 bytes at a time, to detect changes in files - not suitable for hash tables
+inline uint64_t hashBytes(const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    const uint64_t prime = 0x100000001b3ull;
+    uint64_t hash = 0xcbf29ce484222325ull ^ size;
+    size_t c = 0;
+    for (; c + 8 <= size; c += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + c, 8);
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+    for (; c < size; c++) {
+        hash = (hash ^ bytes[c]) * prime;
+    }
+    return hash;
+}
+
 /// Basic vector with 3 floats
 struct vec3 {
     union {
@@ -155,15 +199,26 @@ inline vec3 cross(const vec3 &u, const vec3 &v) {
                 u._v[0] * v._v[1] - u._v[1] * v._v[0]);
 }
 
-/// Ray represented by origin and direction
+/// Ray represented by origin and direction, caches the inverse and the signs of the direction for box tests
 struct Ray {
     vec3 origin;
-    vec3 dir;
+    vec3 dir;  ///< Set with setDir so the cached values stay in sync
+    vec3 invDir;  ///< Component-wise inverse of @dir
+    uint8_t dirIsNeg[3];  ///< 1 for the axes where @dir is negative, selects the near and far plane of a box
 
     Ray() {}
 
-    Ray(const vec3 &origin, const vec3 &dir) : origin(origin), dir(dir) {
+    Ray(const vec3 &origin, const vec3 &dir) : origin(origin) {
         assert(dir.isNormal());
+        setDir(dir);
+    }
+
+    void setDir(const vec3 &direction) {
+        dir = direction;
+        invDir = direction.inverted();
+        for (int c = 0; c < 3; c++) {
+            dirIsNeg[c] = invDir[c] < 0;
+        }
     }
 
     vec3 at(float t) const {
@@ -171,21 +226,6 @@ struct Ray {
     }
 };
 
-/// @brief Get random float in range [0, 1]
-inline float randFloat() {
-    thread_local std::mt19937 rng(42);
-    std::uniform_real_distribution<float> dist(0.f, 1.f);
-    return dist(rng);
-}
-
-inline vec3 randomUnitSphere() {
-    vec3 p;
-    do {
-        p = 2.0f * vec3(randFloat(), randFloat(), randFloat()) - vec3(1);
-    } while (p.lengthSquare() >= 1.f);
-    return p;
-}
-
 /// @brief Reflect vector @v from a surface with a normal @normal
 /// @param v - the vector to reflect
 /// @param normal - the surface normal
@@ -194,6 +234,31 @@ inline vec3 reflect(const vec3 &v, const vec3 &normal) {
     return v - 2.f * dot(v, normal) * normal;
 }
 
+/// Orthonormal basis around a unit normal, converts directions between world space and the local space of a surface
+/// where the normal is the z axis. Built without branches on the normal, from "Building an Orthonormal Basis,
+/// Revisited" (Duff et al. 2017)
+struct Frame {
+    vec3 tangent;
+    vec3 bitangent;
+    vec3 normal;
+
+    Frame(const vec3 &normal) : normal(normal) {
+        const float sign = copysignf(1.f, normal.z);
+        const float a = -1.f / (sign + normal.z);
+        const float b = normal.x * normal.y * a;
+        tangent = vec3(1.f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+        bitangent = vec3(b, sign + normal.y * normal.y * a, -normal.y);
+    }
+
+    vec3 toLocal(const vec3 &v) const {
+        return vec3(dot(v, tangent), dot(v, bitangent), dot(v, normal));
+    }
+
+    vec3 toWorld(const vec3 &v) const {
+        return v.x * tangent + v.y * bitangent + v.z * normal;
+    }
+};
+
 /// Axis aligned bounding box, needs only min and max point of the box
 struct BBox {
     vec3 min = {FLT_MAX, FLT_MAX, FLT_MAX};
@@ -217,6 +282,26 @@ struct BBox {
         max = ::max(max, point);
     }
 
+    /// @brief Get the center point of the box
+    vec3 center() const {
+        return (min + max) * 0.5f;
+    }
+
+    /// @brief Get the surface area of the box, used for SAH cost estimation
+    float surfaceArea() const {
+        const vec3 size = max - min;
+        return 2.f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+
+    /// @brief Get the index of the axis with the biggest extent
+    int maxExtentAxis() const {
+        const vec3 size = max - min;
+        if (size.x > size.y && size.x > size.z) {
+            return 0;
+        }
+        return size.y > size.z ? 1 : 2;
+    }
+
     /// @brief Check if given point is inside the box with some tolerance
     bool inside(const vec3 &point) const {
         return (min.x - 1e-6 <= point.x && point.x <= max.x + 1e-6 && min.y - 1e-6 <= point.y &&
@@ -250,6 +335,62 @@ struct BBox {
         return {::max(min, other.min), ::min(max, other.max)};
     }
 
+    /// @brief Slab test of a ray against the box, unlike testIntersect this also respects the ray interval
+    ///        and works for flat boxes
+    /// @param origin - the ray origin
+    /// @param invDir - component-wise inverse of the ray direction
+    /// @param tMin - near clip distance
+    /// @param tMax - far clip distance
+    /// @return true if the ray overlaps the box inside (tMin, tMax)
+    bool testIntersect(const vec3 &origin, const vec3 &invDir, float tMin, float tMax) const {
+        return clipRay(origin, invDir, tMin, tMax);
+    }
+
+    /// @brief Same as testIntersect with the cached inverse direction of @ray
+    bool testIntersect(const Ray &ray, float tMin, float tMax) const {
+        return clipRay(ray, tMin, tMax);
+    }
+
+    /// @brief Clip the ray interval to the part inside the box
+    /// @param origin - the ray origin
+    /// @param invDir - component-wise inverse of the ray direction
+    /// @param tMin [in/out] - near clip distance, set to the distance where the ray enters the box
+    /// @param tMax [in/out] - far clip distance, set to the distance where the ray leaves the box
+    /// @return true if the ray overlaps the box inside the initial (tMin, tMax)
+    bool clipRay(const vec3 &origin, const vec3 &invDir, float &tMin, float &tMax) const {
+        for (int dim = 0; dim < 3; dim++) {
+            float tNear = (min[dim] - origin[dim]) * invDir[dim];
+            float tFar = (max[dim] - origin[dim]) * invDir[dim];
+            if (tNear > tFar) {
+                std::swap(tNear, tFar);
+            }
+            // make the test conservative for rounding errors, see pbrt-v3 3.9.2
+            tFar *= 1.f + 3.f * FLT_EPSILON;
+            tMin = tNear > tMin ? tNear : tMin;
+            tMax = tFar < tMax ? tFar : tMax;
+            if (tMin > tMax) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// @brief Clip the ray interval to the part inside the box, the near and far plane of each axis are picked by
+    ///        the cached signs of the ray, so there are no branches and no swaps
+    /// @param tMin [in/out] - near clip distance, set to the distance where the ray enters the box
+    /// @param tMax [in/out] - far clip distance, set to the distance where the ray leaves the box
+    /// @return true if the ray overlaps the box inside the initial (tMin, tMax)
+    bool clipRay(const Ray &ray, float &tMin, float &tMax) const {
+        for (int dim = 0; dim < 3; dim++) {
+            const float tNear = ((ray.dirIsNeg[dim] ? max : min)[dim] - ray.origin[dim]) * ray.invDir[dim];
+            float tFar = ((ray.dirIsNeg[dim] ? min : max)[dim] - ray.origin[dim]) * ray.invDir[dim];
+            tFar *= 1.f + 3.f * FLT_EPSILON;
+            tMin = tNear > tMin ? tNear : tMin;
+            tMax = tFar < tMax ? tFar : tMax;
+        }
+        return tMin <= tMax;
+    }
+
     /// @brief Check if a ray intersects the box
     bool testIntersect(const Ray &ray) const {
         // source: https://github.com/anrieff/quaddamage/blob/master/src/bbox.h
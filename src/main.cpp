@@ -1,15 +1,22 @@
 #define _CRT_SECURE_NO_WARNINGS
 
+#include <atomic>
 #include <cmath>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <random>
 #include <vector>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "Counters.hpp"
 #include "Image.hpp"
+#include "Light.hpp"
 #include "Material.hpp"
 #include "Mesh.hpp"
 #include "Primitive.hpp"
+#include "Sampler.hpp"
+#include "SphereSet.hpp"
 #include "Threading.hpp"
 #include "third_party/stb_image_write.h"
 
@@ -41,23 +48,218 @@ struct Camera {
     }
 };
 
-vec3 raytrace(const Ray &r, Instancer &prims, int depth = 0) {
-    Intersection data;
-    if (prims.intersect(r, 0.001f, FLT_MAX, data)) {
-        Ray scatter;
-        Color attenuation;
-        if (depth < MAX_RAY_DEPTH && data.material->shade(r, data, attenuation, scatter)) {
-            const Color incoming = raytrace(scatter, prims, depth + 1);
-            return attenuation * incoming;
-        } else {
-            return Color(0.f);
-        }
-    }
+vec3 skyColor(const Ray &r) {
     const vec3 dir = r.dir;
     const float f = 0.5f * (dir.y + 1.f);
     return (1.f - f) * vec3(1.f) + f * vec3(0.5f, 0.7f, 1.f);
 }
 
+/// Limits for the length of the traced paths, set per scene
+struct PathSettings {
+    int maxDepth = MAX_RAY_DEPTH;  ///< Paths are cut after this many bounces
+    int rouletteDepth = 3;  ///< Bounces before Russian roulette starts to terminate paths
+    /// Upper limit for the survival probability, so even paths with full throughput are terminated sometimes
+    float maxSurvival = 0.95f;
+};
+
+/// State of a path carried from one bounce to the next
+struct PathState {
+    Color throughput = Color(1.f);
+    Color radiance = Color(0.f);  ///< Light gathered by the path so far
+    float scatterPdf = 0.f;  ///< Density of the direction of the last ray, 0 for camera rays
+};
+
+/// @brief Power heuristic of multiple importance sampling, the weight of a sample taken with density @pdf when the
+///        other strategy takes the same sample with density @otherPdf
+inline float powerHeuristic(float pdf, float otherPdf) {
+    const float square = pdf * pdf;
+    return square / (square + otherPdf * otherPdf);
+}
+
+/// @brief Next event estimation, sample a light chosen by power and return the light it sends directly to the hit
+///        and on along the reverse of @ray. Weighted with the power heuristic against finding the same light by
+///        sampling the material, the other half of the estimate is added when a scattered ray hits the light.
+/// @param ray - the ray that hit the surface
+/// @param hit - the intersection of @ray
+/// @param prims - the scene, the visibility of the sampled point is checked with a shadow ray
+Color sampleDirectLight(const Ray &ray,
+                        const Intersection &hit,
+                        const MaterialTable &materials,
+                        const LightList &lights,
+                        Instancer &prims) {
+    if (lights.empty()) {
+        return Color(0.f);
+    }
+    Light *light = lights.select(randFloat());
+    LightSample sample;
+    if (!light->sample(hit.p, sample)) {
+        return Color(0.f);
+    }
+    const Color value = materials.eval(ray, hit, sample.dir);
+    if (std::max(value.x, std::max(value.y, value.z)) <= 0.f) {
+        return Color(0.f);
+    }
+    if (prims.occluded(Ray(hit.p, sample.dir), 0.001f, sample.distance * 0.999f)) {
+        return Color(0.f);
+    }
+    const float lightPdf = sample.pdf * light->selectPdf;
+    const float weight = sample.isDelta ? 1.f : powerHeuristic(lightPdf, materials.pdf(ray, hit, sample.dir));
+    return value * sample.radiance * (weight / lightPdf);
+}
+
+/// @brief Shade the hit of a path and decide if the path continues. Adds the emission of a hit light and the direct
+///        light sampled at the hit to the path's radiance, then samples the material for the next ray. After
+///        PathSettings::rouletteDepth bounces each path survives with probability equal to its throughput's largest
+///        component and the throughput of the survivors is scaled up to keep the estimate unbiased
+/// @param ray - the ray that hit the surface
+/// @param hit - the intersection of @ray
+/// @param depth - number of bounces of the path before this hit
+/// @param state [in/out] - the path, its throughput is multiplied by the weight of the sampled direction
+/// @param scatter [out] - the next ray of the path
+/// @return false if the path is absorbed or terminated at this hit
+bool continuePath(const Ray &ray,
+                  const Intersection &hit,
+                  int depth,
+                  const PathSettings &settings,
+                  const MaterialTable &materials,
+                  const LightList &lights,
+                  Instancer &prims,
+                  PathState &state,
+                  Ray &scatter) {
+    threadSampler().startBounce(depth + 1);
+    if (Light *light = materials.getLight(hit.material)) {
+        // camera rays see the light fully, scattered rays share it with the light sampled at the previous hit
+        const float lightPdf = light->selectPdf * light->pdf(ray, hit);
+        const float weight = state.scatterPdf > 0.f ? powerHeuristic(state.scatterPdf, lightPdf) : 1.f;
+        state.radiance += state.throughput * light->emitted(ray, hit) * weight;
+        // the surfaces of lights absorb everything
+        return false;
+    }
+    if (depth >= settings.maxDepth) {
+        return false;
+    }
+    // the material takes the first 2 numbers of the bounce so they form one stratified 2D point
+    MaterialSample sample;
+    const bool scattered = materials.sample(ray, hit, sample);
+    const float rouletteNumber = randFloat();
+    state.radiance += state.throughput * sampleDirectLight(ray, hit, materials, lights, prims);
+    if (!scattered) {
+        return false;
+    }
+    scatter = Ray(hit.p, sample.dir);
+    state.throughput = state.throughput * sample.weight;
+    state.scatterPdf = sample.pdf;
+    if (depth + 1 >= settings.rouletteDepth) {
+        const Color &throughput = state.throughput;
+        const float survival =
+            std::min(std::max(throughput.x, std::max(throughput.y, throughput.z)), settings.maxSurvival);
+        if (rouletteNumber >= survival) {
+            return false;
+        }
+        state.throughput /= survival;
+    }
+    return true;
+}
+
+/// @brief Follow the path starting with the ray @r and its first intersection @data until it escapes to the sky,
+///        is absorbed or is terminated, bounces are traced iteratively while keeping the path state
+vec3 raytraceHit(const Ray &r,
+                 const Intersection &data,
+                 Instancer &prims,
+                 const MaterialTable &materials,
+                 const LightList &lights,
+                 const PathSettings &settings) {
+    Ray ray = r;
+    Intersection hit = data;
+    PathState state;
+    for (int depth = 0;; depth++) {
+        Ray scatter;
+        if (!continuePath(ray, hit, depth, settings, materials, lights, prims, state, scatter)) {
+            return state.radiance;
+        }
+        ray = scatter;
+        if (!prims.intersect(ray, 0.001f, FLT_MAX, hit)) {
+            return state.radiance + state.throughput * skyColor(ray);
+        }
+    }
+}
+
+vec3 raytrace(const Ray &r,
+              Instancer &prims,
+              const MaterialTable &materials,
+              const LightList &lights,
+              const PathSettings &settings) {
+    Intersection data;
+    if (prims.intersect(r, 0.001f, FLT_MAX, data)) {
+        return raytraceHit(r, data, prims, materials, lights, settings);
+    }
+    return skyColor(r);
+}
+
+/// Sizes of the ray queues of the wavefront integrator, see Scene::renderWavefront
+struct WavefrontSettings {
+    int queueSize = 1 << 15;  ///< Paths in flight on each thread, the ray queue of a bounce holds at most that many
+    int batchSize = 1 << 12;  ///< Camera rays generated at once, a new batch starts whenever it fits in the queue
+    bool reorderRays = false;  ///< Sort the secondary rays of each bounce by direction and origin before tracing
+};
+
+/// Settings of adaptive sampling, enabled by a target noise level or a sample budget in place of a fixed spp
+struct AdaptiveSettings {
+    /// A pixel stops when the 95% confidence interval of its luminance, converted to the gamma corrected image, is
+    /// narrower than this on each side, 0.01 is about 2.5 levels of an 8 bit image
+    float targetNoise = 0.f;
+    float sampleBudget = 0.f;  ///< Average samples per pixel for the whole image, 0 for no limit
+    int minSamples = 8;  ///< Samples of every pixel in the first pass, enough for a first variance estimate
+    int passSamples = 4;  ///< Least samples added to a noisy pixel in each of the following passes
+    int maxSamples = 1024;  ///< No pixel gets more samples than this
+
+    bool isEnabled() const {
+        return targetNoise > 0 || sampleBudget > 0;
+    }
+};
+
+/// Running sums of the samples of a pixel, used to estimate its variance
+struct PixelStats {
+    Color sum = Color(0.f);
+    float luminanceSquares = 0.f;  ///< Sum of the squared luminance of the samples
+    int count = 0;
+
+    void add(const Color &sample) {
+        const float value = luminance(sample);
+        sum += sample;
+        luminanceSquares += value * value;
+        count++;
+    }
+
+    /// @brief Get the half width of the 95% confidence interval of the mean luminance after gamma correction
+    float noise() const {
+        if (count < 2) {
+            return FLT_MAX;
+        }
+        const float mean = luminance(sum) / count;
+        const float variance = std::max(luminanceSquares / count - mean * mean, 0.f) * count / (count - 1);
+        // the image stores the square root of the mean, its derivative scales the error
+        return 1.96f * sqrtf(variance / count) / (2.f * sqrtf(std::max(mean, 1e-4f)));
+    }
+};
+
+/// Work done by the secondary ray passes of the wavefront integrator on one thread
+struct BounceStats {
+    uint64_t rays = 0;
+    uint64_t nodes = 0;  ///< Nodes fetched while tracing the rays, only counted when built with RAY_STATS
+    uint64_t cacheMisses = 0;  ///< Only counted when CacheMissCounter is available
+    int64_t traceNs = 0;
+    int64_t reorderNs = 0;
+
+    void add(const BounceStats &other) {
+        rays += other.rays;
+        nodes += other.nodes;
+        cacheMisses += other.cacheMisses;
+        traceNs += other.traceNs;
+        reorderNs += other.reorderNs;
+    }
+};
+
 /// The whole scene description
 struct Scene : Task {
     Scene() = default;
@@ -67,14 +269,38 @@ struct Scene : Task {
     int width = 640;
     int height = 480;
     int samplesPerPixel = 2;
+    bool usePackets = true;  ///< Trace primary rays in packets, see renderTilePackets
+    bool useWavefront = false;  ///< Trace all paths of a thread together bounce by bounce, see renderWavefront
+    PathSettings path;
+    WavefrontSettings wavefront;
+    AdaptiveSettings adaptive;  ///< When enabled samplesPerPixel is ignored, see renderAdaptive
+    static const int PACKET_BLOCK = 4;
+    static constexpr int TILE_SIZE = 16;  ///< Threads render square tiles of pixels, the last row and column may be cut
     std::string name;
-    std::atomic<int> renderedPixels;
+    ThreadManager *loadThreads = nullptr;  ///< Threads to load the scene files with, set before creating the scene
+    std::atomic<int> renderedPixels{0};  ///< Updated once per tile
+
+    /// Tile of the image, identified by its top left pixel
+    struct Tile {
+        int col;
+        int row;
+        uint32_t order;  ///< Position of the tile on a Z-order curve over the image
+    };
+    std::vector<Tile> tiles;  ///< All tiles in the order they are split between threads
+    std::vector<BounceStats> bounceStats;  ///< Per thread stats of renderWavefront
+    BBox sceneBox;  ///< Bounds of all primitives, used to quantize ray origins when reordering rays
+    std::vector<PixelStats> pixelStats;  ///< Samples of each pixel, only used by renderAdaptive
+    std::vector<uint16_t> passSamples;  ///< Samples added to each pixel in the current adaptive pass
+    WorkStealingRanges scheduler;
     Instancer primitives;
+    MaterialTable materials;
+    LightList lights;
     Camera camera;
     ImageData image;
 
-    void onBeforeRender() {
-        primitives.onBeforeRender();
+    void onBeforeRender(ThreadManager &tm) {
+        primitives.onBeforeRender(&tm);
+        lights.build();
     }
 
     void initImage(int w, int h, int spp) {
@@ -89,31 +315,572 @@ struct Scene : Task {
         primitives.addInstance(std::move(primitive));
     }
 
+    /// @brief Add a light, area lights are primitives as well and are also added to the primitives
+    template <typename LightType>
+    void addLight(std::shared_ptr<LightType> light) {
+        if constexpr (std::is_base_of_v<Primitive, LightType>) {
+            light->material = materials.add(LightSurface{light.get()});
+            primitives.addInstance(light);
+        }
+        lights.add(std::move(light));
+    }
+
     void render(ThreadManager &tm) {
-        runOn(tm);
+        if (adaptive.isEnabled()) {
+            renderAdaptive(tm);
+        } else {
+            runOn(tm);
+        }
+    }
+
+    /// @brief Render in passes, the first pass samples all pixels and each next one adds samples only to the pixels
+    ///        that are still noisier than AdaptiveSettings::targetNoise. The noise falls with the square root of the
+    ///        sample count, so each pixel gets the samples it is expected to need, at most doubling its count. When the
+    ///        sample budget can not cover all of them, the noisiest pixels get the samples. Renders end when all
+    ///        pixels converge or the budget runs out.
+    void renderAdaptive(ThreadManager &tm) {
+        struct NoisyPixel {
+            float noise;
+            int index;
+            int samples;  ///< Samples to add in the next pass
+        };
+        const int pixelCount = width * height;
+        const int64_t budget = adaptive.sampleBudget > 0 ? int64_t(adaptive.sampleBudget * pixelCount) : INT64_MAX;
+        const int maxSamples = std::clamp(adaptive.maxSamples, 1, int(UINT16_MAX));
+        const int minPassSamples = std::max(adaptive.passSamples, 1);
+        const int firstSamples = int(std::clamp<int64_t>(budget / pixelCount, 1, std::max(adaptive.minSamples, 1)));
+        pixelStats.assign(pixelCount, PixelStats());
+        passSamples.assign(pixelCount, uint16_t(std::min(firstSamples, maxSamples)));
+
+        int64_t samples = 0;
+        int passes = 0;
+        int converged = 0;
+        std::vector<NoisyPixel> noisy;
+        while (true) {
+            runOn(tm);
+            passes++;
+
+            noisy.clear();
+            converged = 0;
+            int64_t wanted = 0;
+            for (int c = 0; c < pixelCount; c++) {
+                samples += passSamples[c];
+                passSamples[c] = 0;
+                const PixelStats &stats = pixelStats[c];
+                const float noise = stats.noise();
+                if (noise <= adaptive.targetNoise) {
+                    converged++;
+                } else if (stats.count < maxSamples) {
+                    // without a target the budget decides, the noisiest pixels double their samples
+                    const float ratio = noise / std::max(adaptive.targetNoise, 1e-6f);
+                    const float growth = adaptive.targetNoise > 0 ? std::min(ratio * ratio - 1.f, 1.f) : 1.f;
+                    const int add = std::max(int(stats.count * growth), minPassSamples);
+                    noisy.push_back({noise, c, std::min(add, maxSamples - stats.count)});
+                    wanted += noisy.back().samples;
+                }
+            }
+            int64_t remaining = budget - samples;
+            if (noisy.empty() || remaining <= 0) {
+                break;
+            }
+            if (wanted > remaining) {
+                std::sort(noisy.begin(), noisy.end(), [](const NoisyPixel &a, const NoisyPixel &b) {
+                    return a.noise > b.noise;
+                });
+            }
+            int noisyCount = 0;
+            for (const NoisyPixel &pixel : noisy) {
+                if (remaining <= 0) {
+                    break;
+                }
+                passSamples[pixel.index] = uint16_t(std::min<int64_t>(pixel.samples, remaining));
+                remaining -= passSamples[pixel.index];
+                noisyCount++;
+            }
+            printf("\rPass %d: %d noisy pixels ", passes, noisyCount);
+        }
+
+        for (int r = 0; r < height; r++) {
+            for (int c = 0; c < width; c++) {
+                const PixelStats &stats = pixelStats[r * width + c];
+                setPixel(r, c, stats.sum / stats.count);
+            }
+        }
+        printf("\nAdaptive sampling: %d passes, %lld samples, %.2f per pixel, %.1f%% of the pixels converged\n",
+               passes,
+               (long long)samples,
+               double(samples) / pixelCount,
+               100.0 * converged / pixelCount);
+    }
+
+    /// @brief Trace the same rays with closest hit intersect and with any hit occluded on this thread and print
+    ///        the best time of each. The rays are the camera rays through the pixel centers and rays from their hit
+    ///        points in random directions around the normal, like ambient occlusion rays.
+    void benchmarkOcclusion() {
+        std::vector<Ray> rays;
+        for (int r = 0; r < height; r++) {
+            for (int c = 0; c < width; c++) {
+                const Ray ray = camera.getRay((c + 0.5f) / width, (r + 0.5f) / height);
+                rays.push_back(ray);
+                Intersection data;
+                if (primitives.intersect(ray, 0.001f, FLT_MAX, data)) {
+                    const vec3 dir = data.normal + randomUnitSphere().normalized();
+                    if (dir.lengthSquare() > 1e-6f) {
+                        rays.push_back(Ray(data.p, dir.normalized()));
+                    }
+                }
+            }
+        }
+
+        // the best of a few alternating runs, so both queries see the same cache and machine load
+        const int runs = 3;
+        int closestHits = 0, anyHits = 0;
+        float closestMs = FLT_MAX, anyMs = FLT_MAX;
+        for (int run = 0; run < runs; run++) {
+            closestHits = 0;
+            Timer closestTimer;
+            for (const Ray &ray : rays) {
+                Intersection data;
+                closestHits += primitives.intersect(ray, 0.001f, FLT_MAX, data);
+            }
+            closestMs = std::min(closestMs, Timer::toMs<float>(closestTimer.elapsedNs()));
+
+            anyHits = 0;
+            Timer anyTimer;
+            for (const Ray &ray : rays) {
+                anyHits += primitives.occluded(ray, 0.001f, FLT_MAX);
+            }
+            anyMs = std::min(anyMs, Timer::toMs<float>(anyTimer.elapsedNs()));
+        }
+
+        printf("Occlusion benchmark with %d rays: closest hit %gms, %d hits; any hit %gms, %d hits; %.2fx faster\n",
+               int(rays.size()),
+               closestMs,
+               closestHits,
+               anyMs,
+               anyHits,
+               closestMs / std::max(anyMs, 1e-3f));
+        if (closestHits != anyHits) {
+            printf("Occlusion benchmark hit counts differ\n");
+        }
+    }
+
+    /// @brief Order the tiles along a Z-order curve and split them between the threads
+    void onBeforeRun(int threadCount) override {
+        const int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        const int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+        tiles.clear();
+        for (int r = 0; r < tilesY; r++) {
+            for (int c = 0; c < tilesX; c++) {
+                tiles.push_back({c * TILE_SIZE, r * TILE_SIZE, mortonCode2D(c, r)});
+            }
+        }
+        std::sort(tiles.begin(), tiles.end(), [](const Tile &a, const Tile &b) {
+            return a.order < b.order;
+        });
+        scheduler.init(int(tiles.size()), threadCount);
+        renderedPixels = 0;
+        if (useWavefront) {
+            bounceStats.assign(threadCount, BounceStats());
+            sceneBox = BBox();
+            primitives.expandBox(sceneBox);
+        }
     }
 
     void run(int threadIndex, int threadCount) override {
+        if (adaptive.isEnabled()) {
+            int tileIndex;
+            while (scheduler.next(threadIndex, tileIndex)) {
+                renderTileAdaptive(tiles[tileIndex]);
+            }
+            return;
+        }
+        if (useWavefront) {
+            renderWavefront(threadIndex);
+            return;
+        }
+        int tileIndex;
+        while (scheduler.next(threadIndex, tileIndex)) {
+            const Tile &tile = tiles[tileIndex];
+            const int tileWidth = std::min(TILE_SIZE, width - tile.col);
+            const int tileHeight = std::min(TILE_SIZE, height - tile.row);
+            if (usePackets) {
+                renderTilePackets(tile, tileWidth, tileHeight);
+            } else {
+                renderTileRays(tile, tileWidth, tileHeight);
+            }
+            addRenderedPixels(tileWidth * tileHeight);
+        }
+    }
+
+    /// @brief Print the total work of the secondary ray passes of the last wavefront render
+    void printBounceStats() const {
+        BounceStats total;
+        for (const BounceStats &stats : bounceStats) {
+            total.add(stats);
+        }
+        if (!total.rays) {
+            return;
+        }
+        printf("Secondary rays: %llu, traced in %gms",
+               (unsigned long long)total.rays,
+               Timer::toMs<float>(total.traceNs));
+        if (wavefront.reorderRays) {
+            printf(", reordered in %gms", Timer::toMs<float>(total.reorderNs));
+        }
+#ifdef RAY_STATS
+        printf(", %.1f nodes per ray", double(total.nodes) / total.rays);
+#endif
+        if (total.cacheMisses) {
+            printf(", %.2f cache misses per ray", double(total.cacheMisses) / total.rays);
+        }
+        printf("\n");
+    }
+
+    /// @brief Add @count to the rendered pixels and print the progress each time another percent is completed
+    void addRenderedPixels(int count) {
         const int total = width * height;
-        const int incrementPrint = total / 100;
-        for (int idx = threadIndex; idx < total; idx += threadCount) {
-            const int r = idx / width;
-            const int c = idx % width;
-
-            Color avg(0);
-            for (int s = 0; s < samplesPerPixel; s++) {
-                const float u = float(c + randFloat()) / float(width);
-                const float v = float(r + randFloat()) / float(height);
-                const Ray &ray = camera.getRay(u, v);
-                const vec3 sample = raytrace(ray, primitives);
-                avg += sample;
+        const int incrementPrint = std::max(total / 100, 1);
+        const int completed = renderedPixels.fetch_add(count, std::memory_order_relaxed);
+        if (completed / incrementPrint != (completed + count) / incrementPrint) {
+            printf("\r%d%% ", int(float(completed + count) / float(total) * 100));
+        }
+    }
+
+    void setPixel(int r, int c, const Color &avg) {
+        image(c, height - r - 1) = Color(sqrtf(avg.x), sqrtf(avg.y), sqrtf(avg.z));
+    }
+
+    /// Path in the ray queues of renderWavefront
+    struct WavefrontPath {
+        Ray ray;  ///< The next ray of the path
+        PathState state;
+        int pixel;  ///< Index of the pixel in the image
+        int tile;  ///< Index of the path's tile in the list of tiles started by the thread
+        int sample;  ///< Index of the sample in its tile, the samples of each pixel are after each other
+        int depth;  ///< Bounces so far
+    };
+
+    /// @brief Sort the paths by the octant of their ray direction and then by their ray origin along a Z-order curve
+    ///        in the scene box, so rays traced after each other start close and visit mostly the same nodes
+    /// @param sorted - scratch space for the sorted paths, swapped with @paths
+    void reorderPaths(std::vector<WavefrontPath> &paths,
+                      std::vector<WavefrontPath> &sorted,
+                      std::vector<uint64_t> &keys) {
+        // 9 bits per axis, so the 27 bit Morton code and the 3 bit octant fit in the upper half of the key
+        const int cells = 1 << 9;
+        const vec3 size = sceneBox.max - sceneBox.min;
+        const float scale[3] = {cells / std::max(size.x, 1e-6f), cells / std::max(size.y, 1e-6f),
+                                cells / std::max(size.z, 1e-6f)};
+        const auto quantize = [&](const Ray &ray, int axis) {
+            const int cell = int((ray.origin[axis] - sceneBox.min[axis]) * scale[axis]);
+            return uint32_t(std::clamp(cell, 0, cells - 1));
+        };
+        keys.resize(paths.size());
+        for (int c = 0; c < int(paths.size()); c++) {
+            const Ray &ray = paths[c].ray;
+            const uint32_t octant = (ray.dir.x < 0) | (ray.dir.y < 0) << 1 | (ray.dir.z < 0) << 2;
+            const uint32_t key = octant << 27 | mortonCode3D(quantize(ray, 0), quantize(ray, 1), quantize(ray, 2));
+            keys[c] = uint64_t(key) << 32 | uint32_t(c);
+        }
+        std::sort(keys.begin(), keys.end());
+        sorted.clear();
+        for (const uint64_t key : keys) {
+            sorted.push_back(paths[uint32_t(key)]);
+        }
+        std::swap(paths, sorted);
+    }
+
+    /// @brief Render the tiles of this thread as a stream of paths, each bounce is one pass over the ray queue.
+    ///        All rays of the queue are intersected, the hits are binned by material and each bin is shaded at once,
+    ///        so the same material code and data are used for long runs, then the surviving paths are compacted in
+    ///        the queue of the next bounce. Camera rays are added in batches whenever a whole batch fits in the queue,
+    ///        they are traced in packets as in renderTilePackets and join the queue with their hits.
+    ///        With WavefrontSettings::reorderRays the queue is sorted with reorderPaths before each bounce.
+    ///        Paths finish out of order, so each tile keeps its samples and sums them in order once all are done.
+    void renderWavefront(int threadIndex) {
+        static_assert(PACKET_BLOCK * PACKET_BLOCK == RayPacket::SIZE, "one ray per pixel of the block");
+        struct StartedTile {
+            int index;  ///< Index in tiles
+            int remaining;  ///< Samples of the tile that are not finished yet
+            std::vector<Color> samples;  ///< Color of each finished sample
+        };
+        const int queueSize = std::max(wavefront.queueSize, int(RayPacket::SIZE));
+        const int batchSize = std::clamp(wavefront.batchSize, int(RayPacket::SIZE), queueSize);
+        std::vector<StartedTile> started;
+        std::vector<WavefrontPath> queue, nextQueue;
+        std::vector<Intersection> hits(queueSize);
+        std::vector<int> hitBins(queueSize);
+        std::vector<int> shadeOrder(queueSize);  // indices of the hits sorted by bin
+        std::vector<MaterialId> binMaterials;
+        std::vector<int> binOffsets;
+        std::vector<uint64_t> sortKeys;
+        BounceStats &stats = bounceStats[threadIndex];
+        const CacheMissCounter cacheMisses;
+        queue.reserve(queueSize);
+        nextQueue.reserve(queueSize);
+
+        auto finishPath = [&](const WavefrontPath &p, const Color &color) {
+            StartedTile &startedTile = started[p.tile];
+            startedTile.samples[p.sample] = color;
+            if (--startedTile.remaining == 0) {
+                const Tile &tile = tiles[startedTile.index];
+                const int tileWidth = std::min(TILE_SIZE, width - tile.col);
+                const int tileHeight = std::min(TILE_SIZE, height - tile.row);
+                const Color *sample = startedTile.samples.data();
+                for (int r = tile.row; r < tile.row + tileHeight; r++) {
+                    for (int c = tile.col; c < tile.col + tileWidth; c++) {
+                        Color avg(0);
+                        for (int s = 0; s < samplesPerPixel; s++) {
+                            avg += *sample++;
+                        }
+                        setPixel(r, c, avg / samplesPerPixel);
+                    }
+                }
+                std::vector<Color>().swap(startedTile.samples);
+                addRenderedPixels(tileWidth * tileHeight);
+            }
+        };
+
+        // the last started tile is generated block by block, one packet for each sample of a block
+        int block = 0, blockCount = 0, blockSample = 0;
+        bool tilesLeft = true;
+        RayPacket packet;
+        Intersection packetHits[RayPacket::SIZE];
+        auto addCameraRays = [&](int count) {
+            for (int generated = 0; generated + RayPacket::SIZE <= count;) {
+                if (block == blockCount) {
+                    int tileIndex;
+                    if (!scheduler.next(threadIndex, tileIndex)) {
+                        tilesLeft = false;
+                        return;
+                    }
+                    const Tile &tile = tiles[tileIndex];
+                    const int tileWidth = std::min(TILE_SIZE, width - tile.col);
+                    const int tileHeight = std::min(TILE_SIZE, height - tile.row);
+                    block = 0;
+                    blockCount = ((tileWidth + PACKET_BLOCK - 1) / PACKET_BLOCK) *
+                                 ((tileHeight + PACKET_BLOCK - 1) / PACKET_BLOCK);
+                    const int sampleCount = tileWidth * tileHeight * samplesPerPixel;
+                    started.push_back({tileIndex, sampleCount, std::vector<Color>(sampleCount)});
+                }
+                const Tile &tile = tiles[started.back().index];
+                const int tileWidth = std::min(TILE_SIZE, width - tile.col);
+                const int blocksX = (tileWidth + PACKET_BLOCK - 1) / PACKET_BLOCK;
+                const int blockRow = tile.row + block / blocksX * PACKET_BLOCK;
+                const int blockCol = tile.col + block % blocksX * PACKET_BLOCK;
+                uint32_t active = 0;
+                for (int lane = 0; lane < RayPacket::SIZE; lane++) {
+                    const int r = blockRow + lane / PACKET_BLOCK;
+                    const int c = blockCol + lane % PACKET_BLOCK;
+                    if (r < height && c < width) {
+                        active |= 1u << lane;
+                        threadSampler().startSample(c, r, blockSample);
+                        const float u = float(c + randFloat()) / float(width);
+                        const float v = float(r + randFloat()) / float(height);
+                        packet.setRay(lane, camera.getRay(u, v));
+                    }
+                }
+
+                uint32_t hitMask = 0;
+                if (usePackets) {
+                    packet.finalize(active);
+                    hitMask = primitives.intersectPacket(packet, active, 0.001f, packetHits);
+                } else {
+                    for (uint32_t mask = active; mask; mask &= mask - 1) {
+                        const int lane = lowestBit(mask);
+                        if (primitives.intersect(packet.getRay(lane), 0.001f, FLT_MAX, packetHits[lane])) {
+                            hitMask |= 1u << lane;
+                        }
+                    }
+                }
+                for (uint32_t mask = active; mask; mask &= mask - 1) {
+                    const int lane = lowestBit(mask);
+                    const int r = blockRow + lane / PACKET_BLOCK;
+                    const int c = blockCol + lane % PACKET_BLOCK;
+                    const int tileSample = ((r - tile.row) * tileWidth + c - tile.col) * samplesPerPixel + blockSample;
+                    const WavefrontPath p = {
+                        packet.getRay(lane), PathState(), r * width + c, int(started.size()) - 1, tileSample, 0};
+                    if (hitMask & (1u << lane)) {
+                        hits[queue.size()] = packetHits[lane];
+                        queue.push_back(p);
+                    } else {
+                        finishPath(p, skyColor(p.ray));
+                    }
+                    generated++;
+                }
+                if (++blockSample == samplesPerPixel) {
+                    blockSample = 0;
+                    block++;
+                }
+            }
+        };
+
+        while (true) {
+            // intersect the whole queue, paths that escape to the sky finish here and the rest move to the front
+            const uint64_t nodesBefore = threadTraversalStats().nodes;
+            const uint64_t missesBefore = cacheMisses.read();
+            Timer traceTimer;
+            int hitCount = 0;
+            for (int c = 0; c < int(queue.size()); c++) {
+                const WavefrontPath p = queue[c];
+                if (primitives.intersect(p.ray, 0.001f, FLT_MAX, hits[hitCount])) {
+                    queue[hitCount++] = p;
+                } else {
+                    finishPath(p, p.state.radiance + p.state.throughput * skyColor(p.ray));
+                }
+            }
+            stats.traceNs += traceTimer.elapsedNs();
+            stats.cacheMisses += cacheMisses.read() - missesBefore;
+            stats.nodes += threadTraversalStats().nodes - nodesBefore;
+            stats.rays += queue.size();
+            queue.resize(hitCount);
+
+            while (tilesLeft && int(queue.size()) + batchSize <= queueSize) {
+                addCameraRays(batchSize);
+            }
+            if (queue.empty()) {
+                break;
+            }
+            hitCount = int(queue.size());
+
+            // counting sort of the hits by material, scenes have few materials so they are found by linear search
+            // the bins are in the order of the material ids, which keeps the materials of each type together
+            binMaterials.clear();
+            for (int c = 0; c < hitCount; c++) {
+                const MaterialId material = hits[c].material;
+                if (std::find(binMaterials.begin(), binMaterials.end(), material) == binMaterials.end()) {
+                    binMaterials.push_back(material);
+                }
+            }
+            std::sort(binMaterials.begin(), binMaterials.end());
+            for (int c = 0; c < hitCount; c++) {
+                const auto bin = std::lower_bound(binMaterials.begin(), binMaterials.end(), hits[c].material);
+                hitBins[c] = int(bin - binMaterials.begin());
+            }
+            binOffsets.assign(binMaterials.size() + 1, 0);
+            for (int c = 0; c < hitCount; c++) {
+                binOffsets[hitBins[c] + 1]++;
+            }
+            for (int c = 1; c < int(binOffsets.size()); c++) {
+                binOffsets[c] += binOffsets[c - 1];
+            }
+            for (int c = 0; c < hitCount; c++) {
+                shadeOrder[binOffsets[hitBins[c]]++] = c;
             }
 
-            avg /= samplesPerPixel;
-            image(c, height - r - 1) = Color(sqrtf(avg.x), sqrtf(avg.y), sqrtf(avg.z));
-            const int completed = renderedPixels.fetch_add(1, std::memory_order_relaxed);
-            if (completed % incrementPrint == 0) {
-                printf("\r%d%% ", int(float(completed) / float(total) * 100));
+            // shade bin after bin and compact the surviving paths in the queue of the next bounce
+            nextQueue.clear();
+            for (int c = 0; c < hitCount; c++) {
+                const int index = shadeOrder[c];
+                WavefrontPath &p = queue[index];
+                Ray scatter;
+                threadSampler().startSample(p.pixel % width, p.pixel / width, p.sample % samplesPerPixel);
+                if (continuePath(p.ray, hits[index], p.depth, path, materials, lights, primitives, p.state, scatter)) {
+                    nextQueue.push_back({scatter, p.state, p.pixel, p.tile, p.sample, p.depth + 1});
+                } else {
+                    finishPath(p, p.state.radiance);
+                }
+            }
+            std::swap(queue, nextQueue);
+
+            if (wavefront.reorderRays) {
+                Timer reorderTimer;
+                reorderPaths(queue, nextQueue, sortKeys);
+                stats.reorderNs += reorderTimer.elapsedNs();
+            }
+        }
+    }
+
+    void renderTileRays(const Tile &tile, int tileWidth, int tileHeight) {
+        for (int r = tile.row; r < tile.row + tileHeight; r++) {
+            for (int c = tile.col; c < tile.col + tileWidth; c++) {
+                Color avg(0);
+                for (int s = 0; s < samplesPerPixel; s++) {
+                    threadSampler().startSample(c, r, s);
+                    const float u = float(c + randFloat()) / float(width);
+                    const float v = float(r + randFloat()) / float(height);
+                    const Ray &ray = camera.getRay(u, v);
+                    const vec3 sample = raytrace(ray, primitives, materials, lights, path);
+                    avg += sample;
+                }
+                setPixel(r, c, avg / samplesPerPixel);
+            }
+        }
+    }
+
+    /// @brief Add the samples of the current adaptive pass to the pixels of the tile
+    void renderTileAdaptive(const Tile &tile) {
+        const int tileWidth = std::min(TILE_SIZE, width - tile.col);
+        const int tileHeight = std::min(TILE_SIZE, height - tile.row);
+        for (int r = tile.row; r < tile.row + tileHeight; r++) {
+            for (int c = tile.col; c < tile.col + tileWidth; c++) {
+                const int samples = passSamples[r * width + c];
+                PixelStats &stats = pixelStats[r * width + c];
+                for (int s = 0; s < samples; s++) {
+                    threadSampler().startSample(c, r, stats.count);
+                    const float u = float(c + randFloat()) / float(width);
+                    const float v = float(r + randFloat()) / float(height);
+                    stats.add(raytrace(camera.getRay(u, v), primitives, materials, lights, path));
+                }
+            }
+        }
+        addRenderedPixels(tileWidth * tileHeight);
+    }
+
+    /// @brief Render the tile in blocks of PACKET_BLOCK x PACKET_BLOCK pixels, the primary rays of each sample of a
+    ///        block are traced together as one packet and only the secondary rays are traced one by one
+    void renderTilePackets(const Tile &tile, int tileWidth, int tileHeight) {
+        static_assert(PACKET_BLOCK * PACKET_BLOCK == RayPacket::SIZE, "one ray per pixel of the block");
+        static_assert(TILE_SIZE % PACKET_BLOCK == 0, "tiles are split in whole blocks");
+        RayPacket packet;
+        Intersection hits[RayPacket::SIZE];
+        for (int blockRow = tile.row; blockRow < tile.row + tileHeight; blockRow += PACKET_BLOCK) {
+            for (int blockCol = tile.col; blockCol < tile.col + tileWidth; blockCol += PACKET_BLOCK) {
+                uint32_t active = 0;
+                for (int lane = 0; lane < RayPacket::SIZE; lane++) {
+                    const int r = blockRow + lane / PACKET_BLOCK;
+                    const int c = blockCol + lane % PACKET_BLOCK;
+                    if (r < height && c < width) {
+                        active |= 1u << lane;
+                    }
+                }
+
+                Color avg[RayPacket::SIZE];
+                std::fill(avg, avg + RayPacket::SIZE, Color(0));
+                for (int s = 0; s < samplesPerPixel; s++) {
+                    for (uint32_t mask = active; mask; mask &= mask - 1) {
+                        const int lane = lowestBit(mask);
+                        const int r = blockRow + lane / PACKET_BLOCK;
+                        const int c = blockCol + lane % PACKET_BLOCK;
+                        threadSampler().startSample(c, r, s);
+                        const float u = float(c + randFloat()) / float(width);
+                        const float v = float(r + randFloat()) / float(height);
+                        packet.setRay(lane, camera.getRay(u, v));
+                    }
+                    packet.finalize(active);
+
+                    const uint32_t hitMask = primitives.intersectPacket(packet, active, 0.001f, hits);
+                    for (uint32_t mask = active; mask; mask &= mask - 1) {
+                        const int lane = lowestBit(mask);
+                        const Ray ray = packet.getRay(lane);
+                        if (hitMask & (1u << lane)) {
+                            const int r = blockRow + lane / PACKET_BLOCK;
+                            const int c = blockCol + lane % PACKET_BLOCK;
+                            threadSampler().startSample(c, r, s);
+                            avg[lane] += raytraceHit(ray, hits[lane], primitives, materials, lights, path);
+                        } else {
+                            avg[lane] += skyColor(ray);
+                        }
+                    }
+                }
+
+                for (uint32_t mask = active; mask; mask &= mask - 1) {
+                    const int lane = lowestBit(mask);
+                    const int r = blockRow + lane / PACKET_BLOCK;
+                    const int c = blockCol + lane % PACKET_BLOCK;
+                    setPixel(r, c, avg[lane] / samplesPerPixel);
+                }
             }
         }
     }
@@ -124,7 +891,8 @@ void sceneExample(Scene &scene) {
     scene.initImage(800, 600, 4);
     scene.camera.lookAt(90.f, {-0.1f, 5, -0.1f}, {0, 0, 0});
 
-    SharedPrimPtr mesh(new TriangleMesh(MESH_FOLDER "/cube.obj", MaterialPtr(new Lambert{Color(1, 0, 0)})));
+    SharedPrimPtr mesh(
+        new TriangleMesh(MESH_FOLDER "/cube.obj", scene.materials.add(Lambert{Color(1, 0, 0)}), scene.loadThreads));
     Instancer *instancer = new Instancer;
     instancer->addInstance(mesh, vec3(2, 0, 0));
     instancer->addInstance(mesh, vec3(0, 0, 2));
@@ -132,9 +900,10 @@ void sceneExample(Scene &scene) {
     scene.addPrimitive(PrimPtr(instancer));
 
     const float r = 0.6f;
-    scene.addPrimitive(PrimPtr(new SpherePrim{vec3(2, 0, 0), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)})}));
-    scene.addPrimitive(PrimPtr(new SpherePrim{vec3(0, 0, 2), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)})}));
-    scene.addPrimitive(PrimPtr(new SpherePrim{vec3(0, 0, 0), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)})}));
+    const MaterialId sphereMaterial = scene.materials.add(Lambert{Color(0.8, 0.3, 0.3)});
+    scene.addPrimitive(PrimPtr(new SpherePrim{vec3(2, 0, 0), r, sphereMaterial}));
+    scene.addPrimitive(PrimPtr(new SpherePrim{vec3(0, 0, 2), r, sphereMaterial}));
+    scene.addPrimitive(PrimPtr(new SpherePrim{vec3(0, 0, 0), r, sphereMaterial}));
 }
 
 void sceneManyHeavyMeshes(Scene &scene) {
@@ -143,23 +912,27 @@ void sceneManyHeavyMeshes(Scene &scene) {
 
     scene.initImage(1280, 720, 10);
     scene.camera.lookAt(90.f, {0, 3, -count}, {0, 3, count});
+    // rays bounce many times between the two floors of dragons, most of them carry little light after a few
+    scene.path.maxDepth = 16;
+    scene.path.rouletteDepth = 2;
 
-    SharedMaterialPtr instanceMaterials[] = {
-        SharedMaterialPtr(new Lambert{Color(0.2, 0.7, 0.1)}),
-        SharedMaterialPtr(new Lambert{Color(0.7, 0.2, 0.1)}),
-        SharedMaterialPtr(new Lambert{Color(0.1, 0.2, 0.7)}),
-        SharedMaterialPtr(new Metal{Color(0.8, 0.1, 0.1), 0.3f}),
-        SharedMaterialPtr(new Metal{Color(0.1, 0.7, 0.1), 0.6f}),
-        SharedMaterialPtr(new Metal{Color(0.1, 0.1, 0.7), 0.9f}),
+    const MaterialId instanceMaterials[] = {
+        scene.materials.add(Lambert{Color(0.2, 0.7, 0.1)}),
+        scene.materials.add(Lambert{Color(0.7, 0.2, 0.1)}),
+        scene.materials.add(Lambert{Color(0.1, 0.2, 0.7)}),
+        scene.materials.add(Metal{Color(0.8, 0.1, 0.1), 0.3f}),
+        scene.materials.add(Metal{Color(0.1, 0.7, 0.1), 0.6f}),
+        scene.materials.add(Metal{Color(0.1, 0.1, 0.7), 0.9f}),
     };
     const int materialCount = std::size(instanceMaterials);
 
-    auto getRandomMaterial = [instanceMaterials, materialCount]() -> SharedMaterialPtr {
+    auto getRandomMaterial = [instanceMaterials, materialCount]() -> MaterialId {
         const int rng = int(randFloat() * materialCount);
         return instanceMaterials[rng];
     };
 
-    SharedPrimPtr mesh(new TriangleMesh(MESH_FOLDER "/dragon.obj", MaterialPtr(new Lambert{Color(1, 0, 0)})));
+    SharedPrimPtr mesh(
+        new TriangleMesh(MESH_FOLDER "/dragon.obj", scene.materials.add(Lambert{Color(1, 0, 0)}), scene.loadThreads));
     Instancer *instancer = new Instancer;
 
     instancer->addInstance(mesh, vec3(0, 2.5, -count + 1), 0.08f, getRandomMaterial());
@@ -172,6 +945,12 @@ void sceneManyHeavyMeshes(Scene &scene) {
     }
 
     scene.addPrimitive(PrimPtr(instancer));
+
+    // a row of lights under the upper floor facing down and a warm light next to the camera
+    for (int z = -count + 10; z < count; z += 20) {
+        scene.addLight(std::make_shared<QuadLight>(vec3(-1, 5.5f, z - 2), vec3(2, 0, 0), vec3(0, 0, 4), Color(8.f)));
+    }
+    scene.addLight(std::make_shared<PointLight>(vec3(1.5f, 4.5f, -count), Color(3.f, 2.5f, 2.f)));
 }
 
 void sceneManySimpleMeshes(Scene &scene) {
@@ -181,7 +960,8 @@ void sceneManySimpleMeshes(Scene &scene) {
     scene.initImage(800, 600, 2);
     scene.camera.lookAt(90.f, {0, 2, count}, {0, 0, 0});
 
-    SharedPrimPtr mesh(new TriangleMesh(MESH_FOLDER "/cube.obj", MaterialPtr(new Lambert{Color(1, 0, 0)})));
+    SharedPrimPtr mesh(
+        new TriangleMesh(MESH_FOLDER "/cube.obj", scene.materials.add(Lambert{Color(1, 0, 0)}), scene.loadThreads));
     Instancer *instancer = new Instancer;
 
     for (int c = -count; c <= count; c++) {
@@ -193,36 +973,151 @@ void sceneManySimpleMeshes(Scene &scene) {
     scene.addPrimitive(PrimPtr(instancer));
 }
 
+void sceneManySpheres(Scene &scene) {
+    scene.name = "spheres";
+    const uint32_t count = 1000000;
+    const float discRadius = 10.f;
+
+    scene.initImage(800, 600, 4);
+    scene.camera.lookAt(90.f, {0, 6, -12}, {0, 0, 0});
+
+    const MaterialId sphereMaterials[] = {
+        scene.materials.add(Lambert{Color(0.8, 0.3, 0.3)}),
+        scene.materials.add(Lambert{Color(0.2, 0.7, 0.1)}),
+        scene.materials.add(Lambert{Color(0.9, 0.8, 0.5)}),
+        scene.materials.add(Metal{Color(0.8, 0.8, 0.8), 0.2f}),
+    };
+    const uint32_t materialCount = uint32_t(std::size(sphereMaterials));
+
+    // a disc of small spheres, denser and thicker in the middle, hashed from the index so every run is the same
+    SphereSet *spheres = new SphereSet;
+    spheres->reserve(count);
+    for (uint32_t c = 0; c < count; c++) {
+        uint32_t key[4] = {c, 0, 0, 0};
+        pcg4d(key);
+        float random[4];
+        for (int r = 0; r < 4; r++) {
+            random[r] = float(key[r] >> 8) * (1.f / 16777216.f);
+        }
+        const float distance = discRadius * random[0] * random[0];
+        const float angle = 2.f * PI * random[1];
+        const float height = (random[2] - 0.5f) * (1.f - distance / discRadius);
+        const vec3 center(distance * cosf(angle), height, distance * sinf(angle));
+        spheres->add(center, 0.01f + 0.03f * random[3], sphereMaterials[(key[3] & 0xff) % materialCount]);
+    }
+    scene.addPrimitive(PrimPtr(spheres));
+}
+
 void sceneHeavyMesh(Scene &scene) {
     scene.name = "dragon";
     scene.initImage(800, 600, 4);
     scene.camera.lookAt(90.f, {8, 10, 7}, {0, 0, 0});
-    scene.addPrimitive(
-        PrimPtr(new TriangleMesh(MESH_FOLDER "/dragon.obj", MaterialPtr(new Lambert{Color(0.2, 0.7, 0.1)}))));
+    scene.addPrimitive(PrimPtr(new TriangleMesh(
+        MESH_FOLDER "/dragon.obj", scene.materials.add(Lambert{Color(0.2, 0.7, 0.1)}), scene.loadThreads)));
 }
 
 int main(int argc, char *argv[]) {
-    void (*sceneCreators[])(Scene &) = {sceneExample, sceneHeavyMesh, sceneManySimpleMeshes, sceneManyHeavyMeshes};
+    void (*sceneCreators[])(Scene &) = {
+        sceneExample, sceneHeavyMesh, sceneManySimpleMeshes, sceneManyHeavyMeshes, sceneManySpheres};
 
-    puts("> There are 4 scenes (0,1,2,3) to render");
+    puts("> There are 5 scenes (0,1,2,3,4) to render");
     puts("> Pass no arguments to render the example scene (index 0)");
     puts("> Pass one argument, index of the scene to render or -1 to render all");
+    puts("> Pass --accel=oct|kd|bvh|bvh4|bvh8|wide to select the acceleration structure");
+    puts(">   wide is the default and picks the widest BVH supported by the CPU, bvh8 needs AVX2 and FMA");
+    puts("> Pass --no-packets to trace all primary rays one by one instead of in packets");
+    puts("> Pass --wavefront to trace the paths of each thread together, one bounce at a time");
+    puts(">   --wavefront-queue=N and --wavefront-batch=N set the paths in flight and the camera rays per batch");
+    puts(">   --reorder-rays sorts the rays of each bounce by direction and origin before tracing them");
+    puts("> Pass --sampler=random|sobol|bluenoise to select the random numbers for pixel and bounce sampling");
+    puts(">   sobol is the default, bluenoise spreads the error of neighbour pixels as high frequency noise");
+    puts("> Pass --noise=X to sample each pixel until its noise is below X, 0.01 is about 2.5 levels of 8 bit color");
+    puts("> Pass --budget=N to spend N samples per pixel on average and give more of them to the noisy pixels");
+    puts(">   with any of the two the samples per pixel of the scene are ignored, both can be combined");
+    puts(">   adaptive sampling traces each path on its own, --wavefront, --reorder-rays and --no-packets are ignored");
+    puts("> Pass --no-mesh-cache to always load meshes from the obj files and rebuild their trees");
+    puts("> Pass --bench-occlusion to compare closest hit and any hit queries instead of rendering");
     puts("");
 
+    bool usePackets = true;
+    bool benchmarkOcclusion = false;
+    bool useWavefront = false;
+    WavefrontSettings wavefront;
+    AdaptiveSettings adaptive;
+    const char *sceneArg = nullptr;
+    for (int c = 1; c < argc; c++) {
+        if (strncmp(argv[c], "--accel=", 8) == 0) {
+            const char *accelName = argv[c] + 8;
+            if (strcmp(accelName, "oct") == 0) {
+                setDefaultAcceleratorType(AcceleratorType::Oct);
+            } else if (strcmp(accelName, "kd") == 0) {
+                setDefaultAcceleratorType(AcceleratorType::KD);
+            } else if (strcmp(accelName, "bvh") == 0) {
+                setDefaultAcceleratorType(AcceleratorType::BVH);
+            } else if (strcmp(accelName, "bvh4") == 0) {
+                setDefaultAcceleratorType(AcceleratorType::BVH4);
+            } else if (strcmp(accelName, "bvh8") == 0) {
+                setDefaultAcceleratorType(AcceleratorType::BVH8);
+            } else if (strcmp(accelName, "wide") == 0) {
+                setDefaultAcceleratorType(bestWideBVHType());
+            } else {
+                printf("Unknown accelerator \"%s\", using the default\n", accelName);
+            }
+        } else if (strncmp(argv[c], "--sampler=", 10) == 0) {
+            const char *samplerName = argv[c] + 10;
+            if (strcmp(samplerName, "random") == 0) {
+                setSamplerType(SamplerType::Random);
+            } else if (strcmp(samplerName, "sobol") == 0) {
+                setSamplerType(SamplerType::Sobol);
+            } else if (strcmp(samplerName, "bluenoise") == 0) {
+                setSamplerType(SamplerType::BlueNoise);
+            } else {
+                printf("Unknown sampler \"%s\", using the default\n", samplerName);
+            }
+        } else if (strcmp(argv[c], "--no-packets") == 0) {
+            usePackets = false;
+        } else if (strcmp(argv[c], "--wavefront") == 0) {
+            useWavefront = true;
+        } else if (strncmp(argv[c], "--wavefront-queue=", 18) == 0) {
+            useWavefront = true;
+            wavefront.queueSize = std::max(atoi(argv[c] + 18), 1);
+        } else if (strncmp(argv[c], "--wavefront-batch=", 18) == 0) {
+            useWavefront = true;
+            wavefront.batchSize = std::max(atoi(argv[c] + 18), 1);
+        } else if (strcmp(argv[c], "--reorder-rays") == 0) {
+            useWavefront = true;
+            wavefront.reorderRays = true;
+        } else if (strncmp(argv[c], "--noise=", 8) == 0) {
+            adaptive.targetNoise = std::max(float(atof(argv[c] + 8)), 0.f);
+        } else if (strncmp(argv[c], "--budget=", 9) == 0) {
+            adaptive.sampleBudget = std::max(float(atof(argv[c] + 9)), 0.f);
+        } else if (strcmp(argv[c], "--no-mesh-cache") == 0) {
+            setMeshCacheEnabled(false);
+        } else if (strcmp(argv[c], "--bench-occlusion") == 0) {
+            benchmarkOcclusion = true;
+        } else {
+            sceneArg = argv[c];
+        }
+    }
+
+    if (adaptive.isEnabled() && (useWavefront || !usePackets)) {
+        puts("--wavefront, --reorder-rays and --no-packets have no effect with --noise or --budget");
+    }
+
     const int sceneCount = std::size(sceneCreators);
     int renderCount = sceneCount;
     int firstScene = 0;
-    if (argc == 1) {
+    if (!sceneArg) {
         renderCount = 1;
         puts("No arguments, will render only example scene");
     } else {
-        const int arg = atoi(argv[1]);
+        const int arg = atoi(sceneArg);
         if (arg == -1) {
             renderCount = sceneCount;
             firstScene = 0;
-        } else if (arg >= 1 && arg < sceneCount) {
+        } else if (arg >= 0 && arg < sceneCount) {
             firstScene = arg;
-            renderCount = sceneCount;
+            renderCount = 1;
         }
     }
 
@@ -234,14 +1129,25 @@ int main(int argc, char *argv[]) {
         const int sceneIndex = c + firstScene;
         Scene scene;
         printf("Loading scene...\n");
+        scene.loadThreads = &tm;
         sceneCreators[sceneIndex](scene);
+        scene.usePackets = usePackets;
+        scene.useWavefront = useWavefront;
+        scene.wavefront = wavefront;
+        scene.adaptive = adaptive;
         printf("Preparing \"%s\" scene...\n", scene.name.c_str());
-        scene.onBeforeRender();
+        scene.onBeforeRender(tm);
+        if (benchmarkOcclusion) {
+            scene.benchmarkOcclusion();
+            puts("");
+            continue;
+        }
         printf("Starting rendering\n");
         {
             Timer timer;
             scene.render(tm);
             printf("Render time: %gms\n", Timer::toMs<float>(timer.elapsedNs()));
+            scene.printBounceStats();
         }
         const std::string resultImage = scene.name + ".png";
         printf("Saving image to \"%s\"...\n", resultImage.c_str());